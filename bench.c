@@ -0,0 +1,648 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+benchmarks of the irrigation pipeline on synthetic inputs, nothing here talks to CIMIS or a broker:
+CIMIS responses from a week to several years (one or several stations, daily or hourly records) through
+the jansson and the streaming parsers, zone configurations from a few sections to 100k through the
+compiler, the mapped binary and the balance and demand kernels, and relay dispatch through the scheduler
+and the completion queue with an in-process stand-in for the MQTT round trip to the ESPs.
+Every result is one JSON object per line in the output file so runs can be diffed and plotted.
+
+usage: bench [--quick] [-o results.jsonl]
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <jansson.h>     // json parser for C, see https://jansson.readthedocs.io/en/latest/ for documentation
+
+#include "cimis_json.h"
+#include "cimis_stream.h"
+#include "scheduler.h"
+#include "completion.h"
+#include "zone_table.h"
+#include "zone_config.h"
+#include "relay_protocol.h"
+
+#define BENCH_RESULTS_FILE "bench_results.jsonl"
+#define BENCH_ZONE_JSON "bench_zones.json"
+#define BENCH_ZONE_BIN "bench_zones.bin"
+#define BENCH_FEED_CHUNK 16384     // bytes per cimis_stream_feed call, the size of a typical curl write
+#define BENCH_MAX_SCHED_ZONES 1000 // the scheduler scans every job per decision, bigger tables take minutes
+#define LOOPBACK_QUEUE 64
+#define LOOPBACK_PAYLOAD_LEN RELAY_FRAME_MAX
+
+typedef void (*bench_fn)(void *ctx);
+
+typedef struct bench_stats {
+    long calls;          // calls of the benchmarked function per batch
+    double min_ns;       // per call, best batch
+    double median_ns;    // per call, median batch
+} bench_stats;
+
+static FILE *results;
+static int quick;
+static uint64_t rng_state = 0x9E3779B97F4A7C15ull;   // fixed seed, every run benchmarks the same inputs
+
+
+static double now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+
+static uint32_t rng_next(void) {
+    /* xorshift64*, good enough for synthetic weather */
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (uint32_t)((rng_state * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+
+static float rng_float(float low, float high) {
+    return low + (high - low) * (rng_next() / 4294967296.f);
+}
+
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+
+static bench_stats bench_measure(bench_fn fn, void *ctx) {
+    /* grow the batch until it lasts long enough for the clock, then time several batches */
+    double target_ns = quick ? 2e6 : 2e7;
+    int repeats = quick ? 3 : 7;
+    double batch_ns[7];
+    bench_stats stats;
+
+    stats.calls = 1;
+    for (;;) {
+        double start = now_ns();
+        for (long c = 0; c < stats.calls; c++)
+            fn(ctx);
+        double elapsed = now_ns() - start;
+        if (elapsed >= target_ns || stats.calls >= (1L << 24))
+            break;
+        stats.calls *= elapsed < target_ns / 16 ? 8 : 2;
+    }
+
+    for (int r = 0; r < repeats; r++) {
+        double start = now_ns();
+        for (long c = 0; c < stats.calls; c++)
+            fn(ctx);
+        batch_ns[r] = (now_ns() - start) / stats.calls;
+    }
+    qsort(batch_ns, repeats, sizeof(double), compare_double);
+    stats.min_ns = batch_ns[0];
+    stats.median_ns = batch_ns[repeats / 2];
+    return stats;
+}
+
+
+static void bench_report(const char *name, const char *params, long items, size_t bytes, bench_stats stats) {
+    /* one JSON line per result, items are what the call processed (records, sections, commands) */
+    fprintf(results, "{\"bench\":\"%s\",%s,\"items\":%ld,\"bytes\":%zu,\"calls\":%ld,\"min_ns\":%.0f,\"median_ns\":%.0f,"
+        "\"ns_per_item\":%.2f,\"mb_per_s\":%.2f}\n", name, params, items, bytes, stats.calls, stats.min_ns, stats.median_ns,
+        items > 0 ? stats.median_ns / items : 0., bytes > 0 ? bytes / stats.median_ns * 1e3 : 0.);
+    fflush(results);
+    fprintf(stderr, "%-22s %-40s %12.0f ns %10.2f ns/item\n", name, params, stats.median_ns,
+        items > 0 ? stats.median_ns / items : 0.);
+}
+
+
+// ******************************** synthetic CIMIS responses ******************************** //
+
+typedef struct text_buffer {
+    char *data;
+    size_t size;
+    size_t capacity;
+} text_buffer;
+
+
+static void text_append(text_buffer *text, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+static void text_append(text_buffer *text, const char *format, ...) {
+    va_list args;
+
+    for (;;) {
+        va_start(args, format);
+        int length = vsnprintf(text->data + text->size, text->capacity - text->size, format, args);
+        va_end(args);
+        if (length < 0) {
+            fprintf(stderr, "error: cannot format the synthetic input\n");
+            exit(1);
+        }
+        if (text->size + length < text->capacity) {
+            text->size += length;
+            return;
+        }
+        text->capacity = (text->capacity + length) * 2;
+        text->data = realloc(text->data, text->capacity);
+        if (!text->data) {
+            fprintf(stderr, "error: out of memory for the synthetic input\n");
+            exit(1);
+        }
+    }
+}
+
+
+static text_buffer cimis_payload(int num_days, int num_stations, int hourly) {
+    /* the shape of a CIMIS data response, every station's records under the first provider */
+    text_buffer text = {NULL, 0, 0};
+    int32_t first_day = cimis_civil_to_day(2024, 1, 1);
+    static const char *station_ids[] = {"2", "80", "105", "206"};
+
+    text_append(&text, "{\"Data\":{\"Providers\":[{\"Name\":\"cimis\",\"Type\":\"station\",\"Owner\":\"water.ca.gov\",\"Records\":[");
+    for (int s = 0; s < num_stations; s++) {
+        for (int d = 0; d < num_days; d++) {
+            char date[16];
+            cimis_day_string(first_day + d, date, sizeof(date));
+
+            if (!hourly) {
+                text_append(&text, "%s{\"Date\":\"%s\",\"Julian\":\"%d\",\"Station\":\"%s\",\"Standard\":\"english\","
+                    "\"ZipCodes\":\"93624\",\"Scope\":\"daily\",\"DayAsceEto\":{\"Value\":\"%.2f\",\"Qc\":\" \",\"Unit\":\"(in)\"},"
+                    "\"DayPrecip\":{\"Value\":\"%.2f\",\"Qc\":\" \",\"Unit\":\"(in)\"}}",
+                    s + d == 0 ? "" : ",", date, d % 365 + 1, station_ids[s], rng_float(0.02f, 0.35f),
+                    rng_next() % 8 == 0 ? rng_float(0.f, 0.8f) : 0.f);
+                continue;
+            }
+            for (int h = 1; h <= 24; h++) {
+                text_append(&text, "%s{\"Date\":\"%s\",\"Julian\":\"%d\",\"Hour\":\"%02d00\",\"Station\":\"%s\",\"Standard\":\"english\","
+                    "\"ZipCodes\":\"93624\",\"Scope\":\"hourly\",\"HlyAsceEto\":{\"Value\":\"%.3f\",\"Qc\":\" \",\"Unit\":\"(in)\"},"
+                    "\"HlyPrecip\":{\"Value\":\"%.2f\",\"Qc\":\" \",\"Unit\":\"(in)\"}}",
+                    s + d + h == 1 ? "" : ",", date, d % 365 + 1, h, station_ids[s], rng_float(0.f, 0.03f),
+                    rng_next() % 64 == 0 ? rng_float(0.f, 0.1f) : 0.f);
+            }
+        }
+    }
+    text_append(&text, "]}]}}");
+    return text;
+}
+
+
+typedef struct parse_bench {
+    const text_buffer *payload;
+    int hourly;
+    long records;
+    float check;         // keeps the compiler from dropping the parse
+} parse_bench;
+
+
+static void bench_jansson_load(void *ctx) {
+    parse_bench *bench = (parse_bench *)ctx;
+    json_error_t error;
+
+    json_t *root = json_loadb(bench->payload->data, bench->payload->size, 0, &error);
+    if (!root) {
+        fprintf(stderr, "error: synthetic payload on line %d: %s\n", error.line, error.text);
+        exit(1);
+    }
+    bench->check += json_object_size(root);
+    json_decref(root);
+}
+
+
+static void bench_jansson_parse(void *ctx) {
+    /* the whole document parse the runner used before the streaming parser */
+    parse_bench *bench = (parse_bench *)ctx;
+    json_error_t error;
+
+    json_t *root = json_loadb(bench->payload->data, bench->payload->size, 0, &error);
+    cimis_results totals = parse_cimis_json(root);
+    bench->check += totals.Et0;
+    json_decref(root);
+}
+
+
+static int count_record(void *ctx, const char *station, int32_t day, const cimis_day *record) {
+    parse_bench *bench = (parse_bench *)ctx;
+    (void)station;
+    (void)day;
+    (void)record;
+    bench->records++;
+    return 0;
+}
+
+
+static void bench_stream_parse(void *ctx) {
+    /* fed in curl sized chunks, the way weather_update receives the response */
+    parse_bench *bench = (parse_bench *)ctx;
+    cimis_stream stream;
+
+    cimis_stream_init(&stream, count_record, bench, NULL);
+    for (size_t offset = 0; offset < bench->payload->size; offset += BENCH_FEED_CHUNK) {
+        size_t size = bench->payload->size - offset < BENCH_FEED_CHUNK ? bench->payload->size - offset : BENCH_FEED_CHUNK;
+        cimis_stream_feed(&stream, bench->payload->data + offset, size);
+    }
+    cimis_stream_finish(&stream);
+    bench->check += stream.total_eto;
+}
+
+
+static void run_cimis_benches(void) {
+    static const int day_counts[] = {7, 30, 365, 3 * 365};
+    int num_day_counts = quick ? 2 : 4;
+
+    for (int d = 0; d < num_day_counts; d++) {
+        for (int num_stations = 1; num_stations <= 4; num_stations += 3) {
+            for (int hourly = 0; hourly <= 1; hourly++) {
+                text_buffer payload = cimis_payload(day_counts[d], num_stations, hourly);
+                long num_records = (long)day_counts[d] * num_stations * (hourly ? 24 : 1);
+                parse_bench bench = {&payload, hourly, 0, 0.f};
+                char params[96];
+
+                snprintf(params, sizeof(params), "\"days\":%d,\"stations\":%d,\"scope\":\"%s\"",
+                    day_counts[d], num_stations, hourly ? "hourly" : "daily");
+
+                bench_report("cimis_jansson_load", params, num_records, payload.size, bench_measure(bench_jansson_load, &bench));
+                if (!hourly) {
+                    // parse_cimis_json and the stream parser only understand daily records, an hourly payload
+                    // would be timed skipping records it never parses
+                    bench_report("cimis_jansson_parse", params, num_records, payload.size, bench_measure(bench_jansson_parse, &bench));
+                    bench_report("cimis_stream_parse", params, num_records, payload.size, bench_measure(bench_stream_parse, &bench));
+                }
+                free(payload.data);
+            }
+        }
+    }
+}
+
+
+// ******************************** zone configurations ******************************** //
+
+static int write_zone_json(const char *path, int num_zones, int num_stations) {
+    /* irrigation_log.json with num_zones sections spread over 8-relay controllers and four sources */
+    static const char *station_ids[] = {"2", "80", "105", "206"};
+    FILE *json_file = fopen(path, "w");
+    if (json_file == NULL) {
+        fprintf(stderr, "error: cannot write %s\n", path);
+        return -1;
+    }
+
+    fprintf(json_file, "{\"Stations\": [");
+    for (int s = 0; s < num_stations; s++)
+        fprintf(json_file, "%s{\"Id\": \"%s\", \"Lat\": %.3f, \"Lon\": %.3f}", s ? ", " : "", station_ids[s],
+            rng_float(36.f, 37.f), rng_float(-120.5f, -119.5f));
+    fprintf(json_file, "],\n \"Sources\": [");
+    for (int s = 0; s < 4; s++)
+        fprintf(json_file, "%s{\"Name\": \"source %d\", \"MaxGPH\": %.1f}", s ? ", " : "", s, rng_float(10.f, 40.f));
+    fprintf(json_file, "],\n \"Data\": [\n");
+    for (int i = 0; i < num_zones; i++) {
+        fprintf(json_file, "%s{\"Name\": \"section %d\", \"PF\": \"%.1f\", \"LA\": %d, \"RootDepth\": %.1f, \"AWC\": 0.15, \"MAD\": 0.5, "
+            "\"Date\": \"2024-10-28 00:00:00\", \"Gallons\": \"3.0\", \"numEmitters\": %d, \"EmitterGPH\": 1.0, \"Source\": \"source %d\", "
+            "\"Controller\": %d, \"Relay\": %d, \"Lat\": %.3f, \"Lon\": %.3f}", i ? ",\n" : "", i, rng_float(0.3f, 1.f),
+            (int)(rng_next() % 40) + 4, rng_float(6.f, 24.f), (int)(rng_next() % 8) + 1, i % 4, i / 8 + 1, i % 8 + 1,
+            rng_float(36.f, 37.f), rng_float(-120.5f, -119.5f));
+    }
+    fprintf(json_file, "\n]}\n");
+
+    if (fclose(json_file) != 0) {
+        fprintf(stderr, "error: cannot write %s\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+
+typedef struct zone_bench {
+    int num_zones;
+    zone_config config;
+    zone_table table;
+    json_t *json_zones;          // the Data array of the JSON, for the field by field path
+    irrigation_job *jobs;
+    int num_jobs;
+    water_source sources[MAX_WATER_SOURCES];
+    int num_sources;
+    float check;
+} zone_bench;
+
+
+static void bench_config_compile(void *ctx) {
+    (void)ctx;
+    if (zone_config_compile(BENCH_ZONE_JSON, BENCH_ZONE_BIN, "2", NULL) != 0)
+        exit(1);
+}
+
+
+static void bench_config_open(void *ctx) {
+    zone_bench *bench = (zone_bench *)ctx;
+    zone_config config;
+
+    if (zone_config_open(&config, BENCH_ZONE_JSON, BENCH_ZONE_BIN, "2", NULL) != 0)
+        exit(1);
+    bench->check += config.num_zones;
+    zone_config_close(&config);
+}
+
+
+static void bench_json_fields(void *ctx) {
+    /* the per section jansson lookups every run did before the configuration was compiled */
+    zone_bench *bench = (zone_bench *)ctx;
+
+    for (int i = 0; i < bench->num_zones; i++) {
+        json_t *zone = json_array_get(bench->json_zones, i);
+        float PF = strtof(get_json_string("PF", zone), NULL);
+        long LA = get_json_long("LA", zone);
+        double emitter_gph = get_json_double("EmitterGPH", zone);
+        long num_emitters = get_json_long("numEmitters", zone);
+        bench->check += PF * LA + emitter_gph * num_emitters;
+    }
+}
+
+
+static void bench_table_fill(void *ctx) {
+    /* the copy of the mapped records into the zone table, as run_irrigation does it */
+    zone_bench *bench = (zone_bench *)ctx;
+    zone_table *table = &bench->table;
+
+    for (int i = 0; i < bench->num_zones; i++) {
+        const zone_config_zone *record = &bench->config.zones[i];
+
+        table->name[i] = record->name;
+        table->relay_num[i] = record->relay_num;
+        table->controller_num[i] = record->controller_num;
+        table->flow_gph[i] = record->flow_gph;
+        table->source[i] = record->source;
+        table->PF[i] = record->PF;
+        table->LA[i] = record->LA;
+        table->taw[i] = record->root_depth * record->awc * record->LA * INCHES_TO_GALLONS_PER_FT2;
+        table->mad[i] = record->mad;
+        table->last_day[i] = 0;
+        table->depletion[i] = 0.f;
+    }
+}
+
+
+static void bench_balance_kernel(void *ctx) {
+    zone_bench *bench = (zone_bench *)ctx;
+    zone_balance_kernel(&bench->table);
+}
+
+
+static void bench_demand_kernel(void *ctx) {
+    zone_bench *bench = (zone_bench *)ctx;
+    zone_demand_kernel(&bench->table);
+    bench->check += bench->table.runtime_ms[0];
+}
+
+
+static void bench_schedule(void *ctx) {
+    /* the whole dispatch plan against a virtual clock */
+    zone_bench *bench = (zone_bench *)ctx;
+    bench->check += scheduler_estimate_ms(bench->jobs, bench->num_jobs, bench->sources, bench->num_sources);
+}
+
+
+static void run_zone_benches(void) {
+    static const int zone_counts[] = {5, 100, 10000, 100000};
+    int num_zone_counts = quick ? 3 : 4;
+
+    for (int z = 0; z < num_zone_counts; z++) {
+        for (int num_stations = 1; num_stations <= 4; num_stations += 3) {
+            zone_bench bench;
+            json_error_t error;
+            char params[64];
+            int num_zones = zone_counts[z];
+
+            memset(&bench, 0, sizeof(bench));
+            bench.num_zones = num_zones;
+            snprintf(params, sizeof(params), "\"zones\":%d,\"stations\":%d", num_zones, num_stations);
+
+            if (write_zone_json(BENCH_ZONE_JSON, num_zones, num_stations) != 0)
+                exit(1);
+            bench_report("zone_config_compile", params, num_zones, 0, bench_measure(bench_config_compile, &bench));
+            bench_report("zone_config_open", params, num_zones, 0, bench_measure(bench_config_open, &bench));
+
+            json_t *root = json_load_file(BENCH_ZONE_JSON, 0, &error);
+            if (!root) {
+                fprintf(stderr, "error: %s on line %d: %s\n", BENCH_ZONE_JSON, error.line, error.text);
+                exit(1);
+            }
+            bench.json_zones = json_object_get(root, "Data");
+            bench_report("zone_json_fields", params, num_zones, 0, bench_measure(bench_json_fields, &bench));
+            json_decref(root);
+
+            if (zone_config_open(&bench.config, BENCH_ZONE_JSON, BENCH_ZONE_BIN, "2", NULL) != 0 || zone_table_init(&bench.table, num_zones) != 0)
+                exit(1);
+            bench_report("zone_table_fill", params, num_zones, 0, bench_measure(bench_table_fill, &bench));
+
+            // a summer day of weather, the depletion settles at taw after enough calls which is still a full pass
+            for (int i = 0; i < num_zones; i++) {
+                bench.table.eto[i] = rng_float(0.1f, 0.35f);
+                bench.table.precip[i] = rng_next() % 8 == 0 ? rng_float(0.f, 0.5f) : 0.f;
+            }
+            bench_report("zone_balance_kernel", params, num_zones, 0, bench_measure(bench_balance_kernel, &bench));
+            bench_report("zone_demand_kernel", params, num_zones, 0, bench_measure(bench_demand_kernel, &bench));
+
+            if (num_zones <= (quick ? 100 : BENCH_MAX_SCHED_ZONES)) {
+                bench.num_sources = zone_config_sources(&bench.config, bench.sources);
+                bench.jobs = malloc(num_zones * sizeof(irrigation_job) + 1);
+                for (int i = 0; i < num_zones; i++) {
+                    irrigation_job *job = &bench.jobs[bench.num_jobs++];
+                    job->section = i;
+                    job->controller_num = bench.table.controller_num[i];
+                    job->relay_num = bench.table.relay_num[i];
+                    job->source = bench.table.source[i];
+                    job->flow_gph = bench.table.flow_gph[i];
+                    job->duration_ms = (long)bench.table.runtime_ms[i] + 60000;
+                }
+                bench_report("scheduler_estimate", params, bench.num_jobs, 0, bench_measure(bench_schedule, &bench));
+                free(bench.jobs);
+            }
+
+            zone_table_free(&bench.table);
+            zone_config_close(&bench.config);
+        }
+    }
+    remove(BENCH_ZONE_JSON);
+    remove(BENCH_ZONE_BIN);
+}
+
+
+// ******************************** relay dispatch over a loopback broker ******************************** //
+
+// stands in for mosquitto and the ESPs: published commands go into a queue, a responder thread plays the
+// controller and answers each with its done frame, which goes through the runner's ack parsing
+typedef struct loopback_broker {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    char payloads[LOOPBACK_QUEUE][LOOPBACK_PAYLOAD_LEN];
+    long controllers[LOOPBACK_QUEUE];
+    int head;
+    int count;
+    int closed;
+    completion_queue *acks;
+    pthread_t responder;
+} loopback_broker;
+
+
+static void loopback_publish(loopback_broker *broker, long controller_num, const char *payload) {
+    pthread_mutex_lock(&broker->lock);
+    while (broker->count == LOOPBACK_QUEUE)
+        pthread_cond_wait(&broker->ready, &broker->lock);
+    int slot = (broker->head + broker->count) % LOOPBACK_QUEUE;
+    snprintf(broker->payloads[slot], LOOPBACK_PAYLOAD_LEN, "%s", payload);
+    broker->controllers[slot] = controller_num;
+    broker->count++;
+    pthread_cond_broadcast(&broker->ready);
+    pthread_mutex_unlock(&broker->lock);
+}
+
+
+static void *loopback_respond(void *arg) {
+    loopback_broker *broker = (loopback_broker *)arg;
+    char command[LOOPBACK_PAYLOAD_LEN], ack[LOOPBACK_PAYLOAD_LEN];
+
+    for (;;) {
+        pthread_mutex_lock(&broker->lock);
+        while (broker->count == 0 && !broker->closed)
+            pthread_cond_wait(&broker->ready, &broker->lock);
+        if (broker->count == 0) {
+            pthread_mutex_unlock(&broker->lock);
+            return NULL;
+        }
+        memcpy(command, broker->payloads[broker->head], LOOPBACK_PAYLOAD_LEN);
+        long controller_num = broker->controllers[broker->head];
+        broker->head = (broker->head + 1) % LOOPBACK_QUEUE;
+        broker->count--;
+        pthread_cond_broadcast(&broker->ready);
+        pthread_mutex_unlock(&broker->lock);
+
+        // the ESP side: a one section schedule frame in, its done frame back out the moment the relay is switched
+        unsigned long command_id;
+        long relay_num, duration_ms, offset_ms;
+        relay_done done;
+        if (sscanf(command, "IR%*d %*d S %*d %lu %ld %ld %ld;", &command_id, &relay_num, &duration_ms, &offset_ms) != 4)
+            continue;
+        int length = relay_format_done(ack, sizeof(ack), controller_num, command_id, relay_num);
+
+        // the runner side, the same parsing as on_message
+        if (relay_parse_done(ack, length, &done) == 0)
+            completion_post(broker->acks, done.controller_num, done.relay_num, done.command_id);
+    }
+}
+
+
+typedef struct dispatch_bench {
+    loopback_broker *broker;
+    completion_queue *acks;
+    int num_commands;
+    int in_flight;       // commands published before waiting on the first ack
+    int num_controllers;
+} dispatch_bench;
+
+
+static void bench_dispatch(void *ctx) {
+    /* publish num_commands relay commands and wait for every ack, with up to in_flight outstanding */
+    dispatch_bench *bench = (dispatch_bench *)ctx;
+    int outstanding = 0, tag;
+    long latency_ms;
+    char payload[RELAY_FRAME_MAX];
+    relay_frame frame;
+
+    for (int c = 0; c < bench->num_commands; c++) {
+        // one relay per controller at a time
+        long controller_num = c % bench->num_controllers + 1;
+        long relay_num = (c / bench->num_controllers) % 8;
+
+        if (outstanding == bench->in_flight) {
+            completion_wait(bench->acks, &tag, &latency_ms);
+            outstanding--;
+        }
+        completion_expect(bench->acks, controller_num, relay_num, c + 1, monotonic_ms() + 10000, c);
+        relay_frame_schedule(&frame, controller_num);
+        relay_frame_add(&frame, c + 1, relay_num, 60000, 0);
+        relay_frame_finish(&frame, payload);
+        loopback_publish(bench->broker, controller_num, payload);
+        outstanding++;
+    }
+    while (outstanding > 0 && completion_wait(bench->acks, &tag, &latency_ms) != COMPLETION_EMPTY)
+        outstanding--;
+}
+
+
+static void run_dispatch_benches(void) {
+    loopback_broker broker;
+    completion_queue acks;
+
+    memset(&broker, 0, sizeof(broker));
+    if (completion_init(&acks, 16) != 0)
+        exit(1);
+    pthread_mutex_init(&broker.lock, NULL);
+    pthread_cond_init(&broker.ready, NULL);
+    broker.acks = &acks;
+    pthread_create(&broker.responder, NULL, loopback_respond, &broker);
+
+    static const int controller_counts[] = {1, 8};
+    for (int k = 0; k < 2; k++) {
+        // today's one command at a time and a controller per relay in flight
+        dispatch_bench bench = {&broker, &acks, 1000, controller_counts[k], controller_counts[k]};
+        char params[64];
+
+        snprintf(params, sizeof(params), "\"controllers\":%d,\"in_flight\":%d", bench.num_controllers, bench.in_flight);
+        bench_report("relay_dispatch", params, bench.num_commands, 0, bench_measure(bench_dispatch, &bench));
+    }
+
+    pthread_mutex_lock(&broker.lock);
+    broker.closed = 1;
+    pthread_cond_broadcast(&broker.ready);
+    pthread_mutex_unlock(&broker.lock);
+    pthread_join(broker.responder, NULL);
+    pthread_mutex_destroy(&broker.lock);
+    pthread_cond_destroy(&broker.ready);
+    completion_destroy(&acks);
+}
+
+
+int main(int argc, char *argv[]) {
+    const char *results_path = BENCH_RESULTS_FILE;
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--quick") == 0) {
+            quick = 1;
+        } else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) {
+            results_path = argv[++a];
+        } else {
+            fprintf(stderr, "usage: %s [--quick] [-o results.jsonl]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    results = fopen(results_path, "w");
+    if (results == NULL) {
+        fprintf(stderr, "error: cannot write %s\n", results_path);
+        return 1;
+    }
+    fprintf(results, "{\"bench\":\"meta\",\"compiler\":\"%s\",\"zone_lanes\":%d,\"quick\":%d}\n", __VERSION__, ZONE_LANES, quick);
+
+    run_cimis_benches();
+    run_zone_benches();
+    run_dispatch_benches();
+
+    fclose(results);
+    fprintf(stderr, "results written to %s\n", results_path);
+    return 0;
+}
@@ -0,0 +1,168 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cimis_json.h"
+
+
+static int newline_offset(const char *text) {
+    /* Return the offset of the first newline in text or the length of
+   text if there's no newline */
+    const char *newline = strchr(text, '\n');
+    if(!newline)
+        return strlen(text);
+    else
+        return (int)(newline - text);
+}
+
+
+cimis_results parse_cimis_json(json_t *json_root){
+    // to check what type it actually is, go to https://jansson.readthedocs.io/en/2.8/apiref.html#c.json_type
+    // and check typeof (it's an int and the types are listed in order)
+
+    // obtain the Eto values for each day requested to CIMIS
+    json_t *Data, *Providers, *get_records, *Records;
+    const char *eto_value, *precip_value; // values adding up the total precipitation and ETo over specified range
+    cimis_results cimis_out;
+
+    int error_count = 0;
+    float total_precipitation = 0.0; 
+    float total_eto = 0.0;
+
+    Data = json_object_get(json_root, "Data");
+    // Data has to be an object
+    if (!json_is_object(Data)) {
+        // fprintf(stderr, "error: Data is not an object\n");
+        // printf("    Data is a(n) %d\n", json_typeof(json_root));
+        error_count++;
+    } 
+    Providers = json_object_get(Data, "Providers");
+    if (!json_is_array(Providers)) {
+        // fprintf(stderr, "error: Providers is not an array\n");
+        // printf("    is Providers is an array? (1==yes) %d\n", json_is_array(Providers));
+        error_count++; 
+    } 
+    get_records = json_array_get(Providers, 0);
+    if (!json_is_object(get_records)) {
+        error_count++;  
+    } 
+    Records = json_object_get(get_records, "Records");
+    if (!json_is_array(Records)) {
+        error_count++; 
+    }
+    // else {
+    //     printf("The number of days being analyzed is %lu days\n", json_array_size(Records));
+    // }
+
+    for (size_t i = 0; i < json_array_size(Records); i++) {
+        json_t *get_daydata, *DayAsceEto, *EToValue, *DayPrecip, *PrecipValue;
+
+        get_daydata = json_array_get(Records, i);
+        if (!json_is_object(get_daydata)) {
+            error_count++;  
+        } 
+        DayAsceEto = json_object_get(get_daydata, "DayAsceEto");
+        if (!json_is_object(DayAsceEto)) {
+            error_count++; 
+        } 
+        EToValue = json_object_get(DayAsceEto, "Value");
+        if (!json_is_string(EToValue)) {
+            error_count++; 
+        } 
+
+        eto_value = json_string_value(EToValue);
+            // printf("%.8s %.*s\n", json_string_value(Providers), newline_offset(eto_value),
+            //     eto_value);
+        total_eto = total_eto + strtof(eto_value, NULL);
+
+        // *************** get the Precipitation data for the day *************** //
+        DayPrecip = json_object_get(get_daydata, "DayPrecip");
+        if (!json_is_object(DayPrecip)) {
+            error_count++; 
+        }
+
+        PrecipValue = json_object_get(DayPrecip, "Value");
+        if (json_is_null(PrecipValue)) { 
+            // precipitation could be null, just set as zero for now (likely that they don't have the data for the whole day so they provide null)
+            // precip_value = json_string_value(PrecipValue);
+            printf("Precipitation value for the day is null (probably the last day if only one message appears!)\n");
+        } else if (!json_is_string(PrecipValue)) {
+            // fprintf(stderr, "error: PrecipValue is not a string\n");
+            // printf("    PrecipValue is a(n) %d\n", json_typeof(PrecipValue));
+            error_count++; 
+        } else {
+            precip_value = json_string_value(PrecipValue);
+            // printf("%.8s %.*s\n", json_string_value(Providers), newline_offset(precip_value),
+            // precip_value);
+            total_precipitation = total_precipitation + strtof(precip_value, NULL);
+        }
+   
+    }
+
+    cimis_out.parse_errors = error_count;
+    cimis_out.Et0 = total_eto;
+    cimis_out.precip = total_precipitation;
+
+    return cimis_out;
+}
+
+
+const char * get_json_string(char *Val, json_t *json_data){
+    json_t *getVal;
+
+    getVal = json_object_get(json_data, Val);
+    if (!json_is_string(getVal)) {
+        printf("Is this not a String?\n");
+        printf("    getVal is a(n) %d\n", json_typeof(getVal));
+    }
+
+    return json_string_value(getVal);
+}
+
+
+long get_json_long(char *Val, json_t *json_data){
+    json_t *getVal;
+    long value;
+
+    getVal = json_object_get(json_data, Val); // obtain the int val from JSON data
+    value = json_integer_value(getVal);       // convert to an int/long
+    if (value == 0) {
+        printf("Either the return is zero (offline controllers or relays) or json is not an int?\n");
+        // printf("    getVal is a(n) %d\n", json_typeof(getVal));
+    }
+
+    return value;
+}
+
+
+double get_json_double(char *Val, json_t *json_data){
+    json_t *getVal;
+    double value;
+
+    getVal = json_object_get(json_data, Val); // obtain the int val from JSON data
+    value = json_real_value(getVal);       // convert to an int/long
+    if (value == 0.) {
+        printf("Either the return is zero or json is not an int\n");
+        // printf("    getVal is a(n) %d\n", json_typeof(getVal));
+    }
+
+    return value;
+}
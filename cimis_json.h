@@ -0,0 +1,37 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+whole document CIMIS parsing with jansson and the json field helpers, shared by the irrigation runner
+and the benchmarks
+*/
+
+#ifndef CIMIS_JSON_H
+#define CIMIS_JSON_H
+
+#include <jansson.h>     // json parser for C, see https://jansson.readthedocs.io/en/latest/ for documentation
+
+#include "cimis_store.h"
+
+// total ETo and precipitation of every daily record in a parsed CIMIS response
+cimis_results parse_cimis_json(json_t *json_root);
+
+const char * get_json_string(char *Val, json_t *json_data);
+long get_json_long(char *Val, json_t *json_data);
+double get_json_double(char *Val, json_t *json_data);
+
+#endif
@@ -0,0 +1,268 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cimis_store.h"
+
+static const char store_magic[4] = {'C', 'I', 'M', 'S'};
+
+// on-disk header, the records follow it directly (native byte order, the store is a local cache)
+typedef struct cimis_store_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    int32_t first_day;
+    int32_t num_days;
+    char station[CIMIS_STATION_LEN];
+} cimis_store_header;
+
+
+int32_t cimis_civil_to_day(int year, int month, int day) {
+    /* days since 1970-01-01 in the proleptic Gregorian calendar, no time zones or DST involved
+       (Howard Hinnant's days_from_civil) */
+    year -= month <= 2;
+    int32_t era = (year >= 0 ? year : year - 399) / 400;
+    int32_t year_of_era = year - era * 400;
+    int32_t day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int32_t day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    return era * 146097 + day_of_era - 719468;
+}
+
+
+int32_t cimis_epoch_day(const char *date) {
+    int year, month, day;
+
+    if (!date || sscanf(date, "%4d-%2d-%2d", &year, &month, &day) != 3)
+        return -1;
+    if (month < 1 || month > 12 || day < 1 || day > 31)
+        return -1;
+    return cimis_civil_to_day(year, month, day);
+}
+
+
+void cimis_day_string(int32_t day, char *buffer, size_t size) {
+    /* inverse of cimis_civil_to_day (Howard Hinnant's civil_from_days) */
+    day += 719468;
+    int32_t era = (day >= 0 ? day : day - 146096) / 146097;
+    int32_t day_of_era = day - era * 146097;
+    int32_t year_of_era = (day_of_era - day_of_era / 1460 + day_of_era / 36524 - day_of_era / 146096) / 365;
+    int32_t day_of_year = day_of_era - (365 * year_of_era + year_of_era / 4 - year_of_era / 100);
+    int32_t mp = (5 * day_of_year + 2) / 153;
+    int month = mp < 10 ? mp + 3 : mp - 9;
+    int year = year_of_era + era * 400 + (month <= 2);
+
+    snprintf(buffer, size, "%04d-%02d-%02d", year, month, (int)(day_of_year - (153 * mp + 2) / 5 + 1));
+}
+
+
+int cimis_store_open(cimis_store *store, const char *station) {
+    cimis_store_header header;
+
+    memset(store, 0, sizeof(cimis_store));
+    snprintf(store->station, CIMIS_STATION_LEN, "%s", station);
+    snprintf(store->path, sizeof(store->path), "cimis_%s.dat", station);
+
+    FILE *store_file = fopen(store->path, "rb");
+    if (store_file == NULL) {
+        // first run for this station, nothing stored yet
+        return 0;
+    }
+
+    if (fread(&header, sizeof(header), 1, store_file) != 1 || memcmp(header.magic, store_magic, 4) != 0
+            || header.version != CIMIS_STORE_VERSION || header.record_size != sizeof(cimis_day) || header.num_days < 0) {
+        fprintf(stderr, "error: %s is not a version %d CIMIS store\n", store->path, CIMIS_STORE_VERSION);
+        fclose(store_file);
+        return -1;
+    }
+
+    store->days = malloc(header.num_days * sizeof(cimis_day) + 1);
+    if (!store->days || fread(store->days, sizeof(cimis_day), header.num_days, store_file) != (size_t)header.num_days) {
+        fprintf(stderr, "error: %s is truncated\n", store->path);
+        free(store->days);
+        store->days = NULL;
+        fclose(store_file);
+        return -1;
+    }
+    fclose(store_file);
+
+    store->first_day = header.first_day;
+    store->num_days = header.num_days;
+    store->capacity = header.num_days;
+    return 0;
+}
+
+
+int cimis_store_save(cimis_store *store) {
+    /* write to a temporary file and rename it over the store so a crash never leaves half a file */
+    cimis_store_header header;
+    char tmp_path[80];
+
+    if (!store->dirty)
+        return 0;
+
+    memcpy(header.magic, store_magic, 4);
+    header.version = CIMIS_STORE_VERSION;
+    header.record_size = sizeof(cimis_day);
+    header.first_day = store->first_day;
+    header.num_days = store->num_days;
+    memset(header.station, 0, CIMIS_STATION_LEN);
+    snprintf(header.station, CIMIS_STATION_LEN, "%s", store->station);
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", store->path);
+    FILE *store_file = fopen(tmp_path, "wb");
+    if (store_file == NULL) {
+        fprintf(stderr, "error: cannot write %s\n", tmp_path);
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, store_file) != 1
+            || fwrite(store->days, sizeof(cimis_day), store->num_days, store_file) != (size_t)store->num_days) {
+        fprintf(stderr, "error: cannot write %s\n", tmp_path);
+        fclose(store_file);
+        remove(tmp_path);
+        return -1;
+    }
+    if (fclose(store_file) != 0 || rename(tmp_path, store->path) != 0) {
+        fprintf(stderr, "error: cannot replace %s\n", store->path);
+        remove(tmp_path);
+        return -1;
+    }
+
+    store->dirty = 0;
+    return 0;
+}
+
+
+void cimis_store_close(cimis_store *store) {
+    free(store->days);
+    store->days = NULL;
+    store->num_days = 0;
+    store->capacity = 0;
+}
+
+
+int cimis_store_copy(cimis_store *copy, const cimis_store *store, const log_streams *log) {
+    *copy = *store;
+    // calloc: put() extends num_days over the spare capacity, days never written there must read as not present
+    copy->days = calloc(store->capacity + 1, sizeof(cimis_day));
+    if (!copy->days) {
+        fprintf(LOG_ERR(log), "error: unable to copy the CIMIS store of station %s\n", store->station);
+        copy->capacity = copy->num_days = 0;
+        return -1;
+    }
+    memcpy(copy->days, store->days, store->num_days * sizeof(cimis_day));
+    return 0;
+}
+
+
+int cimis_store_put(cimis_store *store, int32_t day, const cimis_day *record) {
+    if (store->num_days == 0) {
+        store->first_day = day;
+    }
+
+    int32_t new_first = day < store->first_day ? day : store->first_day;
+    int32_t new_end = (day >= store->first_day + store->num_days) ? day + 1 : store->first_day + store->num_days;
+    int32_t new_num = new_end - new_first;
+
+    if (new_num > store->capacity || new_first != store->first_day) {
+        // grow by at least a month at a time, days that were never returned stay zeroed (not present)
+        int32_t new_capacity = new_num > store->capacity + 31 ? new_num : store->capacity + 31;
+        cimis_day *new_days = calloc(new_capacity, sizeof(cimis_day));
+        if (!new_days)
+            return -1;
+        if (store->num_days > 0)
+            memcpy(new_days + (store->first_day - new_first), store->days, store->num_days * sizeof(cimis_day));
+        free(store->days);
+        store->days = new_days;
+        store->capacity = new_capacity;
+        store->first_day = new_first;
+    }
+
+    store->num_days = new_num;
+    store->days[day - store->first_day] = *record;
+    store->dirty = 1;
+    return 0;
+}
+
+
+const cimis_day *cimis_store_get(const cimis_store *store, int32_t day) {
+    if (day < store->first_day || day >= store->first_day + store->num_days)
+        return NULL;
+    if (!(store->days[day - store->first_day].flags & CIMIS_DAY_PRESENT))
+        return NULL;
+    return &store->days[day - store->first_day];
+}
+
+
+static int needs_fetch(const cimis_store *store, int32_t day, int32_t end_day) {
+    const cimis_day *record = cimis_store_get(store, day);
+
+    if (!record)
+        return 1;
+    // CIMIS fills in the most recent days late (e.g. precipitation is null for the last day), ask again for those
+    if (day > end_day - CIMIS_REFETCH_DAYS && (record->flags & (CIMIS_DAY_ETO_VALID | CIMIS_DAY_PRECIP_VALID)) != (CIMIS_DAY_ETO_VALID | CIMIS_DAY_PRECIP_VALID))
+        return 1;
+    return 0;
+}
+
+
+int cimis_store_missing(const cimis_store *store, int32_t start_day, int32_t end_day, int32_t *first_missing, int32_t *last_missing) {
+    int count = 0;
+
+    *first_missing = -1;
+    *last_missing = -1;
+    for (int32_t day = start_day; day <= end_day; day++) {
+        if (needs_fetch(store, day, end_day)) {
+            if (count == 0)
+                *first_missing = day;
+            *last_missing = day;
+            count++;
+        }
+    }
+    return count;
+}
+
+
+cimis_results cimis_store_window(const cimis_store *store, int32_t start_day, int32_t end_day, const log_streams *log) {
+    cimis_results cimis_out = {.Et0 = 0., .precip = 0., .parse_errors = 0};
+
+    for (int32_t day = start_day; day <= end_day; day++) {
+        const cimis_day *record = cimis_store_get(store, day);
+        char date_buffer[16];
+
+        if (!record || !(record->flags & CIMIS_DAY_ETO_VALID)) {
+            cimis_day_string(day, date_buffer, sizeof(date_buffer));
+            fprintf(LOG_ERR(log), "error: no ETo stored for station %s on %s\n", store->station, date_buffer);
+            cimis_out.parse_errors++;
+            continue;
+        }
+        cimis_out.Et0 += record->eto;
+
+        if (record->flags & CIMIS_DAY_PRECIP_VALID) {
+            cimis_out.precip += record->precip;
+        } else {
+            // precipitation could be null, just set as zero for now (likely that they don't have the data for the whole day so they provide null)
+            cimis_day_string(day, date_buffer, sizeof(date_buffer));
+            fprintf(LOG_OUT(log), "Precipitation value for %s is null (probably the last day if only one message appears!)\n", date_buffer);
+        }
+    }
+
+    return cimis_out;
+}
@@ -0,0 +1,92 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+local per-day store of CIMIS daily records (ETo, precipitation and their QC flags) for one station,
+saved as cimis_<station>.dat: a small header followed by one fixed size record per day indexed by
+the day number since 1970-01-01, so a year of history is ~4 KB and looking up a day is an array index.
+Only the days that are missing from the store have to be requested from CIMIS.
+*/
+
+#ifndef CIMIS_STORE_H
+#define CIMIS_STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "log_streams.h"
+
+#define CIMIS_STORE_VERSION 1
+#define CIMIS_STATION_LEN 16
+
+// how many of the most recent days are requested again while their values are still incomplete (e.g. null precipitation)
+#define CIMIS_REFETCH_DAYS 3
+
+enum {
+    CIMIS_DAY_PRESENT = 0x1,       // CIMIS returned a record for the day
+    CIMIS_DAY_ETO_VALID = 0x2,     // DayAsceEto had a value
+    CIMIS_DAY_PRECIP_VALID = 0x4,  // DayPrecip had a value
+};
+
+typedef struct cimis_results {
+    float Et0;
+    float precip;
+    int parse_errors;   // will save how many json types were incorrect (or days were missing from the store)
+} cimis_results;
+
+typedef struct cimis_day {
+    float eto;           // in inches, DayAsceEto
+    float precip;        // in inches, DayPrecip
+    char eto_qc;         // CIMIS QC flag, ' ' when the value passed all checks
+    char precip_qc;
+    uint8_t flags;       // CIMIS_DAY_* bits
+    uint8_t reserved;
+} cimis_day;
+
+typedef struct cimis_store {
+    char station[CIMIS_STATION_LEN];
+    char path[64];
+    int32_t first_day;   // day number of days[0]
+    int32_t num_days;
+    int32_t capacity;
+    cimis_day *days;
+    int dirty;           // set when days were added since the last save
+} cimis_store;
+
+// day number since 1970-01-01 of a "YYYY-MM-DD" date string, -1 if it doesn't parse
+int32_t cimis_epoch_day(const char *date);
+int32_t cimis_civil_to_day(int year, int month, int day);
+// format a day number as "YYYY-MM-DD" like the CIMIS startDate/endDate parameters
+void cimis_day_string(int32_t day, char *buffer, size_t size);
+
+// loads cimis_<station>.dat if it exists, an empty store otherwise; returns -1 on a corrupt or unreadable file
+int cimis_store_open(cimis_store *store, const char *station);
+int cimis_store_save(cimis_store *store);
+void cimis_store_close(cimis_store *store);
+// a copy of store with its own days, to be closed separately; -1 if it can't be allocated
+int cimis_store_copy(cimis_store *copy, const cimis_store *store, const log_streams *log);
+
+int cimis_store_put(cimis_store *store, int32_t day, const cimis_day *record);
+const cimis_day *cimis_store_get(const cimis_store *store, int32_t day);
+
+// number of days in [start_day, end_day] that still have to be requested, and the range that covers them
+int cimis_store_missing(const cimis_store *store, int32_t start_day, int32_t end_day, int32_t *first_missing, int32_t *last_missing);
+
+// total ETo and precipitation over [start_day, end_day] from the local records, the missing days are reported to log
+cimis_results cimis_store_window(const cimis_store *store, int32_t start_day, int32_t end_day, const log_streams *log);
+
+#endif
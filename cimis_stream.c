@@ -0,0 +1,253 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cimis_stream.h"
+
+enum { LEX_VALUE = 0, LEX_STRING, LEX_LITERAL };
+enum { TOKEN_STRING = 0, TOKEN_LITERAL };
+
+
+void cimis_stream_init(cimis_stream *stream, cimis_record_callback on_record, void *ctx, const log_streams *log) {
+    memset(stream, 0, sizeof(cimis_stream));
+    stream->lex_state = LEX_VALUE;
+    stream->on_record = on_record;
+    stream->ctx = ctx;
+    stream->log = log;
+}
+
+
+static void fail(cimis_stream *stream, const char *why) {
+    fprintf(LOG_ERR(stream->log), "error: CIMIS response is not valid JSON (%s)\n", why);
+    stream->parse_errors++;
+    stream->stopped = 1;
+}
+
+
+static void start_record(cimis_stream *stream) {
+    memset(stream->date, 0, sizeof(stream->date));
+    memset(stream->station, 0, sizeof(stream->station));
+    memset(&stream->record, 0, sizeof(cimis_day));
+    stream->record.eto_qc = ' ';
+    stream->record.precip_qc = ' ';
+}
+
+
+static void end_record(cimis_stream *stream) {
+    int32_t day = cimis_epoch_day(stream->date);
+
+    if (day < 0) {
+        fprintf(LOG_ERR(stream->log), "error: CIMIS record without a Date, skipping it\n");
+        stream->parse_errors++;
+        return;
+    }
+
+    stream->record.flags |= CIMIS_DAY_PRESENT;
+    if (stream->record.flags & CIMIS_DAY_ETO_VALID)
+        stream->total_eto += stream->record.eto;
+    if (stream->record.flags & CIMIS_DAY_PRECIP_VALID)
+        stream->total_precip += stream->record.precip;
+    stream->num_records++;
+
+    if (stream->on_record && stream->on_record(stream->ctx, stream->station, day, &stream->record) != 0)
+        stream->stopped = 1;
+}
+
+
+static void push_frame(cimis_stream *stream, int is_object) {
+    if (stream->depth >= CIMIS_STREAM_MAX_DEPTH) {
+        fail(stream, "nested too deep");
+        return;
+    }
+
+    cimis_stream_frame *frame = &stream->frames[stream->depth];
+    frame->key[0] = '\0';
+    frame->is_object = is_object;
+    frame->expect_key = is_object;
+    // Data.Providers[].Records[] entries are the daily records
+    frame->is_record = is_object && stream->depth >= 2 && !stream->frames[stream->depth - 1].is_object
+        && stream->frames[stream->depth - 2].is_object && strcmp(stream->frames[stream->depth - 2].key, "Records") == 0;
+    stream->depth++;
+
+    if (frame->is_record)
+        start_record(stream);
+}
+
+
+static void pop_frame(cimis_stream *stream, int is_object) {
+    if (stream->depth == 0 || stream->frames[stream->depth - 1].is_object != is_object) {
+        fail(stream, "unbalanced brackets");
+        return;
+    }
+
+    stream->depth--;
+    if (stream->frames[stream->depth].is_record)
+        end_record(stream);
+}
+
+
+static void handle_value(cimis_stream *stream, int kind) {
+    /* keep the handful of fields the model uses, everything else is dropped */
+    cimis_stream_frame *top = &stream->frames[stream->depth - 1];
+
+    if (!top->is_object)
+        return;
+
+    if (top->is_record) {
+        if (kind == TOKEN_STRING && strcmp(top->key, "Date") == 0)
+            memcpy(stream->date, stream->token, sizeof(stream->date));
+        else if (kind == TOKEN_STRING && strcmp(top->key, "Station") == 0) {
+            memcpy(stream->station, stream->token, CIMIS_STATION_LEN - 1);
+            stream->station[CIMIS_STATION_LEN - 1] = '\0';
+        }
+        return;
+    }
+
+    if (stream->depth < 2 || !stream->frames[stream->depth - 2].is_record)
+        return;
+
+    const char *field = stream->frames[stream->depth - 2].key;
+    int is_eto = strcmp(field, "DayAsceEto") == 0;
+    int is_precip = strcmp(field, "DayPrecip") == 0;
+    if (!is_eto && !is_precip)
+        return;
+
+    if (strcmp(top->key, "Value") == 0) {
+        // precipitation could be null (likely that they don't have the data for the whole day so they provide null)
+        if (kind != TOKEN_STRING)
+            return;
+        if (is_eto) {
+            stream->record.eto = strtof(stream->token, NULL);
+            stream->record.flags |= CIMIS_DAY_ETO_VALID;
+        } else {
+            stream->record.precip = strtof(stream->token, NULL);
+            stream->record.flags |= CIMIS_DAY_PRECIP_VALID;
+        }
+    } else if (strcmp(top->key, "Qc") == 0 && kind == TOKEN_STRING && stream->token[0] != '\0') {
+        if (is_eto)
+            stream->record.eto_qc = stream->token[0];
+        else
+            stream->record.precip_qc = stream->token[0];
+    }
+}
+
+
+static void end_token(cimis_stream *stream, int kind) {
+    stream->token[stream->token_len] = '\0';
+    stream->lex_state = LEX_VALUE;
+
+    if (stream->depth == 0)
+        return;
+
+    cimis_stream_frame *top = &stream->frames[stream->depth - 1];
+    if (top->is_object && top->expect_key) {
+        if (kind != TOKEN_STRING) {
+            fail(stream, "object key is not a string");
+            return;
+        }
+        memcpy(top->key, stream->token, CIMIS_STREAM_TOKEN_LEN);
+        top->expect_key = 0;
+        return;
+    }
+
+    handle_value(stream, kind);
+}
+
+
+static void append_token(cimis_stream *stream, char c) {
+    if (stream->token_len < CIMIS_STREAM_TOKEN_LEN - 1)
+        stream->token[stream->token_len++] = c;
+}
+
+
+size_t cimis_stream_feed(cimis_stream *stream, const char *data, size_t size) {
+    size_t i;
+
+    for (i = 0; i < size && !stream->stopped; i++) {
+        char c = data[i];
+
+        if (stream->lex_state == LEX_STRING) {
+            if (stream->escape) {
+                stream->escape = 0;
+                append_token(stream, c);
+            } else if (c == '\\') {
+                stream->escape = 1;
+            } else if (c == '"') {
+                end_token(stream, TOKEN_STRING);
+            } else {
+                append_token(stream, c);
+            }
+            continue;
+        }
+
+        if (stream->lex_state == LEX_LITERAL) {
+            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || c == '.' || c == '-' || c == '+' || c == 'E') {
+                append_token(stream, c);
+                continue;
+            }
+            end_token(stream, TOKEN_LITERAL);
+            // c is the delimiter after the literal, handle it below
+        }
+
+        switch (c) {
+            case ' ': case '\t': case '\r': case '\n': case ':':
+                break;
+            case '{':
+                push_frame(stream, 1);
+                break;
+            case '[':
+                push_frame(stream, 0);
+                break;
+            case '}':
+                pop_frame(stream, 1);
+                break;
+            case ']':
+                pop_frame(stream, 0);
+                break;
+            case ',':
+                if (stream->depth > 0 && stream->frames[stream->depth - 1].is_object)
+                    stream->frames[stream->depth - 1].expect_key = 1;
+                break;
+            case '"':
+                stream->lex_state = LEX_STRING;
+                stream->token_len = 0;
+                break;
+            default:
+                stream->lex_state = LEX_LITERAL;
+                stream->token_len = 0;
+                append_token(stream, c);
+                break;
+        }
+    }
+
+    return i;
+}
+
+
+int cimis_stream_finish(cimis_stream *stream) {
+    if (stream->lex_state == LEX_LITERAL)
+        end_token(stream, TOKEN_LITERAL);
+
+    if (!stream->stopped && (stream->depth != 0 || stream->lex_state == LEX_STRING))
+        fail(stream, "response ended early");
+
+    return stream->parse_errors > 0 ? -1 : 0;
+}
@@ -0,0 +1,83 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+incremental parser for CIMIS daily data responses. Bytes are fed in as curl delivers them and every
+Data.Providers[].Records[] entry is handed to a callback as soon as its closing brace arrives, so memory
+stays the size of this struct no matter how many days, stations or providers the response holds.
+Only the fields the irrigation model needs are kept (Date, Station, DayAsceEto and DayPrecip Value/Qc),
+everything else is skipped without being stored.
+*/
+
+#ifndef CIMIS_STREAM_H
+#define CIMIS_STREAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cimis_store.h"
+#include "log_streams.h"
+
+#define CIMIS_STREAM_MAX_DEPTH 16
+#define CIMIS_STREAM_TOKEN_LEN 48   // longer strings are truncated, none of the fields we keep come close
+
+// called for every complete daily record, return non-zero to stop parsing
+typedef int (*cimis_record_callback)(void *ctx, const char *station, int32_t day, const cimis_day *record);
+
+typedef struct cimis_stream_frame {
+    char key[CIMIS_STREAM_TOKEN_LEN];   // the key of the value currently being parsed (objects only)
+    char is_object;
+    char expect_key;
+    char is_record;                     // this object is an entry of a Records array
+} cimis_stream_frame;
+
+typedef struct cimis_stream {
+    cimis_stream_frame frames[CIMIS_STREAM_MAX_DEPTH];
+    int depth;
+
+    // lexer state, a token may be split across any two curl writes
+    int lex_state;
+    int escape;
+    char token[CIMIS_STREAM_TOKEN_LEN];
+    int token_len;
+
+    // the record being assembled
+    char date[CIMIS_STREAM_TOKEN_LEN];
+    char station[CIMIS_STATION_LEN];
+    cimis_day record;
+
+    cimis_record_callback on_record;
+    void *ctx;
+    const log_streams *log;    // where its errors go
+
+    // running totals over every record seen
+    float total_eto;
+    float total_precip;
+    int num_records;
+    int parse_errors;    // malformed JSON or records without a usable Date
+    int stopped;         // the callback asked to stop or the JSON is broken
+} cimis_stream;
+
+void cimis_stream_init(cimis_stream *stream, cimis_record_callback on_record, void *ctx, const log_streams *log);
+
+// parse the next chunk of the response, returns the number of bytes consumed (less than size once stopped)
+size_t cimis_stream_feed(cimis_stream *stream, const char *data, size_t size);
+
+// returns 0 if the whole document was parsed without errors
+int cimis_stream_finish(cimis_stream *stream);
+
+#endif
@@ -0,0 +1,181 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "completion.h"
+
+
+long monotonic_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+int completion_init(completion_queue *queue, int capacity) {
+    pthread_condattr_t cond_attr;
+
+    queue->commands = calloc(capacity > 0 ? capacity : 1, sizeof(relay_command));
+    if (!queue->commands)
+        return -1;
+    queue->capacity = capacity;
+    queue->unexpected_acks = 0;
+    queue->duplicate_acks = 0;
+    memset(queue->recent_ids, 0, sizeof(queue->recent_ids));
+    queue->recent_next = 0;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    // deadlines are on the monotonic clock so a wall-clock (NTP) jump can't fire or hide a timeout
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&queue->cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    return 0;
+}
+
+
+void completion_destroy(completion_queue *queue) {
+    pthread_cond_destroy(&queue->cond);
+    pthread_mutex_destroy(&queue->lock);
+    free(queue->commands);
+    queue->commands = NULL;
+    queue->capacity = 0;
+}
+
+
+int completion_expect(completion_queue *queue, long controller_num, long relay_num, unsigned long command_id, long deadline_ms, int tag) {
+    int slot = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    for (int i = 0; i < queue->capacity; i++) {
+        if (!queue->commands[i].in_use) {
+            slot = i;
+            break;
+        }
+    }
+    if (slot >= 0) {
+        relay_command *command = &queue->commands[slot];
+        command->controller_num = controller_num;
+        command->relay_num = relay_num;
+        command->command_id = command_id;
+        command->deadline_ms = deadline_ms;
+        command->sent_ms = monotonic_ms();
+        command->acked_ms = 0;
+        command->tag = tag;
+        command->acked = 0;
+        command->in_use = 1;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return slot < 0 ? -1 : 0;
+}
+
+
+int completion_post(completion_queue *queue, long controller_num, long relay_num, unsigned long command_id) {
+    int result = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    // ids are never 0, so the unused slots of the ring never match
+    for (int r = 0; r < COMPLETION_RECENT_IDS; r++) {
+        if (queue->recent_ids[r] == command_id) {
+            result = 1;
+            break;
+        }
+    }
+    for (int i = 0; i < queue->capacity && result < 0; i++) {
+        relay_command *command = &queue->commands[i];
+        if (command->in_use && !command->acked && command->command_id == command_id
+                && command->controller_num == controller_num && command->relay_num == relay_num) {
+            command->acked = 1;
+            command->acked_ms = monotonic_ms();
+            queue->recent_ids[queue->recent_next] = command_id;
+            queue->recent_next = (queue->recent_next + 1) % COMPLETION_RECENT_IDS;
+            result = 0;
+        }
+    }
+    if (result == 0) {
+        pthread_cond_signal(&queue->cond);
+    } else if (result == 1) {
+        queue->duplicate_acks++;
+    } else {
+        queue->unexpected_acks++;
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return result;
+}
+
+
+int completion_cancel(completion_queue *queue, int tag) {
+    int found = -1;
+
+    pthread_mutex_lock(&queue->lock);
+    for (int i = 0; i < queue->capacity; i++) {
+        relay_command *command = &queue->commands[i];
+        if (command->in_use && !command->acked && command->tag == tag) {
+            command->in_use = 0;
+            found = 0;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return found;
+}
+
+
+int completion_wait(completion_queue *queue, int *tag, long *latency_ms) {
+    int result = COMPLETION_EMPTY;
+
+    pthread_mutex_lock(&queue->lock);
+    for (;;) {
+        long now_ms = monotonic_ms();
+        long earliest_ms = -1;
+        int waiting = 0;
+
+        for (int i = 0; i < queue->capacity; i++) {
+            relay_command *command = &queue->commands[i];
+            if (!command->in_use)
+                continue;
+
+            if (command->acked || command->deadline_ms <= now_ms) {
+                result = command->acked ? COMPLETION_ACKED : COMPLETION_TIMEOUT;
+                *tag = command->tag;
+                *latency_ms = (command->acked ? command->acked_ms : now_ms) - command->sent_ms;
+                command->in_use = 0;
+                break;
+            }
+            waiting++;
+            if (earliest_ms < 0 || command->deadline_ms < earliest_ms)
+                earliest_ms = command->deadline_ms;
+        }
+        if (result != COMPLETION_EMPTY || waiting == 0)
+            break;
+
+        struct timespec until = {.tv_sec = earliest_ms / 1000, .tv_nsec = (earliest_ms % 1000) * 1000000};
+        pthread_cond_timedwait(&queue->cond, &queue->lock, &until);
+    }
+    pthread_mutex_unlock(&queue->lock);
+
+    return result;
+}
@@ -0,0 +1,76 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+thread-safe table of relay commands waiting for their done message, keyed by command id.
+The mosquitto network thread posts acks, the main thread blocks until any command is acked or
+misses its deadline, so the next section starts the moment the ESP reports back
+*/
+
+#ifndef COMPLETION_H
+#define COMPLETION_H
+
+#include <pthread.h>
+
+enum { COMPLETION_EMPTY = 0, COMPLETION_ACKED, COMPLETION_TIMEOUT };
+
+#define COMPLETION_RECENT_IDS 64   // acked command ids remembered to tell a redelivered ack from an unknown one
+
+typedef struct relay_command {
+    long controller_num;
+    long relay_num;
+    unsigned long command_id;
+    long deadline_ms;    // monotonic msec by which the ack has to arrive
+    long sent_ms;        // monotonic msec when the command was published
+    long acked_ms;       // monotonic msec when the ack arrived
+    int tag;             // caller's handle for the command (e.g. the job index)
+    int in_use;          // 0 == free slot
+    int acked;
+} relay_command;
+
+typedef struct completion_queue {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    relay_command *commands;
+    int capacity;
+    int unexpected_acks; // acks that matched no waiting command (late or from an unknown command)
+    int duplicate_acks;  // redelivered acks of a command that was already acked
+    unsigned long recent_ids[COMPLETION_RECENT_IDS];
+    int recent_next;
+} completion_queue;
+
+// monotonic clock in msec, used for every command deadline
+long monotonic_ms(void);
+
+int completion_init(completion_queue *queue, int capacity);
+void completion_destroy(completion_queue *queue);
+
+// register a published command, returns -1 if the table is full
+int completion_expect(completion_queue *queue, long controller_num, long relay_num, unsigned long command_id, long deadline_ms, int tag);
+
+// called from the mosquitto thread when a done message arrives, returns 0 if the ack matched a waiting command,
+// 1 if that command was already acked (QoS 1 delivers at least once) and -1 if no such command is waiting
+int completion_post(completion_queue *queue, long controller_num, long relay_num, unsigned long command_id);
+
+// stop waiting on the command with tag (e.g. a scheduled section that was cancelled), returns -1 if it isn't waiting
+int completion_cancel(completion_queue *queue, int tag);
+
+// block until a command is acked or misses its deadline, returns COMPLETION_ACKED or COMPLETION_TIMEOUT
+// and sets *tag and *latency_ms, or COMPLETION_EMPTY if nothing is waiting
+int completion_wait(completion_queue *queue, int *tag, long *latency_ms);
+
+#endif
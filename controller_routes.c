@@ -0,0 +1,155 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "controller_routes.h"
+
+
+static uint32_t controller_hash(long controller_num) {
+    // Fibonacci hashing, consecutive controller numbers spread over the whole table
+    return (uint32_t)((uint64_t)controller_num * 2654435761u);
+}
+
+
+static uint32_t topic_hash(const char *topic, size_t length) {
+    // FNV-1a
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ (unsigned char)topic[i]) * 16777619u;
+    return hash;
+}
+
+
+static int32_t find_topic(const route_table *table, const char *topic, size_t length) {
+    /* the slot holding the route with base topic (length bytes, not NUL terminated) or the empty slot it would go in */
+    uint32_t slot = topic_hash(topic, length) & (table->num_slots - 1);
+
+    while (table->by_topic[slot] >= 0) {
+        const char *route_topic = table->routes[table->by_topic[slot]].topic;
+        if (strncmp(route_topic, topic, length) == 0 && route_topic[length] == '\0')
+            break;
+        slot = (slot + 1) & (table->num_slots - 1);
+    }
+    return (int32_t)slot;
+}
+
+
+int route_table_build(route_table *table, const zone_config *config) {
+    /* the compiled records are unique and sorted by controller number, only a topic reused by two
+    controllers (a Topic equal to another controller's default) has to be dropped */
+    uint32_t num_slots = 16;
+
+    memset(table, 0, sizeof(route_table));
+    while (num_slots < 2 * (uint32_t)config->num_controllers)
+        num_slots *= 2;
+
+    table->routes = calloc(config->num_controllers + 1, sizeof(controller_route));
+    table->by_controller = malloc(num_slots * sizeof(int32_t));
+    table->by_topic = malloc(num_slots * sizeof(int32_t));
+    if (!table->routes || !table->by_controller || !table->by_topic) {
+        fprintf(LOG_ERR(config->log), "error: unable to allocate the routes of %d controllers\n", config->num_controllers);
+        route_table_free(table);
+        return -1;
+    }
+    memset(table->by_controller, 0xff, num_slots * sizeof(int32_t));
+    memset(table->by_topic, 0xff, num_slots * sizeof(int32_t));
+    table->num_slots = num_slots;
+
+    for (int c = 0; c < config->num_controllers; c++) {
+        const zone_config_controller *record = &config->controllers[c];
+        controller_route *route = &table->routes[table->num_routes];
+        const char *topic = route->topic;
+        char default_base[CONTROLLER_TOPIC_LEN];
+
+        memcpy(route->topic, record->topic, CONTROLLER_TOPIC_LEN);
+        route->topic[CONTROLLER_TOPIC_LEN - 1] = '\0';
+        snprintf(default_base, sizeof(default_base), "%s/", CONTROLLER_TOPIC_PREFIX);
+
+        route->controller_num = record->controller_num;
+        snprintf(route->cmd_topic, ROUTE_TOPIC_LEN, "%s/cmd", topic);
+        snprintf(route->done_topic, ROUTE_TOPIC_LEN, "%s/done", topic);
+        snprintf(route->status_topic, ROUTE_TOPIC_LEN, "%s/status", topic);
+        // one level under the prefix, e.g. irrigation/back_yard
+        route->default_topic = strncmp(topic, default_base, strlen(default_base)) == 0 && !strchr(topic + strlen(default_base), '/');
+
+        int32_t slot = find_topic(table, topic, strlen(topic));
+        if (table->by_topic[slot] >= 0) {
+            fprintf(LOG_ERR(config->log), "error: controllers %ld and %ld share the topic %s, controller %ld has no route\n",
+                table->routes[table->by_topic[slot]].controller_num, route->controller_num, topic, route->controller_num);
+            continue;
+        }
+        table->by_topic[slot] = table->num_routes;
+
+        slot = controller_hash(route->controller_num) & (num_slots - 1);
+        while (table->by_controller[slot] >= 0)
+            slot = (slot + 1) & (num_slots - 1);
+        table->by_controller[slot] = table->num_routes;
+        table->num_routes++;
+    }
+    return 0;
+}
+
+
+void route_table_free(route_table *table) {
+    free(table->routes);
+    free(table->by_controller);
+    free(table->by_topic);
+    memset(table, 0, sizeof(route_table));
+}
+
+
+const controller_route *route_find(const route_table *table, long controller_num) {
+    if (table->num_slots == 0)
+        return NULL;
+
+    uint32_t slot = controller_hash(controller_num) & (table->num_slots - 1);
+    while (table->by_controller[slot] >= 0) {
+        const controller_route *route = &table->routes[table->by_controller[slot]];
+        if (route->controller_num == controller_num)
+            return route;
+        slot = (slot + 1) & (table->num_slots - 1);
+    }
+    return NULL;
+}
+
+
+const controller_route *route_find_topic(const route_table *table, const char *topic, int *kind) {
+    /* split "<base topic>/<done|status>" at the last level and look the base up */
+    const char *last = strrchr(topic, '/');
+
+    *kind = ROUTE_TOPIC_OTHER;
+    if (table->num_slots == 0 || !last)
+        return NULL;
+    if (strcmp(last, "/done") == 0)
+        *kind = ROUTE_TOPIC_DONE;
+    else if (strcmp(last, "/status") == 0)
+        *kind = ROUTE_TOPIC_STATUS;
+    else
+        return NULL;
+
+    int32_t slot = find_topic(table, topic, last - topic);
+    if (table->by_topic[slot] < 0) {
+        *kind = ROUTE_TOPIC_OTHER;
+        return NULL;
+    }
+    return &table->routes[table->by_topic[slot]];
+}
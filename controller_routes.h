@@ -0,0 +1,68 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+routing of the relay commands, acks and heartbeats by controller. Every controller has a command topic
+(<topic>/cmd) the server publishes its schedule on, a done topic (<topic>/done) its ESP reports the
+finished sections on and a status topic (<topic>/status) for its heartbeats. The table is built from
+the compiled controller records with two open addressing indexes, by controller number for dispatch
+and by base topic for what the ESPs send, so both are a hash and a compare however many controllers
+there are.
+*/
+
+#ifndef CONTROLLER_ROUTES_H
+#define CONTROLLER_ROUTES_H
+
+#include <stdint.h>
+
+#include "zone_config.h"
+
+#define ROUTE_TOPIC_LEN (CONTROLLER_TOPIC_LEN + 8)
+#define ROUTE_DONE_SUBSCRIPTION CONTROLLER_TOPIC_PREFIX "/+/done"   // every controller on the default topics
+#define ROUTE_STATUS_SUBSCRIPTION CONTROLLER_TOPIC_PREFIX "/+/status"
+
+enum { ROUTE_TOPIC_OTHER = 0, ROUTE_TOPIC_DONE, ROUTE_TOPIC_STATUS };
+
+typedef struct controller_route {
+    long controller_num;
+    char topic[CONTROLLER_TOPIC_LEN];
+    char cmd_topic[ROUTE_TOPIC_LEN];
+    char done_topic[ROUTE_TOPIC_LEN];
+    char status_topic[ROUTE_TOPIC_LEN];
+    int default_topic;         // its done and status topics are covered by the ROUTE_*_SUBSCRIPTION wildcards
+} controller_route;
+
+typedef struct route_table {
+    controller_route *routes;
+    int num_routes;
+    int32_t *by_controller;    // slots holding a route index or -1, num_slots of them
+    int32_t *by_topic;
+    uint32_t num_slots;        // a power of two, at least twice num_routes
+} route_table;
+
+// build the routes of every controller in config, 0 or -1 when out of memory
+int route_table_build(route_table *table, const zone_config *config);
+void route_table_free(route_table *table);
+
+// NULL when the controller has no route
+const controller_route *route_find(const route_table *table, long controller_num);
+// the route a message topic belongs to and in *kind whether it is its done or status topic, NULL when
+// it is neither for any controller
+const controller_route *route_find_topic(const route_table *table, const char *topic, int *kind);
+
+#endif
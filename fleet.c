@@ -0,0 +1,286 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fleet.h"
+
+static struct {
+    pthread_mutex_t lock;
+    fleet_controller **controllers;
+    int num_controllers;
+    int capacity;
+    int32_t *slots;        // open addressing index by controller number, -1 == empty
+    uint32_t num_slots;    // a power of two, at least twice capacity
+} fleet = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+
+static int restarted(unsigned long previous_s, unsigned long uptime_s) {
+    /* the uptime went back, except for the millis() wrap of older firmware that sends millis() / 1000 */
+    if (uptime_s >= previous_s)
+        return 0;
+    return !(previous_s >= FLEET_MILLIS_WRAP_S - FLEET_STALE_S && uptime_s < FLEET_STALE_S);
+}
+
+
+static uint32_t controller_slot(long controller_num, uint32_t num_slots) {
+    return (uint32_t)((uint64_t)controller_num * 2654435761u) & (num_slots - 1);
+}
+
+
+static int32_t *find_slot(long controller_num) {
+    /* caller holds the lock, the slot of controller_num or the empty slot it would go in */
+    uint32_t slot = controller_slot(controller_num, fleet.num_slots);
+
+    while (fleet.slots[slot] >= 0 && fleet.controllers[fleet.slots[slot]]->controller_num != controller_num)
+        slot = (slot + 1) & (fleet.num_slots - 1);
+    return &fleet.slots[slot];
+}
+
+
+static int grow(void) {
+    /* caller holds the lock, doubles the table and rebuilds the index */
+    int capacity = fleet.capacity ? fleet.capacity * 2 : 16;
+    fleet_controller **controllers = realloc(fleet.controllers, capacity * sizeof(fleet_controller *));
+    if (!controllers)
+        return -1;
+    fleet.controllers = controllers;
+
+    int32_t *slots = malloc(2 * capacity * sizeof(int32_t));
+    if (!slots)
+        return -1;
+    free(fleet.slots);
+    fleet.slots = slots;
+    fleet.num_slots = 2 * capacity;
+    fleet.capacity = capacity;
+    memset(fleet.slots, 0xff, fleet.num_slots * sizeof(int32_t));
+    for (int c = 0; c < fleet.num_controllers; c++)
+        *find_slot(fleet.controllers[c]->controller_num) = c;
+    return 0;
+}
+
+
+static fleet_controller *find_controller(long controller_num) {
+    /* caller holds the lock, NULL when the controller never sent a heartbeat */
+    if (fleet.num_slots == 0)
+        return NULL;
+    int32_t index = *find_slot(controller_num);
+    return index >= 0 ? fleet.controllers[index] : NULL;
+}
+
+
+int fleet_heartbeat(const relay_heartbeat *heartbeat, time_t received, const log_streams *log) {
+    int status = -1;
+
+    pthread_mutex_lock(&fleet.lock);
+    fleet_controller *controller = find_controller(heartbeat->controller_num);
+    if (!controller) {
+        if (fleet.num_controllers == fleet.capacity && grow() != 0)
+            goto done;
+        controller = calloc(1, sizeof(fleet_controller));
+        if (!controller)
+            goto done;
+        controller->controller_num = heartbeat->controller_num;
+        fleet.controllers[fleet.num_controllers] = controller;
+        *find_slot(heartbeat->controller_num) = fleet.num_controllers;
+        fleet.num_controllers++;
+    }
+
+    if (controller->count > 0) {
+        const fleet_sample *last = &controller->samples[(controller->next + FLEET_HISTORY - 1) % FLEET_HISTORY];
+        if (restarted(last->heartbeat.uptime_s, heartbeat->uptime_s))
+            controller->restarts++;
+    }
+    controller->samples[controller->next].received = received;
+    controller->samples[controller->next].heartbeat = *heartbeat;
+    controller->next = (controller->next + 1) % FLEET_HISTORY;
+    if (controller->count < FLEET_HISTORY)
+        controller->count++;
+    controller->heartbeats++;
+    status = 0;
+
+done:
+    pthread_mutex_unlock(&fleet.lock);
+    if (status != 0)
+        fprintf(LOG_ERR(log), "error: unable to allocate the heartbeats of controller %ld\n", heartbeat->controller_num);
+    return status;
+}
+
+
+static void controller_stats(const fleet_controller *controller, fleet_stats *stats) {
+    /* caller holds the lock. The counters are since the ESP booted, what happened within the ring is the
+    sum of the increases between neighbouring heartbeats (a restart starts them over) */
+    const fleet_sample *previous = NULL;
+    double rssi_sum = 0., loop_sum = 0.;
+
+    memset(stats, 0, sizeof(fleet_stats));
+    stats->controller_num = controller->controller_num;
+    stats->num_samples = controller->count;
+    stats->heartbeats = controller->heartbeats;
+    stats->restarts = controller->restarts;
+
+    for (int k = 0; k < controller->count; k++) {
+        const fleet_sample *sample = &controller->samples[(controller->next + FLEET_HISTORY - controller->count + k) % FLEET_HISTORY];
+        const relay_heartbeat *heartbeat = &sample->heartbeat;
+
+        if (k == 0 || heartbeat->free_heap < stats->free_heap_min)
+            stats->free_heap_min = heartbeat->free_heap;
+        if (k == 0 || heartbeat->rssi < stats->rssi_min)
+            stats->rssi_min = heartbeat->rssi;
+        if (heartbeat->loop_max_us > stats->loop_max_us)
+            stats->loop_max_us = heartbeat->loop_max_us;
+        rssi_sum += heartbeat->rssi;
+        loop_sum += heartbeat->loop_avg_us;
+
+        if (previous && !restarted(previous->heartbeat.uptime_s, heartbeat->uptime_s)) {
+            if (heartbeat->connects > previous->heartbeat.connects)
+                stats->reconnects += heartbeat->connects - previous->heartbeat.connects;
+            // unsigned 32 bit difference, the ESP's counter wraps
+            stats->relay_on_s += ((heartbeat->relay_on_ms - previous->heartbeat.relay_on_ms) & 0xffffffffUL) / 1000.;
+        }
+        previous = sample;
+    }
+
+    if (previous) {
+        stats->last_seen = previous->received;
+        stats->uptime_s = previous->heartbeat.uptime_s;
+        stats->free_heap_last = previous->heartbeat.free_heap;
+        stats->rssi_avg = rssi_sum / controller->count;
+        stats->loop_avg_us = loop_sum / controller->count;
+    }
+}
+
+
+int fleet_stats_get(long controller_num, fleet_stats *stats) {
+    pthread_mutex_lock(&fleet.lock);
+    const fleet_controller *controller = find_controller(controller_num);
+    if (controller)
+        controller_stats(controller, stats);
+    pthread_mutex_unlock(&fleet.lock);
+
+    return controller ? 0 : -1;
+}
+
+
+int fleet_warning(long controller_num, time_t now, char *reason, size_t reason_len) {
+    /* a controller that never sent a heartbeat may run older firmware, only the ones that did are judged */
+    fleet_stats stats;
+
+    if (fleet_stats_get(controller_num, &stats) != 0)
+        return 0;
+
+    if (now - stats.last_seen > FLEET_STALE_S)
+        snprintf(reason, reason_len, "no heartbeat for %ld sec", (long)(now - stats.last_seen));
+    else if (stats.restarts > 0 && stats.uptime_s < FLEET_HISTORY * FLEET_HEARTBEAT_S)
+        snprintf(reason, reason_len, "restarted %lu sec ago (%llu restarts seen)", stats.uptime_s, (unsigned long long)stats.restarts);
+    else if (stats.reconnects > 2)
+        snprintf(reason, reason_len, "%lu broker reconnects in the last %d heartbeats", stats.reconnects, stats.num_samples);
+    else if (stats.rssi_avg < FLEET_WEAK_RSSI)
+        snprintf(reason, reason_len, "weak WiFi, %.0f dBm on average", stats.rssi_avg);
+    else if (stats.loop_max_us > FLEET_SLOW_LOOP_US)
+        snprintf(reason, reason_len, "slow loop, %lu usec at worst", stats.loop_max_us);
+    else
+        return 0;
+    return 1;
+}
+
+
+int fleet_write(const char *path) {
+    /* write to a temporary file and rename it over the metrics so the collector never reads a partial file */
+    static const struct {
+        const char *name;
+        const char *help;
+    } gauges[] = {
+        {"irrigation_controller_heartbeat_age_seconds", "Time since the controller's last heartbeat."},
+        {"irrigation_controller_uptime_seconds", "Controller uptime at its last heartbeat."},
+        {"irrigation_controller_free_heap_min_bytes", "Lowest free heap over the recent heartbeats."},
+        {"irrigation_controller_rssi_avg_dbm", "Average WiFi signal over the recent heartbeats."},
+        {"irrigation_controller_rssi_min_dbm", "Weakest WiFi signal over the recent heartbeats."},
+        {"irrigation_controller_reconnects", "Broker reconnects over the recent heartbeats."},
+        {"irrigation_controller_loop_avg_microseconds", "Average loop() pass over the recent heartbeats."},
+        {"irrigation_controller_loop_max_microseconds", "Longest loop() pass over the recent heartbeats."},
+        {"irrigation_controller_relay_on_seconds", "Measured relay on time over the recent heartbeats."},
+        {"irrigation_controller_restarts_total", "Controller restarts seen in its heartbeats."},
+    };
+    enum { NUM_GAUGES = sizeof(gauges) / sizeof(gauges[0]) };
+    char tmp_path[128];
+    time_t now = time(NULL);
+    int num_stale = 0;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *fleet_file = fopen(tmp_path, "w");
+    if (fleet_file == NULL) {
+        fprintf(stderr, "error: cannot write %s\n", tmp_path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&fleet.lock);
+    fleet_stats *stats = malloc((fleet.num_controllers + 1) * sizeof(fleet_stats));
+    if (stats) {
+        for (int c = 0; c < fleet.num_controllers; c++) {
+            controller_stats(fleet.controllers[c], &stats[c]);
+            if (now - stats[c].last_seen > FLEET_STALE_S)
+                num_stale++;
+        }
+    }
+    int num_controllers = stats ? fleet.num_controllers : 0;
+    pthread_mutex_unlock(&fleet.lock);
+
+    fprintf(fleet_file, "# HELP irrigation_fleet_controllers Controllers that sent a heartbeat.\n");
+    fprintf(fleet_file, "# TYPE irrigation_fleet_controllers gauge\nirrigation_fleet_controllers %d\n", num_controllers);
+    fprintf(fleet_file, "# HELP irrigation_fleet_stale_controllers Controllers without a heartbeat for %d sec.\n", FLEET_STALE_S);
+    fprintf(fleet_file, "# TYPE irrigation_fleet_stale_controllers gauge\nirrigation_fleet_stale_controllers %d\n", num_stale);
+
+    for (int g = 0; g < NUM_GAUGES; g++) {
+        fprintf(fleet_file, "# HELP %s %s\n# TYPE %s %s\n", gauges[g].name, gauges[g].help, gauges[g].name,
+            strstr(gauges[g].name, "_total") ? "counter" : "gauge");
+        for (int c = 0; c < num_controllers; c++) {
+            const fleet_stats *s = &stats[c];
+            double values[NUM_GAUGES] = {
+                (double)(now - s->last_seen), s->uptime_s, s->free_heap_min, s->rssi_avg, s->rssi_min,
+                s->reconnects, s->loop_avg_us, s->loop_max_us, s->relay_on_s, (double)s->restarts
+            };
+            fprintf(fleet_file, "%s{controller=\"%ld\"} %.10g\n", gauges[g].name, s->controller_num, values[g]);
+        }
+    }
+    free(stats);
+
+    if (fclose(fleet_file) != 0 || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "error: cannot replace %s\n", path);
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+void fleet_free(void) {
+    pthread_mutex_lock(&fleet.lock);
+    for (int c = 0; c < fleet.num_controllers; c++)
+        free(fleet.controllers[c]);
+    free(fleet.controllers);
+    free(fleet.slots);
+    fleet.controllers = NULL;
+    fleet.slots = NULL;
+    fleet.num_controllers = fleet.capacity = 0;
+    fleet.num_slots = 0;
+    pthread_mutex_unlock(&fleet.lock);
+}
@@ -0,0 +1,88 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+health of the ESP controllers from their heartbeats. The mosquitto thread adds each heartbeat to its
+controller's ring buffer (the last FLEET_HISTORY of them, an hour at one a minute), the aggregates are
+computed over the ring when they are read: for the warnings before a run and for irrigation_fleet.prom
+next to the run metrics, in the Prometheus text format.
+*/
+
+#ifndef FLEET_H
+#define FLEET_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "relay_protocol.h"
+#include "log_streams.h"
+
+#define FLEET_HISTORY 60
+#define FLEET_HEARTBEAT_S 60          // the ESPs' heartbeat interval
+#define FLEET_STALE_S (3 * FLEET_HEARTBEAT_S)
+#define FLEET_MILLIS_WRAP_S 4294967UL // 2^32 msec, where millis() / 1000 starts over on firmware before the 64 bit uptime
+#define FLEET_WEAK_RSSI -80           // in dBm, below this the link drops now and then
+#define FLEET_SLOW_LOOP_US 50000      // a loop() pass this long delays relay starts and broker traffic
+
+typedef struct fleet_sample {
+    time_t received;
+    relay_heartbeat heartbeat;
+} fleet_sample;
+
+typedef struct fleet_controller {
+    long controller_num;
+    fleet_sample samples[FLEET_HISTORY];   // ring, oldest at (next - count)
+    int next;
+    int count;
+    uint64_t heartbeats;
+    uint64_t restarts;                     // the uptime went back between two heartbeats
+} fleet_controller;
+
+// aggregates over a controller's ring
+typedef struct fleet_stats {
+    long controller_num;
+    int num_samples;
+    time_t last_seen;
+    unsigned long uptime_s;
+    unsigned long free_heap_min;
+    unsigned long free_heap_last;
+    double rssi_avg;
+    long rssi_min;
+    unsigned long reconnects;      // broker reconnects within the ring
+    double loop_avg_us;
+    unsigned long loop_max_us;
+    double relay_on_s;             // measured relay on time within the ring
+    uint64_t heartbeats;
+    uint64_t restarts;
+} fleet_stats;
+
+// add a heartbeat received at the given time, returns -1 when out of memory (reported to log)
+int fleet_heartbeat(const relay_heartbeat *heartbeat, time_t received, const log_streams *log);
+
+// the aggregates of controller_num, -1 if it never sent a heartbeat
+int fleet_stats_get(long controller_num, fleet_stats *stats);
+
+// why controller_num looks unhealthy at now (stale, restarting, weak WiFi, slow loop) in reason, 0 if it looks fine
+int fleet_warning(long controller_num, time_t now, char *reason, size_t reason_len);
+
+// every controller's aggregates to path (through a temporary file)
+int fleet_write(const char *path);
+
+void fleet_free(void);
+
+#endif
@@ -0,0 +1,346 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "http_session.h"
+
+
+static uint64_t hash_url(const char *url) {
+    /* FNV-1a, the validators file never holds the URL itself since it carries the app key */
+    uint64_t hash = 14695981039346656037ULL;
+    for (const unsigned char *c = (const unsigned char *)url; *c; c++) {
+        hash ^= *c;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+static http_validator *find_validator(http_session *session, uint64_t url_hash) {
+    for (int i = 0; i < session->num_validators; i++) {
+        if (session->validators[i].url_hash == url_hash)
+            return &session->validators[i];
+    }
+    return NULL;
+}
+
+
+static http_validator *add_validator(http_session *session, uint64_t url_hash) {
+    http_validator *validator = find_validator(session, url_hash);
+    if (validator)
+        return validator;
+
+    if (session->num_validators == session->capacity) {
+        int new_capacity = session->capacity ? session->capacity * 2 : 16;
+        http_validator *grown = realloc(session->validators, new_capacity * sizeof(http_validator));
+        if (!grown)
+            return NULL;
+        session->validators = grown;
+        session->capacity = new_capacity;
+    }
+
+    validator = &session->validators[session->num_validators++];
+    memset(validator, 0, sizeof(http_validator));
+    validator->url_hash = url_hash;
+    return validator;
+}
+
+
+static void load_validators(http_session *session) {
+    /* one line per URL: <hash> TAB <etag> TAB <last-modified>, either validator may be empty */
+    char line[HTTP_ETAG_LEN + HTTP_DATE_LEN + 32];
+    FILE *validators_file = fopen(session->validators_path, "r");
+
+    if (validators_file == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), validators_file)) {
+        char *etag = strchr(line, '\t');
+        char *last_modified = etag ? strchr(etag + 1, '\t') : NULL;
+        if (!last_modified)
+            continue;
+        *etag++ = '\0';
+        *last_modified++ = '\0';
+        last_modified[strcspn(last_modified, "\r\n")] = '\0';
+
+        http_validator *validator = add_validator(session, strtoull(line, NULL, 16));
+        if (!validator)
+            break;
+        snprintf(validator->etag, HTTP_ETAG_LEN, "%s", etag);
+        snprintf(validator->last_modified, HTTP_DATE_LEN, "%s", last_modified);
+    }
+    fclose(validators_file);
+}
+
+
+static void save_validators(http_session *session) {
+    char tmp_path[80];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", session->validators_path);
+    FILE *validators_file = fopen(tmp_path, "w");
+    if (validators_file == NULL) {
+        fprintf(stderr, "error: cannot write %s\n", tmp_path);
+        return;
+    }
+    for (int i = 0; i < session->num_validators; i++) {
+        const http_validator *validator = &session->validators[i];
+        fprintf(validators_file, "%016llx\t%s\t%s\n", (unsigned long long)validator->url_hash, validator->etag, validator->last_modified);
+    }
+    if (fclose(validators_file) != 0 || rename(tmp_path, session->validators_path) != 0) {
+        fprintf(stderr, "error: cannot replace %s\n", session->validators_path);
+        remove(tmp_path);
+        return;
+    }
+    session->validators_dirty = 0;
+}
+
+
+static size_t read_header(char *buffer, size_t size, size_t nitems, void *userdata) {
+    /* pick the ETag and Last-Modified validators out of the response headers */
+    http_request *request = (http_request *)userdata;
+    size_t length = size * nitems;
+    char *target = NULL;
+    size_t target_size = 0, name_length = 0;
+
+    if (length > 5 && strncasecmp(buffer, "ETag:", 5) == 0) {
+        target = request->response.etag;
+        target_size = HTTP_ETAG_LEN;
+        name_length = 5;
+    } else if (length > 14 && strncasecmp(buffer, "Last-Modified:", 14) == 0) {
+        target = request->response.last_modified;
+        target_size = HTTP_DATE_LEN;
+        name_length = 14;
+    }
+
+    if (target) {
+        size_t start = name_length;
+        size_t end = length;
+        while (start < end && (buffer[start] == ' ' || buffer[start] == '\t'))
+            start++;
+        while (end > start && (buffer[end - 1] == '\r' || buffer[end - 1] == '\n' || buffer[end - 1] == ' '))
+            end--;
+        // tabs would break the validators file, and values that don't fit are useless anyway
+        if (end - start < target_size && !memchr(buffer + start, '\t', end - start)) {
+            memcpy(target, buffer + start, end - start);
+            target[end - start] = '\0';
+        }
+    }
+
+    return length;
+}
+
+
+static int grow_handles(http_session *session, int num_handles) {
+    /* easy handles are kept between batches so their connections and TLS sessions get reused */
+    if (num_handles <= session->num_handles)
+        return 0;
+
+    CURL **grown = realloc(session->handles, num_handles * sizeof(CURL *));
+    if (!grown)
+        return -1;
+    session->handles = grown;
+
+    while (session->num_handles < num_handles) {
+        CURL *curl = curl_easy_init();
+        if (!curl)
+            return -1;
+        // let curl pick every encoding it was built with (gzip and deflate at least) and decompress on the fly
+        curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+        curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+        curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+        curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, read_header);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, (long)HTTP_CONNECT_TIMEOUT_S);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, (long)HTTP_LOW_SPEED_BYTES);
+        curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME, (long)HTTP_LOW_SPEED_S);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, (long)HTTP_TIMEOUT_S);
+        session->handles[session->num_handles++] = curl;
+    }
+    return 0;
+}
+
+
+int http_session_init(http_session *session, const char *validators_path) {
+    memset(session, 0, sizeof(http_session));
+
+    curl_global_init(CURL_GLOBAL_ALL);
+    session->multi = curl_multi_init();
+    if (!session->multi || grow_handles(session, 1) != 0) {
+        http_session_cleanup(session);
+        return -1;
+    }
+
+    if (validators_path) {
+        snprintf(session->validators_path, sizeof(session->validators_path), "%s", validators_path);
+        load_validators(session);
+    }
+
+    return 0;
+}
+
+
+void http_session_cleanup(http_session *session) {
+    if (session->validators_path[0] != '\0' && session->validators_dirty)
+        save_validators(session);
+
+    for (int i = 0; i < session->num_handles; i++)
+        curl_easy_cleanup(session->handles[i]);
+    if (session->multi)
+        curl_multi_cleanup(session->multi);
+    curl_global_cleanup();
+
+    free(session->handles);
+    free(session->validators);
+    memset(session, 0, sizeof(http_session));
+}
+
+
+static void start_request(http_session *session, CURL *curl, http_request *request) {
+    char header_line[HTTP_ETAG_LEN + 32];
+    http_validator *known = session->validators_path[0] != '\0' ? find_validator(session, hash_url(request->url)) : NULL;
+
+    memset(&request->response, 0, sizeof(http_validator));
+    request->headers = NULL;
+    request->result = HTTP_ERROR;
+    request->response_code = 0;
+
+    // conditional request, the server answers 304 with no body when nothing changed since last time
+    if (known && known->etag[0] != '\0') {
+        snprintf(header_line, sizeof(header_line), "If-None-Match: %s", known->etag);
+        request->headers = curl_slist_append(request->headers, header_line);
+    }
+    if (known && known->last_modified[0] != '\0') {
+        snprintf(header_line, sizeof(header_line), "If-Modified-Since: %s", known->last_modified);
+        request->headers = curl_slist_append(request->headers, header_line);
+    }
+
+    curl_easy_setopt(curl, CURLOPT_URL, request->url);
+    curl_easy_setopt(curl, CURLOPT_HTTPHEADER, request->headers);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, request->on_data);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, request->ctx);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, request);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, request);
+    curl_multi_add_handle(session->multi, curl);
+    session->num_requests++;
+}
+
+
+static void finish_request(http_session *session, CURL *curl, http_request *request, CURLcode status) {
+    curl_off_t downloaded = 0;
+
+    if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &downloaded) == CURLE_OK)
+        session->bytes_downloaded += (double)downloaded;
+
+    if (status != CURLE_OK) {
+        // don't print the url, it holds the app key
+        fprintf(stderr, "error: unable to request data: %s\n", curl_easy_strerror(status));
+        request->result = HTTP_ERROR;
+        return;
+    }
+
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &request->response_code);
+    if (request->response_code == 304) {
+        session->num_not_modified++;
+        request->result = HTTP_NOT_MODIFIED;
+        return;
+    }
+    if (request->response_code != 200) {
+        fprintf(stderr, "error: server responded with code %ld\n", request->response_code);
+        request->result = HTTP_ERROR;
+        return;
+    }
+
+    if (session->validators_path[0] != '\0' && (request->response.etag[0] != '\0' || request->response.last_modified[0] != '\0')) {
+        http_validator *validator = add_validator(session, hash_url(request->url));
+        if (validator) {
+            memcpy(validator->etag, request->response.etag, HTTP_ETAG_LEN);
+            memcpy(validator->last_modified, request->response.last_modified, HTTP_DATE_LEN);
+            session->validators_dirty = 1;
+        }
+    }
+    request->result = HTTP_OK;
+}
+
+
+int http_get_many(http_session *session, http_request *requests, int num_requests) {
+    int still_running = 0;
+    int num_failed = 0;
+
+    if (grow_handles(session, num_requests) != 0) {
+        fprintf(stderr, "error: unable to allocate %d curl handles\n", num_requests);
+        return num_requests;
+    }
+
+    for (int i = 0; i < num_requests; i++)
+        start_request(session, session->handles[i], &requests[i]);
+
+    do {
+        CURLMcode multi_status = curl_multi_perform(session->multi, &still_running);
+        if (multi_status == CURLM_OK && still_running)
+            multi_status = curl_multi_poll(session->multi, NULL, 0, 1000, NULL);
+        if (multi_status != CURLM_OK) {
+            fprintf(stderr, "error: %s\n", curl_multi_strerror(multi_status));
+            break;
+        }
+
+        CURLMsg *message;
+        int messages_left;
+        while ((message = curl_multi_info_read(session->multi, &messages_left))) {
+            http_request *request = NULL;
+            if (message->msg != CURLMSG_DONE)
+                continue;
+            curl_easy_getinfo(message->easy_handle, CURLINFO_PRIVATE, (char **)&request);
+            finish_request(session, message->easy_handle, request, message->data.result);
+        }
+    } while (still_running);
+
+    for (int i = 0; i < num_requests; i++) {
+        curl_multi_remove_handle(session->multi, session->handles[i]);
+        curl_easy_setopt(session->handles[i], CURLOPT_HTTPHEADER, NULL);
+        curl_slist_free_all(requests[i].headers);
+        requests[i].headers = NULL;
+        if (requests[i].result == HTTP_ERROR)
+            num_failed++;
+    }
+
+    return num_failed;
+}
+
+
+int http_get(http_session *session, const char *url, http_write_callback on_data, void *ctx) {
+    http_request request = {.url = url, .on_data = on_data, .ctx = ctx};
+
+    http_get_many(session, &request, 1);
+    return request.result;
+}
+
+
+void http_session_forget(http_session *session, const char *url) {
+    uint64_t url_hash = hash_url(url);
+
+    for (int i = 0; i < session->num_validators; i++) {
+        if (session->validators[i].url_hash == url_hash) {
+            session->validators[i] = session->validators[--session->num_validators];
+            session->validators_dirty = 1;
+            return;
+        }
+    }
+}
@@ -0,0 +1,90 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+persistent HTTP client for the CIMIS API. One curl multi handle and its easy handles are kept for the whole
+session so TCP/TLS connections are reused between requests and several requests (e.g. one per station) run
+concurrently, so a batch takes as long as its slowest request. Responses are requested gzip/deflate compressed, and the ETag and
+Last-Modified validators of every successful response are remembered (hashed by URL, the URL holds the
+app key) in a small text file so asking for the same data again costs a 304 instead of a full download
+*/
+
+#ifndef HTTP_SESSION_H
+#define HTTP_SESSION_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <curl/curl.h>   // see for examples https://curl.se/libcurl/c/example.html
+
+#define HTTP_ETAG_LEN 128
+#define HTTP_DATE_LEN 64
+
+// a stalled server fails the request instead of holding up the run (the weather cache's update lock with it)
+#define HTTP_CONNECT_TIMEOUT_S 15
+#define HTTP_LOW_SPEED_BYTES 100     // slower than this for HTTP_LOW_SPEED_S fails the request
+#define HTTP_LOW_SPEED_S 30
+#define HTTP_TIMEOUT_S 120           // a whole request, retries get as long again
+
+enum { HTTP_OK = 0, HTTP_NOT_MODIFIED = 1, HTTP_ERROR = -1 };
+
+typedef size_t (*http_write_callback)(void *ptr, size_t size, size_t nmemb, void *ctx);
+
+typedef struct http_validator {
+    uint64_t url_hash;
+    char etag[HTTP_ETAG_LEN];
+    char last_modified[HTTP_DATE_LEN];
+} http_validator;
+
+typedef struct http_request {
+    const char *url;
+    http_write_callback on_data;
+    void *ctx;
+    int result;                  // HTTP_OK, HTTP_NOT_MODIFIED or HTTP_ERROR once the batch is done
+    long response_code;
+    http_validator response;     // validators of the response being received
+    struct curl_slist *headers;
+} http_request;
+
+typedef struct http_session {
+    CURLM *multi;                // owns the connection cache shared by every handle
+    CURL **handles;              // reused between batches, grown to the largest batch
+    int num_handles;
+    char validators_path[64];
+    http_validator *validators;
+    int num_validators;
+    int capacity;
+    int validators_dirty;
+    long num_requests;
+    long num_not_modified;
+    double bytes_downloaded;     // compressed bytes on the wire
+} http_session;
+
+// validators_path may be NULL to skip conditional requests
+int http_session_init(http_session *session, const char *validators_path);
+// saves the validators and closes the connection
+void http_session_cleanup(http_session *session);
+
+// GET url, the (decompressed) body is passed to on_data; returns HTTP_OK, HTTP_NOT_MODIFIED or HTTP_ERROR
+int http_get(http_session *session, const char *url, http_write_callback on_data, void *ctx);
+
+// run every request at the same time, each request's result is set; returns the number that failed
+int http_get_many(http_session *session, http_request *requests, int num_requests);
+
+// drop the validators of url, e.g. when its body could not be used, so the next request downloads it again
+void http_session_forget(http_session *session, const char *url);
+
+#endif
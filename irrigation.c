@@ -33,597 +33,936 @@ https://bmpbooks.com/media/Irrigation-Management-04-Scheduling-Knowing-When-and-
 #include <time.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 
 // Include CMake input file, it's in the build folder so VSCode is freaking out
 #include "IrrigationConfig.h"
-
-#define BUFFER_SIZE (256 * 1024) /* 256 KB */
-
-const char host_id[] = MQTT_HOST;
-const char mqtt_ssid[] = MQTT_SSID_SECRET;
-const char mqtt_password[] = MQTT_PASSWORD_SECRET;
-
-int curr_relay_done = 0;
-int curr_contrlr_done = 0;
-
-typedef struct cimis_results {
-    float Et0;
-    float precip;
-    int parse_errors;   // will save how many json types were incorrect
-} cimis_results;
-
-typedef struct garden_section {
-    const char *name;
-    float PF;            // combined water demand determined by the types of plants being watered
-    long int LA;         // in ft^2, the area the garden section takes up
-    double days_since;   // number of days since last irrigation 
-    float eff_irr;       // effective irrigation value
-    float water_demand;  // the amount of water that the section will need
-    long num_emitter;    // the number of drip emitters in the garden section
-    long relay_num;      // the relay number of that garden section
-    long controller_num; // the ESP module's number for that section of the garden
-} garden_section;
+#include "scheduler.h"
+#include "completion.h"
+#include "cimis_store.h"
+#include "cimis_json.h"
+#include "http_session.h"
+#include "weather.h"
+#include "zone_table.h"
+#include "zone_config.h"
+#include "watering_journal.h"
+#include "water_balance.h"
+#include "metrics.h"
+#include "controller_routes.h"
+#include "relay_protocol.h"
+#include "fleet.h"
+#include "replay.h"
+#include "sweep.h"
+#include "sites.h"
+#include "work_pool.h"
+#include "status_api.h"
+
+#ifndef RELAY_ACK_GRACE_MS
+#define RELAY_ACK_GRACE_MS 5000   // in msec, how long past the runtime to wait for the done topic before calling it a timeout
+#endif
+
+#ifndef DAEMON_RUN_HOUR
+#define DAEMON_RUN_HOUR 7         // local hour of the daily watering run in --daemon mode
+#endif
+
+#define MAX_RELAY_COMMANDS 256    // relays that can be waiting on their ack at the same time
+
+#ifndef SITE_THREADS
+#define SITE_THREADS 8            // sites running at the same time with --sites (a run mostly waits on acks), unless --threads
+#endif
+
+// a controller's part of the run goes out as one schedule frame (see relay_protocol.h), a command per section
+#define SCHEDULE_MAX_ENTRIES 16        // schedule slots on the ESP
+#define SCHEDULE_CANCEL_MARGIN_MS 1000 // sections starting sooner than this may already be on, they are waited on
+#define RELAY_QOS 1                    // commands and acks are delivered at least once, duplicates are dropped by id
+
+#define IRRIGATION_FILE "irrigation_log.json"          // the zone configuration people edit
+#define IRRIGATION_CONFIG_FILE "irrigation_log.bin"    // compiled from it, mapped by the runner
+#define BALANCE_FILE "irrigation_balance.dat"          // root zone depletion of every section
+#define METRICS_FILE "irrigation_metrics.prom"         // timings and counters, Prometheus text format
+#define FLEET_FILE "irrigation_fleet.prom"             // controller health from their heartbeats, same format
+#define REPLAY_FILE "irrigation_replay.csv"            // waterings of a --replay season
+#define SWEEP_FILE "irrigation_sweep.csv"              // ranked coefficients of a --sweep
+#define SITE_LOG_FILE "irrigation_log.txt"             // each site's messages with --sites, in its directory
+#define VALIDATORS_FILE "cimis_validators.txt"         // CIMIS response validators, next to the stores
+#define STATUS_SOCKET_FILE "irrigation.sock"           // the status API of --daemon, unless --socket
+
+typedef struct irrigation_state {
+    site_config site;                        // directory, broker and default station (built in for a single site)
+    char json_path[64];                      // <dir>/irrigation_log.json
+    char config_path[64];                    // <dir>/irrigation_log.bin
+    char balance_path[64];                   // <dir>/irrigation_balance.dat
+    log_streams log;                         // the site's log, stdout and stderr for a single site
+    int failed;                              // the site didn't start, the other sites carry on without it
+    int clashes;                             // uses a controller number another site has, skipped until a reload fixes it
+    int status;                              // of the last run
+    int status_site;                         // the site's index on the status board
+    zone_config config;                      // irrigation_log.json compiled and mapped, kept between runs in daemon mode
+    weather_station stations[MAX_STATIONS];  // CIMIS stations the sections use, their stores are in the shared cache
+    int num_stations;
+    int station_map[MAX_STATIONS];           // cache index of each of the stations
+    weather_cache *weather;                  // shared by every site of the process
+    struct mosquitto *mosq;                  // Libmosquito MQTT client instance
+    completion_queue relay_acks;
+    route_table routes;                      // command and done topic of every controller
+    pthread_mutex_t routes_lock;             // the mosquitto thread looks up acks while a reload swaps the table
+    unsigned long next_command_id;           // 32 bit, rising from the wall clock at startup so a restart doesn't reuse ids
+    zone_table zones;                        // per section inputs and outputs of the demand kernel
+    watering_journal journal;                // confirmed waterings, replayed at startup
+    int daemon;
+} irrigation_state;
+
+
+static int record_watering(irrigation_state *state, water_balance *balance, const irrigation_job *job){
+    /* log a confirmed watering as one journal record (nothing else is rewritten) and credit it to the water balance */
+    watering_event event;
+    struct tm tm_watered;
+    time_t now = time(NULL);
+
+    memset(&event, 0, sizeof(event));
+    event.time = now;
+    localtime_r(&now, &tm_watered);
+    event.day = cimis_civil_to_day(tm_watered.tm_year + 1900, tm_watered.tm_mon + 1, tm_watered.tm_mday);
+    event.gallons = job->duration_ms * job->flow_gph / 3600000.;   // delivered by the emitters
+    event.controller_num = job->controller_num;
+    event.relay_num = job->relay_num;
+    event.duration_ms = job->duration_ms;
+    snprintf(event.zone, ZONE_NAME_LEN, "%s", state->zones.name[job->section]);
+
+    if (watering_journal_append(&state->journal, &event) != 0)
+        return -1;
+    return water_balance_irrigate(balance, &event);
+}
 
 
-struct write_result {
-    char *data;
-    int pos;
-};
+static unsigned long new_command_id(irrigation_state *state) {
+    // 0 is never used, it marks the empty slots on both ends
+    state->next_command_id = (state->next_command_id + 1) & 0xffffffffUL;
+    if (state->next_command_id == 0)
+        state->next_command_id = 1;
+    return state->next_command_id;
+}
 
 
-static size_t write_response(void *ptr, size_t size, size_t nmemb, void *stream) {
-    /* Save the GET response from into write_result struct, function from jannson example code */
-    struct write_result *result = (struct write_result *)stream;
+static void subscribe_routes(irrigation_state *state) {
+    /* the default topics share one wildcard subscription each, only the controllers with their own Topic add theirs.
+    Heartbeats are QoS 0, a lost one is just a gap in the ring */
+    mosquitto_subscribe(state->mosq, NULL, ROUTE_DONE_SUBSCRIPTION, RELAY_QOS);
+    mosquitto_subscribe(state->mosq, NULL, ROUTE_STATUS_SUBSCRIPTION, 0);
 
-    if (result->pos + size * nmemb >= BUFFER_SIZE - 1) {
-        fprintf(stderr, "error: buffer too small\n");
-        return 0;
+    pthread_mutex_lock(&state->routes_lock);
+    for (int r = 0; r < state->routes.num_routes; r++) {
+        if (state->routes.routes[r].default_topic)
+            continue;
+        mosquitto_subscribe(state->mosq, NULL, state->routes.routes[r].done_topic, RELAY_QOS);
+        mosquitto_subscribe(state->mosq, NULL, state->routes.routes[r].status_topic, 0);
     }
-
-    memcpy(result->data + result->pos, ptr, size * nmemb);
-    result->pos += size * nmemb;
-
-    return size * nmemb;
+    pthread_mutex_unlock(&state->routes_lock);
 }
 
 
-static int newline_offset(const char *text) {
-    /* Return the offset of the first newline in text or the length of
-   text if there's no newline */
-    const char *newline = strchr(text, '\n');
-    if(!newline)
-        return strlen(text);
-    else
-        return (int)(newline - text);
+void on_connect(struct mosquitto *mosq, void *obj, int result) {
+    /* subscribe on every (re)connect, the persistent session keeps them but a broker restarted without its
+    persistence file doesn't */
+    if (result == 0)
+        subscribe_routes((irrigation_state *) obj);
 }
 
 
-static char *request(const char *url) {
-    /* CURL GET request from Jansson's github_commit.c example*/
-    CURL *curl = NULL;
-    CURLcode status;
-    struct curl_slist *headers = NULL;
-    char *data = NULL;
-    long code;
-
-    curl_global_init(CURL_GLOBAL_ALL);
-    curl = curl_easy_init();
-    if (!curl)
-        goto error;
-
-    data = malloc(BUFFER_SIZE);
-    if (!data)
-        goto error;
-
-    struct write_result write_result = {.data = data, .pos = 0};
-
-    curl_easy_setopt(curl, CURLOPT_URL, url);
-
-    /* GitHub commits API v3 requires a User-Agent header */
-    // headers = curl_slist_append(headers, "User-Agent: Jansson-Tutorial");
-    // curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-
-    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_response);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &write_result);
-
-    status = curl_easy_perform(curl);
-    if (status != 0) {
-        fprintf(stderr, "error: unable to request data from %s:\n", url);
-        fprintf(stderr, "%s\n", curl_easy_strerror(status));
-        goto error;
+void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg) {
+    /* runs on the mosquitto thread, hands the ack to the main thread through the completion queue. The
+    done frame has to come in on its controller's done topic and names the exact command it completes,
+    heartbeats on the status topic go into the controller's ring */
+    irrigation_state *state = (irrigation_state *) obj;
+    relay_done done;
+    relay_heartbeat heartbeat;
+    long contrlr_done = -1;
+    int kind;
+
+    pthread_mutex_lock(&state->routes_lock);
+    const controller_route *route = route_find_topic(&state->routes, msg->topic, &kind);
+    if (route)
+        contrlr_done = route->controller_num;
+    pthread_mutex_unlock(&state->routes_lock);
+
+    // the wildcard subscriptions also bring the other sites' controllers (and unconfigured ones), not ours to judge
+    if (!route)
+        return;
+
+    if (kind == ROUTE_TOPIC_STATUS) {
+        if (relay_parse_heartbeat(msg->payload, msg->payloadlen, &heartbeat) != 0 || heartbeat.controller_num != contrlr_done)
+            fprintf(state->log.err, "error: %d byte message on %s is not a heartbeat of controller %ld, dropped\n", msg->payloadlen, msg->topic, contrlr_done);
+        else
+            fleet_heartbeat(&heartbeat, time(NULL), &state->log);
+        return;
     }
 
-    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-    if (code != 200) {
-        fprintf(stderr, "error: server responded with code %ld\n", code);
-        goto error;
+    if (relay_parse_done(msg->payload, msg->payloadlen, &done) != 0) {
+        fprintf(state->log.err, "error: %d byte message on %s is not a version %d done frame, dropped\n", msg->payloadlen, msg->topic, RELAY_PROTOCOL_VERSION);
+        metrics_count(COUNTER_UNEXPECTED_ACKS, 1);
+        return;
     }
+	fprintf(state->log.out, "New message with topic %s: command %lu relay %ld done\n", msg->topic, done.command_id, done.relay_num);
 
-    curl_easy_cleanup(curl);
-    curl_slist_free_all(headers);
-    curl_global_cleanup();
+    if (done.controller_num != contrlr_done) {
+        fprintf(state->log.err, "error: ack from controller %ld on %s, which is not its done topic\n", done.controller_num, msg->topic);
+        metrics_count(COUNTER_UNEXPECTED_ACKS, 1);
+        return;
+    }
+    int posted = completion_post(&state->relay_acks, done.controller_num, done.relay_num, done.command_id);
+    if (posted == 1) {
+        metrics_count(COUNTER_DUPLICATE_ACKS, 1);
+        fprintf(state->log.out, "Command %lu was already acked, duplicate dropped\n", done.command_id);
+    } else if (posted != 0) {
+        metrics_count(COUNTER_UNEXPECTED_ACKS, 1);
+        fprintf(state->log.out, "Controller %ld relay %ld command %lu was not waiting on an ack (late or unknown command)\n",
+            done.controller_num, done.relay_num, done.command_id);
+    }
+}
 
-    /* zero-terminate the result */
-    data[write_result.pos] = '\0';
 
-    return data;
+static int stop_requested(const irrigation_state *state) {
+    /* in daemon mode the stop signals are blocked and stay pending until the main loop takes them */
+    sigset_t pending;
 
-error:
-    if (data)
-        free(data);
-    if (curl)
-        curl_easy_cleanup(curl);
-    if (headers)
-        curl_slist_free_all(headers);
-    curl_global_cleanup();
-    return NULL;
+    if (!state->daemon || sigpending(&pending) != 0)
+        return 0;
+    return sigismember(&pending, SIGTERM) || sigismember(&pending, SIGINT);
 }
 
 
-cimis_results parse_cimis_json(json_t *json_root){
-    // to check what type it actually is, go to https://jansson.readthedocs.io/en/2.8/apiref.html#c.json_type
-    // and check typeof (it's an int and the types are listed in order)
-
-    // obtain the Eto values for each day requested to CIMIS
-    json_t *Data, *Providers, *get_records, *Records;
-    const char *eto_value, *precip_value; // values adding up the total precipitation and ETo over specified range
-    cimis_results cimis_out;
-
-    int error_count = 0;
-    float total_precipitation = 0.0; 
-    float total_eto = 0.0;
-
-    Data = json_object_get(json_root, "Data");
-    // Data has to be an object
-    if (!json_is_object(Data)) {
-        // fprintf(stderr, "error: Data is not an object\n");
-        // printf("    Data is a(n) %d\n", json_typeof(json_root));
-        error_count++;
-    } 
-    Providers = json_object_get(Data, "Providers");
-    if (!json_is_array(Providers)) {
-        // fprintf(stderr, "error: Providers is not an array\n");
-        // printf("    is Providers is an array? (1==yes) %d\n", json_is_array(Providers));
-        error_count++; 
-    } 
-    get_records = json_array_get(Providers, 0);
-    if (!json_is_object(get_records)) {
-        error_count++;  
-    } 
-    Records = json_object_get(get_records, "Records");
-    if (!json_is_array(Records)) {
-        error_count++; 
-    }
-    // else {
-    //     printf("The number of days being analyzed is %lu days\n", json_array_size(Records));
-    // }
-
-    for (int i = 0; i < json_array_size(Records); i++) {
-        json_t *get_daydata, *DayAsceEto, *EToValue, *DayPrecip, *PrecipValue;
-
-        get_daydata = json_array_get(Records, i);
-        if (!json_is_object(get_daydata)) {
-            error_count++;  
-        } 
-        DayAsceEto = json_object_get(get_daydata, "DayAsceEto");
-        if (!json_is_object(DayAsceEto)) {
-            error_count++; 
-        } 
-        EToValue = json_object_get(DayAsceEto, "Value");
-        if (!json_is_string(EToValue)) {
-            error_count++; 
-        } 
-
-        eto_value = json_string_value(EToValue);
-            // printf("%.8s %.*s\n", json_string_value(Providers), newline_offset(eto_value),
-            //     eto_value);
-        total_eto = total_eto + strtof(eto_value, NULL);
-
-        // *************** get the Precipitation data for the day *************** //
-        DayPrecip = json_object_get(get_daydata, "DayPrecip");
-        if (!json_is_object(DayPrecip)) {
-            error_count++; 
-        }
+static int load_irrigation(irrigation_state *state) {
+    /* (re)load the zone configuration, the controller routes and the CIMIS stations it uses, irrigation_log.json
+    is only parsed when irrigation_log.bin is missing or older than it */
+    zone_config config;
+    route_table routes;
+    int64_t start_ns = metrics_now_ns();
 
-        PrecipValue = json_object_get(DayPrecip, "Value");
-        if (json_is_null(PrecipValue)) { 
-            // precipitation could be null, just set as zero for now (likely that they don't have the data for the whole day so they provide null)
-            // precip_value = json_string_value(PrecipValue);
-            printf("Precipitation value for the day is null (probably the last day if only one message appears!)\n");
-        } else if (!json_is_string(PrecipValue)) {
-            // fprintf(stderr, "error: PrecipValue is not a string\n");
-            // printf("    PrecipValue is a(n) %d\n", json_typeof(PrecipValue));
-            error_count++; 
-        } else {
-            precip_value = json_string_value(PrecipValue);
-            // printf("%.8s %.*s\n", json_string_value(Providers), newline_offset(precip_value),
-            // precip_value);
-            total_precipitation = total_precipitation + strtof(precip_value, NULL);
-        }
-   
+    fprintf(state->log.out, "opening irrigation file, %s\n", state->json_path);
+    if (zone_config_open(&config, state->json_path, state->config_path, state->site.station, &state->log) != 0)
+        return 1;
+    if (route_table_build(&routes, &config) != 0) {
+        zone_config_close(&config);
+        return 1;
     }
+    metrics_span(SPAN_CONFIG_LOAD, start_ns);
 
-    cimis_out.parse_errors = error_count;
-    cimis_out.Et0 = total_eto;
-    cimis_out.precip = total_precipitation;
+    // the last configuration stays mapped until the new one is ready
+    zone_config_close(&state->config);
+    state->config = config;
 
-    return cimis_out;
-}
+    pthread_mutex_lock(&state->routes_lock);
+    route_table_free(&state->routes);
+    state->routes = routes;
+    pthread_mutex_unlock(&state->routes_lock);
+    // a reload can add controllers with their own topics
+    if (state->mosq)
+        subscribe_routes(state);
 
+    // every CIMIS station the garden sections use, their stores stay open in the cache between runs
+    state->num_stations = zone_config_stations(&state->config, state->stations);
 
-const char * get_json_string(char *Val, json_t *json_data){
-    json_t *getVal;
-    const char *value;
+    return 0;
+}
 
-    getVal = json_object_get(json_data, Val);
-    if (!json_is_string(getVal)) {
-        printf("Is this not a String?\n");
-        printf("    getVal is a(n) %d\n", json_typeof(getVal));
-    }
 
-    return json_string_value(getVal);
-}
+static int mqtt_start(irrigation_state *state) {
+    // setup for MQTT messages to communicate with ESP controlling relay modules
+    int mosq_error = 0;
+    char client_id[16 + SITE_NAME_LEN];
 
+    //Create new libmosquitto client instance (mosquitto_lib_init is called once by main), every site gets its own
+    // client id since two clients with the same id on one broker keep disconnecting each other. The id is fixed and
+    // the session persistent, the broker keeps the QoS 1 acks that come in while the runner is disconnected
+    if (completion_init(&state->relay_acks, MAX_RELAY_COMMANDS) != 0) {
+        fprintf(state->log.err, "error: unable to allocate the relay completion queue\n");
+        return -1;
+    }
+    if (state->site.name[0] != '\0')
+        snprintf(client_id, sizeof(client_id), "irrig_calculator_%s", state->site.name);
+    else
+        snprintf(client_id, sizeof(client_id), "irrig_calculator");
+    state->mosq = mosquitto_new(client_id, false, state);
 
-long get_json_long(char *Val, json_t *json_data){
-    json_t *getVal;
-    long value;
+    if (!state->mosq) {
+	    fprintf(state->log.out, "Error: failed to create mosquitto client\n");
+        completion_destroy(&state->relay_acks);
+        return -1;
+    }
+    mosquitto_connect_callback_set(state->mosq, on_connect);
+    mosquitto_message_callback_set(state->mosq, on_message);
 
-    getVal = json_object_get(json_data, Val); // obtain the int val from JSON data
-    value = json_integer_value(getVal);       // convert to an int/long
-    if (value == 0) {
-        printf("Either the return is zero (offline controllers or relays) or json is not an int?\n");
-        // printf("    getVal is a(n) %d\n", json_typeof(getVal));
+    // connect with a password and user ID
+    if (mosquitto_username_pw_set(state->mosq, state->site.mqtt_user, state->site.mqtt_password) != MOSQ_ERR_SUCCESS) {
+        fprintf(state->log.out, "Error: failed to connect using the provided user ID and password\n");
+        mosq_error += 1;
     }
 
-    return value;
-}
+    //Connect to MQTT broker
+    int64_t start_ns = metrics_now_ns();
+    if (mosquitto_connect(state->mosq, state->site.mqtt_host, state->site.mqtt_port, 60) != MOSQ_ERR_SUCCESS) {
+	    fprintf(state->log.out, "Error: connecting to MQTT broker failed\n");
+        mosq_error += 1;
+    }
+    metrics_span(SPAN_MQTT_CONNECT, start_ns);
 
+    if (mosq_error > 1) {
+        fprintf(state->log.out, "Error: was unable to connect to MQTT broker, stopping program");
 
-double get_json_double(char *Val, json_t *json_data){
-    json_t *getVal;
-    double value;
+        //Clean up/destroy objects created by libmosquitto
+        mosquitto_destroy(state->mosq);
+        completion_destroy(&state->relay_acks);
+        state->mosq = NULL;
 
-    getVal = json_object_get(json_data, Val); // obtain the int val from JSON data
-    value = json_real_value(getVal);       // convert to an int/long
-    if (value == 0.) {
-        printf("Either the return is zero or json is not an int\n");
-        // printf("    getVal is a(n) %d\n", json_typeof(getVal));
+        return -1;
     }
 
-    return value;
-}
-
+    fprintf(state->log.out, "\nNow connected to the broker!\n");
+    // Call to start a new thread to process network traffic (it also reconnects if the broker goes away)
+    mosquitto_loop_start(state->mosq);
 
-void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_message *msg) {
+    return 0;
+}
 
-    char * curr_payload = (char *) msg->payload;
 
-    curr_contrlr_done = atoi(curr_payload);
-    curr_relay_done = atoi(curr_payload+1);
+static void mqtt_stop(irrigation_state *state) {
+    if (!state->mosq)
+        return;
 
-	printf("New message with topic %s: %s\n", msg->topic, (char *) msg->payload);
+    //Clean up/destroy objects created by libmosquitto
+    mosquitto_disconnect(state->mosq);
+    mosquitto_loop_stop(state->mosq, true);
+    mosquitto_destroy(state->mosq);
+    completion_destroy(&state->relay_acks);
+    state->mosq = NULL;
 }
 
 
-int main(){
-    char *cimis_station = CIMIS_STATION;
-    char *cimis_app_key = APP_KEY;
-    // printf("Example of using CMake input file, \n     Irrigation Major Version %d \n     Irrigation Minor Version %d \n", Irrigation_VERSION_MAJOR, Irrigation_VERSION_MINOR);
-
-    time_t date_today, date_start;
-    char today_buffer[80], start_buffer[80];
+static int run_irrigation(irrigation_state *state) {
+    /* one watering run: bring the weather up to date, compute every section's demand and water the ones that need it */
+    time_t date_today;
 
-    struct tm tm_out_today, tm_out_start;
+    struct tm tm_out_today;
 
-    int num_days = 7; // how many days of data do we want to use?
+    int num_days = 7; // how many days of weather a section without a saved water balance starts with
+    int64_t run_start_ns = metrics_now_ns();
+    int64_t start_ns;
 
-    size_t i;
-    char *text;
+    metrics_count(COUNTER_RUNS, 1);
 
-    // CIMIS JSON file
-    json_t *root;
-    json_error_t error;
-    // Last irrigation JSON file
-    json_t *root_irr;
-    json_error_t error_irr;
+    // pick up edits to irrigation_log.json, a failed reload keeps the last mapped configuration
+    if (zone_config_stale(&state->config) && load_irrigation(state) != 0)
+        fprintf(state->log.err, "error: %s could not be compiled, using the last zone configuration\n", state->json_path);
+    const zone_config *config = &state->config;
 
     // provides the current date and time in seconds since the Epoch for the end date provided to CIMIS
     time(&date_today);
     date_today = date_today - 86400; // use previous day's data since the current date's data will all be NULL
-    // subtract the number of days (in seconds) of desired CIMIS data to obtain a start date
-    date_start = date_today - num_days*86400;
 
-    // represent the start and end dates in date and time components (local time)
+    // represent the end date in date and time components (local time) and as a day number for the CIMIS store
     localtime_r(&date_today, &tm_out_today);
-    localtime_r(&date_start, &tm_out_start);
-
-    // format the strings according to the format specified by CIMIS 
-    strftime(today_buffer, sizeof(today_buffer), "%Y-%m-%d", &tm_out_today);
-    strftime(start_buffer, sizeof(start_buffer), "%Y-%m-%d", &tm_out_start);
-
-    // stitch together the file name strings
-    char *file_name = malloc(strlen("cimis_") + strlen(start_buffer) + strlen("_") + strlen(today_buffer) + strlen(".json") + 1); // +1 for the null-terminator
-    // make function that has full_url passed as a pointer ref to concatenate the values internally, but can still free the pointer outside of the function
-    // add checks for errors in malloc here
-    strcpy(file_name, "cimis_");
-    strcat(file_name, start_buffer);
-    strcat(file_name, "_");
-    strcat(file_name, today_buffer);
-    strcat(file_name, ".json");
-
-    // char *file_name = "cimis_2023-07-06_2023-07-13.json";   // hard coded for testing, see above code for real file name creation, will cause an invalide free at the end 
-    // printf("Testing to see if file %s exists\n", file_name);
-
-    // check if call has already been made for this dataset by checking if a file already exists for it
-    FILE *open_file = fopen(file_name, "r");
-    if (open_file == NULL) {
-        printf("File for desired dates does not exist, requesting data from CIMIS");
-
-        // set up the url link with the API key, weather station number, and start and end dates for the data (obtain daily weather data)
-        char *full_url = malloc(strlen("https://et.water.ca.gov/api/data?appKey=") + strlen(cimis_app_key) + strlen("&targets=") + strlen(cimis_station) + strlen("&startDate=") + strlen(start_buffer) + strlen("&endDate=") + strlen(today_buffer) + 1); 
-        // make function that has full_url passed as a pointer ref to concatenate the values internally, but can still free the pointer outside of the function
-        // add checks for errors in malloc here
-        strcpy(full_url, "https://et.water.ca.gov/api/data?appKey=");
-        strcat(full_url, cimis_app_key);
-        strcat(full_url, "&targets=");
-        strcat(full_url, cimis_station);
-        strcat(full_url, "&startDate=");
-        strcat(full_url, start_buffer);
-        strcat(full_url, "&endDate=");
-        strcat(full_url, today_buffer);
-
-        // printf("\nGET call to url: \n%s\n", full_url);
-
-        // Jansson's function call to request data from url from Jannson's github_commit.c example
-        text = request(full_url);
-        if(!text)
-            return 1;
+    int32_t end_day = cimis_civil_to_day(tm_out_today.tm_year + 1900, tm_out_today.tm_mon + 1, tm_out_today.tm_mday);
 
-        root = json_loads(text, 0, &error);
-        // printf("%s", text);
-        free(text);
+    // need to iterate through data over all the garden sections
+    long int num_sections = config->num_zones;
+    fprintf(state->log.out, "The number of garden sections with separate irrigation systems is: %ld\n\n", num_sections);
+
+    // the zone table is kept between runs in daemon mode, it only grows when sections are added
+    zone_table *zones = &state->zones;
+    zone_weather *weather = malloc(num_sections * sizeof(zone_weather) + 1);
+    if (!weather || zone_table_resize(zones, num_sections) != 0) {
+        free(weather);
+        return -1;
+    }
 
-        if (!root) {
-            fprintf(stderr, "error: on line %d: %s\n", error.line, error.text);
-            return 1;
-        }
+    water_source sources[MAX_WATER_SOURCES];
+    int num_sources = zone_config_sources(config, sources);
 
-        // dump json into a file
-        json_dump_file(root, file_name, 0);
-        printf("\nJSON being saved to file: %s\n", file_name);
+    zone_config_fill(config, state->stations, zones, weather);
+    for (int i = 0; i < num_sections; i++) {
+        // a section without a saved balance starts at field capacity after its last watering, at most num_days ago;
+        // the journal has the waterings, the JSON Date only the ones from before it existed
+        const zone_watering *watered = watering_journal_find(&state->journal, config->zones[i].name);
+        int32_t last_watered = config->zones[i].last_watered_day;
+        if (watered && watered->last_day > last_watered)
+            last_watered = watered->last_day;
+        int32_t start = last_watered > end_day - num_days ? last_watered : end_day - num_days;
+        zones->last_day[i] = start - 1;
+        zones->depletion[i] = 0.f;
+    }
 
-        free(full_url); // deallocate the file_name string
-        printf("CIMIS data obtained and cached\n");
+    // the saved balance, plus any watering logged after it was saved (e.g. a run that was killed); without a saved
+    // balance the journal's last waterings above already seeded every section
+    start_ns = metrics_now_ns();
+    water_balance balance;
+    int loaded = water_balance_load(&balance, state->balance_path, zones, &state->log);
+    if (loaded < 0) {
+        water_balance_free(&balance);
+        free(weather);
+        return -1;
+    }
+    if (loaded == 1)
+        balance.seq = state->journal.next_seq - 1;
+    watering_journal_replay(&state->journal, balance.seq, water_balance_irrigate, &balance);
+    metrics_span(SPAN_BALANCE, start_ns);
 
+    // only the days the balance doesn't have yet are needed
+    int32_t start_day = end_day;
+    for (int i = 0; i < num_sections; i++) {
+        if (zones->last_day[i] + 1 < start_day)
+            start_day = zones->last_day[i] + 1;
     }
-    else {
-        // The file exists which means a GET call has already been made for this date range
-        printf("File for desired dates already exists, opening JSON file %s\n", file_name);
-        root = json_load_file(file_name, 0, &error);
-        if(!root) {
-            printf("Could not open file %s\n", file_name);
-            fprintf(stderr, "ERROR: on line %d: %s\n", error.line, error.text);
-            return 1;
-        }
-        // clean up by closing the file
-        fclose(open_file);
+    if (start_day < end_day - BALANCE_MAX_CATCHUP_DAYS)
+        start_day = end_day - BALANCE_MAX_CATCHUP_DAYS;
+
+    // every station in one concurrent batch, only the days missing from their stores are requested (a station
+    // another site brought up to date already has them)
+    start_ns = metrics_now_ns();
+    int num_unusable = weather_cache_update(state->weather, state->stations, state->num_stations, state->station_map, start_day, end_day, &state->log);
+    metrics_span(SPAN_CIMIS_FETCH, start_ns);
+    if (num_unusable < 0) {
+        water_balance_free(&balance);
+        free(weather);
+        return -1;
+    }
+    if (num_unusable == state->num_stations) {
+        // the saved balance still holds, the sections wait for the missing days
+        fprintf(state->log.err, "ERROR: none of the %d CIMIS stations has usable data.\n", state->num_stations);
     }
 
-    cimis_results cimis_out;
-    cimis_out = parse_cimis_json(root);
-    if (cimis_out.parse_errors > 0){
-        fprintf(stderr, "ERROR: there were %d type errors when parsing the Et0 JSON file.\n", cimis_out.parse_errors);
-        return 1;
+    // the sections' stations are read from the cache from here on
+    for (int i = 0; i < num_sections; i++) {
+        for (int k = 0; k < weather[i].num_stations; k++)
+            weather[i].station[k] = state->station_map[weather[i].station[k]];
     }
-    json_decref(root);
 
-    printf("CIMIS Et0 reads %.2f\n", cimis_out.Et0);
-    printf("CIMIS precip reads %.2f\n", cimis_out.precip);
+    // one batched balance step per new day, then the sections past their depletion threshold get their demand
+    start_ns = metrics_now_ns();
+    pthread_rwlock_rdlock(&state->weather->lock);
+    status_cache(state->weather->stations, state->weather->num_stations, time(NULL));
+    int num_new_days = water_balance_advance(&balance, weather, state->weather->stations, end_day, CIMIS_REFETCH_DAYS);
+    pthread_rwlock_unlock(&state->weather->lock);
+    metrics_span(SPAN_BALANCE, start_ns);
+    fprintf(state->log.out, "Water balance advanced by %d days\n\n", num_new_days);
+    free(weather);
+    start_ns = metrics_now_ns();
+    zone_demand_kernel(zones);
+    status_zones(state->status_site, zones, end_day);
+
+    fprintf(state->log.out, "---------------------------------------------------------------------\n");
+    fprintf(state->log.out, "   Section    |         Gallons of H2O needed to meet demand\n");
+    fprintf(state->log.out, "---------------------------------------------------------------------\n");
+
+    // collect the sections that need water, make sure there are offline controllers and relays are set at 0 so that those can be ignored until they come online
+    irrigation_job *jobs = malloc(num_sections * sizeof(irrigation_job) + 1);
+    int num_jobs = 0;
+    long serial_ms = 0;
 
-        
-    char *irrigation_file = "irrigation_log.json";
-    FILE *open_last_file = fopen(irrigation_file, "r");
+    for (int i = 0; i < num_sections; i++) {
+        if (zones->water_demand[i] <= 0.)
+            continue;
 
-    printf("opening JSON irrigation file, irrigation_log.json\n");
-    root_irr = json_load_file(irrigation_file, 0, &error_irr);
-    if(!root_irr) {
-        printf("Could not open irrigation file %s\n", file_name);
-        fprintf(stderr, "ERROR: on line %d: %s\n", error_irr.line, error_irr.text);
-        return 1;
-    }
+        fprintf(state->log.out, "   %s", zones->name[i]);
+        fprintf(state->log.out, "   |                       %.3f   \n", zones->water_demand[i]);
+        fprintf(state->log.out, "---------------------------------------------------------------------\n");
 
-    json_t *Data, *get_records;
-    const char *irr_value; // values adding up the total precipitation and ETo over specified range
-
-    // 
-    Data = json_object_get(root_irr, "Data");
-    // Data is an array, but we first get it as an object
-    if (!json_is_array(Data)) {
-        fprintf(stderr, "error: Data is not an array\n");
-        printf("    Data is a(n) %d\n", json_typeof(root_irr));
-        // error_count++;
-    } 
-    
-    // calculate the effective precipitation from CIMIS data
-    float effective_precipitation = cimis_out.precip * 0.5 * 0.623; // in gallons
-    // need to iterate through data over all the garden sections
-    long int num_sections = json_array_size(Data);
-    printf("The number of garden sections with separate irrigation systems is: %ld\n\n", num_sections);
-    printf("---------------------------------------------------------------------\n");
-    printf("   Section    |         Gallons of H2O needed to meet demand\n");
-    printf("---------------------------------------------------------------------\n");
+        if (zones->relay_num[i] > 0 && zones->controller_num[i] > 0) { 
+            // drip irigation units are gal/hr and we need to send msec to ESP
+            long irr_timer = (long)zones->runtime_ms[i];
+
+            jobs[num_jobs].section = i;
+            jobs[num_jobs].controller_num = zones->controller_num[i];
+            jobs[num_jobs].relay_num = zones->relay_num[i];
+            jobs[num_jobs].source = zones->source[i];
+            jobs[num_jobs].flow_gph = zones->flow_gph[i];
+            jobs[num_jobs].duration_ms = irr_timer;
+            num_jobs++;
+            serial_ms += irr_timer;
+        }
+    }
 
-    garden_section section_array[num_sections];
+    metrics_span(SPAN_DEMAND, start_ns);
 
-    for (int i = 0; i < num_sections; i++) {
-        float amount_irrigated = 0.;
-        float effective_irrigation = 0.;
-        const char *date_str;
-        char today_irr_buffer[80], demand_ceil[50];
-        struct tm last_tm_irrigated;
-        time_t t_irr = time(NULL);
-
-        section_array[i].water_demand = 0.;
-
-        get_records = json_array_get(Data, i);
-        if (!json_is_object(get_records)) {
-            printf("error getting the objects within the array at loop %d\n", i); 
-        } 
-
-        section_array[i].name = get_json_string("Name", get_records);
-        section_array[i].num_emitter = get_json_long("numEmitters", get_records);
-        section_array[i].relay_num = get_json_long("Relay", get_records);
-        section_array[i].controller_num = get_json_long("Controller", get_records);
-
-        // printf("The name of the section is %s\n", section_array[i].name);
-        section_array[i].PF = strtof(get_json_string("PF", get_records), NULL);
-        section_array[i].LA = get_json_long("LA", get_records);
-        // printf("the LA is %ld\n", section_array[i].LA);
-
-        // obtain the date when irrigation happened last and find the difference between it and the current date
-        date_str = get_json_string("Date", get_records);
-        if (strptime(date_str, "%Y-%m-%d %T", &last_tm_irrigated) == NULL) {
-            fprintf(stderr, "error: unable to convert string to tm struct\n");
-            return -1;
-        } 
+    // plan the whole run up front, packing the sections into concurrent runs under each water source's flow budget
+    const route_table *routes = &state->routes;
+    long *start_ms = malloc(num_jobs * sizeof(long) + 1);
+    relay_frame *frames = calloc(routes->num_routes + 1, sizeof(relay_frame));
+    if (!start_ms || !frames || scheduler_plan(jobs, num_jobs, sources, num_sources, start_ms) < 0) {
+        fprintf(state->log.err, "ERROR: unable to allocate the schedule of %d sections\n", num_jobs);
+        num_jobs = 0;
+    }
+    long total_ms = 0;
+    for (int j = 0; j < num_jobs; j++) {
+        if (start_ms[j] + jobs[j].duration_ms > total_ms)
+            total_ms = start_ms[j] + jobs[j].duration_ms;
+    }
+    fprintf(state->log.out, "Watering %d sections should take %ld sec (%ld sec if run one at a time)\n\n", num_jobs, total_ms/1000, serial_ms/1000);
+
+    // each controller gets its part of the plan in one schedule frame on its command topic and runs it on its own
+    // clock, a job is JOB_RUNNING from the moment it is handed to its controller until its ack (or timeout)
+    long sent_ms = monotonic_ms();
+    int num_waiting = 0;
+    for (int j = 0; j < num_jobs; j++) {
+        irrigation_job *job = &jobs[j];
+        const controller_route *route = route_find(routes, job->controller_num);
+
+        job->state = JOB_DONE;
+        if (!route) {
+            fprintf(state->log.out, "No topic for controller %lu, skipping section %s\n\n", job->controller_num, zones->name[job->section]);
+            continue;
+        }
+        relay_frame *frame = &frames[route - routes->routes];
+        if (frame->num_entries == 0) {
+            char reason[80];
+            relay_frame_schedule(frame, job->controller_num);
+            // sent anyway, the warning is so a node that keeps missing waterings is looked at
+            if (fleet_warning(job->controller_num, time(NULL), reason, sizeof(reason)))
+                fprintf(state->log.err, "WARNING: controller %ld looks unhealthy, %s\n", job->controller_num, reason);
+        }
+        if (frame->num_entries == SCHEDULE_MAX_ENTRIES) {
+            fprintf(state->log.err, "ERROR: more than %d sections on controller %ld, section %s waits for the next run\n",
+                SCHEDULE_MAX_ENTRIES, job->controller_num, zones->name[job->section]);
+            continue;
+        }
+        // the ack has to arrive within the start offset and runtime plus a grace period, or the command timed out.
+        // A section the ESP resumes after a reset starts up to RELAY_RESUME_MAX_LATE_MS late and still runs whole
+        job->command_id = new_command_id(state);
+        if (completion_expect(&state->relay_acks, job->controller_num, job->relay_num, job->command_id,
+                sent_ms + start_ms[j] + job->duration_ms + RELAY_RESUME_MAX_LATE_MS + RELAY_ACK_GRACE_MS, j) != 0) {
+            fprintf(state->log.err, "ERROR: more than %d relays waiting on acks, section %s is not logged as watered\n", MAX_RELAY_COMMANDS, zones->name[job->section]);
+            continue;
+        }
+        if (relay_frame_add(frame, job->command_id, job->relay_num, job->duration_ms, start_ms[j]) != 0) {
+            fprintf(state->log.err, "ERROR: the schedule of controller %ld is full, section %s waits for the next run\n",
+                job->controller_num, zones->name[job->section]);
+            completion_cancel(&state->relay_acks, j);
+            continue;
+        }
 
-        last_tm_irrigated.tm_isdst = -1;   // avoid manually determining if DST or not
-        // puts( asctime(&last_tm_irrigated) );
+        fprintf(state->log.out, "Section %s will be watered for %lu msec, %ld sec into the run (relay %lu on controller %lu, %s)\n", zones->name[job->section],
+            job->duration_ms, start_ms[j]/1000, job->relay_num, job->controller_num, sources[job->source].name);
+        job->state = JOB_RUNNING;
+        num_waiting++;
+        status_command(state->status_site, job->command_id, job->controller_num, job->relay_num, zones->name[job->section],
+            start_ms[j], job->duration_ms, time(NULL));
+    }
 
-        section_array[i].days_since = difftime(date_today, mktime(&last_tm_irrigated)) / 86400;  // converts from seconds to days
-        // printf("%.f days have passed since last irrigation.\n", section_array[i].days_since);
+    for (int r = 0; r < routes->num_routes && num_jobs > 0; r++) {
+        char payload[RELAY_FRAME_MAX];
 
-        if (section_array[i].days_since > 7.) {
-            // don't include irrigation in current calculations
-            section_array[i].days_since = 0.;
-        } else {
-            // amount_irrigated = get_json_long("Gallons", get_records);
-            amount_irrigated = strtof(get_json_string("Gallons", get_records), NULL);
-            effective_irrigation = amount_irrigated * 0.7; // in gallons, drip irrigation is not 100% effective, but better than flood
-            // effective_irrigation = (float)amount_irrigated * 0.7; // in gallons, drip irrigation is not 100% effective, but better than flood
+        if (frames[r].num_entries == 0)
+            continue;
+        int length = relay_frame_finish(&frames[r], payload);
+        start_ns = metrics_now_ns();
+        mosquitto_publish(state->mosq, NULL, routes->routes[r].cmd_topic, length, payload, RELAY_QOS, false);
+        metrics_span(SPAN_PUBLISH, start_ns);
+        metrics_count(COUNTER_PUBLISHES, 1);
+    }
+    fprintf(state->log.out, "\n");
+
+    int stopping = 0;
+    while (num_waiting > 0) {
+        int done_job;
+        long ack_latency_ms;
+
+        if (!stopping && stop_requested(state)) {
+            // the controllers drop the sections that haven't started yet, the running ones turn off on their own timers
+            long elapsed_ms = monotonic_ms() - sent_ms;
+            int num_cancelled = 0;
+
+            stopping = 1;
+            for (int r = 0; r < routes->num_routes; r++) {
+                relay_frame cancel;
+                char payload[RELAY_FRAME_MAX];
+
+                if (frames[r].num_entries == 0)
+                    continue;
+                relay_frame_cancel(&cancel, routes->routes[r].controller_num, new_command_id(state));
+                int length = relay_frame_finish(&cancel, payload);
+                mosquitto_publish(state->mosq, NULL, routes->routes[r].cmd_topic, length, payload, RELAY_QOS, false);
+            }
+            for (int j = 0; j < num_jobs; j++) {
+                if (jobs[j].state == JOB_RUNNING && start_ms[j] > elapsed_ms + SCHEDULE_CANCEL_MARGIN_MS
+                        && completion_cancel(&state->relay_acks, j) == 0) {
+                    jobs[j].state = JOB_DONE;
+                    num_waiting--;
+                    num_cancelled++;
+                    status_command_done(state->status_site, jobs[j].command_id, STATUS_CANCELLED, 0, time(NULL));
+                }
+            }
+            fprintf(state->log.out, "Stop requested, %d sections that had not started are cancelled\n", num_cancelled);
+            continue;
         }
 
-        section_array[i].water_demand = (cimis_out.Et0 * section_array[i].PF * section_array[i].LA * 0.623) - effective_precipitation - effective_irrigation;  // in gallons
-        if (section_array[i].water_demand <= 0.) {
-            // zero or negative water demand mean that there is no need for irrigation 
-            section_array[i].water_demand = 0.;
+        // block until any relay reports back (or misses its deadline)
+        int result = completion_wait(&state->relay_acks, &done_job, &ack_latency_ms);
+        if (result == COMPLETION_EMPTY)
+            break;
+        num_waiting--;
+
+        irrigation_job *job = &jobs[done_job];
+        int i = job->section;
+        job->state = JOB_DONE;
+        if (result == COMPLETION_ACKED) {
+            fprintf(state->log.out, "Garden section %s successfully watered! (ack after %ld msec)\n\n", zones->name[i], ack_latency_ms);
+            metrics_ack(job->controller_num, ack_latency_ms, start_ms[done_job] + job->duration_ms);
+            status_command_done(state->status_site, job->command_id, STATUS_ACKED, ack_latency_ms, time(NULL));
+            // the watering is only logged after the ESP confirms the section was watered
+            if (record_watering(state, &balance, job) != 0)
+                fprintf(state->log.err, "ERROR: section %s was watered but could not be logged\n", zones->name[i]);
         } else {
-            printf("   %s", section_array[i].name);
-            printf("   |                       %.3f   \n", section_array[i].water_demand);
-            printf("---------------------------------------------------------------------\n");
-
-            // setup irrigation json updating only for online relays
-            if (section_array[i].relay_num > 0 && section_array[i].controller_num > 0) {
-                // save the new date to "Date" and amount watered to "Gallons" to update the irrigation json later (after confirming that it was watered)
-                strftime(today_irr_buffer, sizeof(today_irr_buffer), "%Y-%m-%d %T", &tm_out_today);
-                // printf("The new date is %s\n", today_irr_buffer);
-                json_object_set(get_records, "Date", json_string(today_irr_buffer));
-
-                snprintf(demand_ceil, 50, "%f", section_array[i].water_demand); 
-                json_object_set(get_records, "Gallons", json_string(demand_ceil));
-            }
+            fprintf(state->log.err, "ERROR: no ack from controller %ld relay %ld within %ld msec, section %s is not logged as watered\n",
+                job->controller_num, job->relay_num, ack_latency_ms, zones->name[i]);
+            metrics_ack_timeout(job->controller_num);
+            status_command_done(state->status_site, job->command_id, STATUS_TIMEOUT, ack_latency_ms, time(NULL));
         }
     }
 
-    // setup for MQTT messages to communicate with ESP controlling relay modules
-    struct mosquitto *mosq;     /**< Libmosquito MQTT client instance. */
+    free(frames);
+    free(start_ms);
+    free(jobs);
+    // the balance after the waterings, until the next run
+    status_zones(state->status_site, zones, end_day);
 
-    int mosq_error = 0;
+    if (water_balance_save(&balance) != 0)
+        fprintf(state->log.err, "error: the water balance was not saved, the next run adds the days again from the last save\n");
+    water_balance_free(&balance);
 
-    //libmosquitto initialization
-    mosquitto_lib_init();
+    metrics_span(SPAN_RUN, run_start_ns);
+    return 0;
+}
 
-    //Create new libmosquitto client instance
-    mosq = mosquitto_new("irrig_calculator", true, NULL);
-    mosquitto_message_callback_set(mosq, on_message);
 
-    if (!mosq) {
-	    printf("Error: failed to create mosquitto client\n");
-        mosq_error += 1;
+static time_t next_run_time(time_t now, int run_hour, int run_minute) {
+    /* the next local run_hour:run_minute after now (mktime takes care of month ends and DST) */
+    struct tm tm_next;
+
+    localtime_r(&now, &tm_next);
+    tm_next.tm_hour = run_hour;
+    tm_next.tm_min = run_minute;
+    tm_next.tm_sec = 0;
+    tm_next.tm_isdst = -1;
+    time_t next = mktime(&tm_next);
+    if (next <= now) {
+        tm_next.tm_mday += 1;
+        tm_next.tm_hour = run_hour;
+        tm_next.tm_min = run_minute;
+        tm_next.tm_isdst = -1;
+        next = mktime(&tm_next);
     }
+    return next;
+}
 
-    // connect with a password and user ID
-    if (mosquitto_username_pw_set(mosq, mqtt_ssid, mqtt_password) != MOSQ_ERR_SUCCESS) {
-        printf("Error: failed to connect using the provided user ID and password\n");
-        mosq_error += 1;
+
+static int run_replay(const char *json_path, const replay_options *replay, const sweep_options *sweep) {
+    /* the season replay and the sweep need the zone configuration only, no journal, CIMIS session or broker */
+    zone_config config;
+    char config_path[64];
+
+    memset(&config, 0, sizeof(config));
+    if (strcmp(json_path, IRRIGATION_FILE) == 0) {
+        snprintf(config_path, sizeof(config_path), "%s", IRRIGATION_CONFIG_FILE);
+    } else if (snprintf(config_path, sizeof(config_path), "%s.bin", json_path) >= (int)sizeof(config_path)) {
+        fprintf(stderr, "error: the path %s is too long\n", json_path);
+        return 1;
     }
+    if (zone_config_open(&config, json_path, config_path, CIMIS_STATION, NULL) != 0)
+        return 1;
+    int status = sweep->weather_path ? sweep_run(&config, sweep) : replay_run(&config, replay);
+    zone_config_close(&config);
+    return status == 0 ? 0 : 1;
+}
 
-    //Connect to MQTT broker
-    if (mosquitto_connect(mosq, host_id, 1883, 60) != MOSQ_ERR_SUCCESS) {
-	    printf("Error: connecting to MQTT broker failed\n");
-        mosq_error += 1;
+
+static void site_close(irrigation_state *state) {
+    /* every part of a site, also the parts a failed site_open never got to */
+    mqtt_stop(state);
+    zone_table_free(&state->zones);
+    watering_journal_close(&state->journal);
+    zone_config_close(&state->config);
+    route_table_free(&state->routes);
+    if (state->log.out && state->log.out != stdout) {
+        fclose(state->log.out);
+        state->log.out = state->log.err = NULL;
     }
+}
 
-    if (mosq_error > 1) {
-        printf("Error: was unable to connect to MQTT broker, stopping program");
 
-        // clean up by closing the file and json root for irrigation file
-        fclose(open_last_file);
-        json_decref(root_irr);
-        // deallocate the CIMIS file_name string
-        free(file_name); 
-        //Clean up/destroy objects created by libmosquitto
-        mosquitto_destroy(mosq);
-        mosquitto_lib_cleanup();
+static int site_open(irrigation_state *state, const site_config *site, weather_cache *weather, int daemon) {
+    /* a site's paths, zone configuration, watering journal and broker session. A single site logs to stdout and
+    stderr like it always did, with --sites each site writes its messages to its own log in its directory */
+    // "<dir>/irrigation" and "<dir>/irrigation_log.txt" fit whatever Dir sites_load accepted
+    char log_path[SITE_DIR_LEN + 24], journal_prefix[SITE_DIR_LEN + 16];
+
+    state->site = *site;
+    state->weather = weather;
+    state->daemon = daemon;
+    state->log.out = stdout;
+    state->log.err = stderr;
+    pthread_mutex_init(&state->routes_lock, NULL);
+    state->next_command_id = (unsigned long)time(NULL) & 0xffffffffUL;
+    state->status_site = status_site(site->name);
+
+    if (site_path(site, IRRIGATION_FILE, state->json_path, sizeof(state->json_path)) != 0
+            || site_path(site, IRRIGATION_CONFIG_FILE, state->config_path, sizeof(state->config_path)) != 0
+            || site_path(site, BALANCE_FILE, state->balance_path, sizeof(state->balance_path)) != 0
+            || site_path(site, "irrigation", journal_prefix, sizeof(journal_prefix)) != 0
+            || site_path(site, SITE_LOG_FILE, log_path, sizeof(log_path)) != 0)
+        return -1;
+    if (site->name[0] != '\0') {
+        FILE *log = fopen(log_path, "a");
+        if (log == NULL) {
+            fprintf(stderr, "error: cannot open %s\n", log_path);
+            return -1;
+        }
+        // line buffered, a site that stops half way still leaves whole lines behind
+        setvbuf(log, NULL, _IOLBF, 0);
+        state->log.out = state->log.err = log;
+    }
 
+    if (load_irrigation(state) != 0 || watering_journal_open(&state->journal, journal_prefix, &state->log) != 0 || mqtt_start(state) != 0) {
+        site_close(state);
         return -1;
     }
+    return 0;
+}
 
-    // subscribe to the ESP's callback
-    mosquitto_subscribe(mosq, NULL, "/relay_done", 0);
 
-    printf("\nNow connected to the broker!\n");
-    // Call to start a new thread to process network traffic
-    mosquitto_loop_start(mosq);
+static void check_controllers(irrigation_state *sites, int num_sites) {
+    /* the metrics and the controller health are labelled by controller number alone (and two sites on one broker
+    would share the topics), a site that uses a controller number an earlier site has is left out until one of them
+    is renumbered */
+    for (int s = 0; s < num_sites; s++) {
+        sites[s].clashes = 0;
+        for (int r = 0; r < sites[s].routes.num_routes && !sites[s].failed && !sites[s].clashes; r++) {
+            long controller_num = sites[s].routes.routes[r].controller_num;
+
+            for (int t = 0; t < s; t++) {
+                if (sites[t].failed || sites[t].clashes || !route_find(&sites[t].routes, controller_num))
+                    continue;
+                fprintf(stderr, "error: sites %s and %s both use controller %ld, %s does not run\n",
+                    sites[t].site.name, sites[s].site.name, controller_num, sites[s].site.name);
+                fprintf(sites[s].log.err, "error: site %s already uses controller %ld, this site does not run until one of them is renumbered\n",
+                    sites[t].site.name, controller_num);
+                sites[s].clashes = 1;
+                break;
+            }
+        }
+    }
+}
 
-    for (int i = 0; i < num_sections; i++) {
-        // send messages to ESP to turn on relays for a given amount of time
-        if (section_array[i].water_demand > 0. && (section_array[i].relay_num > 0 && section_array[i].controller_num > 0)) { 
-            // make sure there are offline controllers and relays are set at 0 so that those can be ignored until they come online
 
-            // drip irigation units are gal/hr and we need to send msec to ESP
-            // long irr_timer = (long)(1000 * section_array[i].water_demand / (section_array[i].num_emitter * 0.7)); // assumes drip is set to 1 gal/sec for testing -> keeps the times shorter
-            long irr_timer = (long)(3600*1000 * section_array[i].water_demand / (section_array[i].num_emitter * 0.7));  // in msec
-            printf("Section %s will be watered for %lu msec\n", section_array[i].name, irr_timer);
-            printf("turning ON relay %lu\n", section_array[i].relay_num);
+static void run_site(void *ctx, int worker, int s) {
+    /* work_pool item, one site's watering run; whatever goes wrong stays in that site's state and log */
+    irrigation_state *state = &((irrigation_state *)ctx)[s];
+    (void)worker;
 
-            char mssg_out[7];
-            sprintf(mssg_out, "%lu %lu", section_array[i].relay_num, irr_timer);
+    if (state->failed || state->clashes)
+        return;
+    status_run_start(state->status_site, time(NULL));
+    state->status = run_irrigation(state);
+    status_run_end(state->status_site, time(NULL), state->status);
+    if (state->status != 0 && state->site.name[0] != '\0')
+        fprintf(stderr, "error: the watering run of site %s failed, see its log\n", state->site.name);
+    fflush(state->log.out);
+}
 
-            if (section_array[i].controller_num == 1) {
-                mosquitto_publish(mosq, NULL, "/back_yard", 7, mssg_out, 0, false);                
-            } // add more topics as the ESPs come online
 
-            int sleep_time = (int)(irr_timer)/1000 + 1; // add two seconds so that the relays never turn on at the same time (pressure problems if using the same source of water)
-            printf("computer sleeps for %d seconds\n", sleep_time);
+static int run_sites(irrigation_state *sites, int num_sites, int num_threads) {
+    /* every site's run, at most num_threads at a time, then the process-wide metrics and controller health */
+    int status = 0;
 
-            sleep(sleep_time); // sleep for the expected amount of time the relay is on plus another second (add a return message later that stops sleep?)
+    work_pool_run(num_threads, num_sites, run_site, sites);
+    for (int s = 0; s < num_sites; s++) {
+        if (sites[s].failed || sites[s].clashes || sites[s].status != 0)
+            status = 1;
+    }
+    metrics_write(METRICS_FILE);
+    fleet_write(FLEET_FILE);
+    return status;
+}
 
-            // check to see if there was a return message from the correct controller and relay
-            if (curr_contrlr_done == section_array[i].controller_num && curr_relay_done == section_array[i].relay_num) {
-                printf("Garden section successfully watered!\n\n");
+
+static int run_daemon(irrigation_state *sites, int num_sites, int num_threads, int run_hour, int run_minute) {
+    /* keep the MQTT sessions, CIMIS stores and zone tables in memory and water every day at run_hour:run_minute.
+    SIGTERM/SIGINT stop after the running relays report back, SIGHUP reloads every site's irrigation_log.json */
+    sigset_t signals;
+    char next_buffer[80];
+
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGTERM);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGHUP);
+
+    for (;;) {
+        time_t next = next_run_time(time(NULL), run_hour, run_minute);
+        status_next_run(next);
+        struct tm tm_next;
+        localtime_r(&next, &tm_next);
+        strftime(next_buffer, sizeof(next_buffer), "%Y-%m-%d %T", &tm_next);
+        printf("Next watering run at %s\n", next_buffer);
+        fflush(stdout);
+
+        // sleep until the run, waking up for signals and to refresh the controller health every heartbeat interval
+        for (;;) {
+            time_t now = time(NULL);
+            if (now >= next)
+                break;
+            fleet_write(FLEET_FILE);
+
+            struct timespec timeout = {.tv_sec = next - now < FLEET_HEARTBEAT_S ? next - now : FLEET_HEARTBEAT_S, .tv_nsec = 0};
+            int signal_number = sigtimedwait(&signals, NULL, &timeout);
+            if (signal_number == SIGTERM || signal_number == SIGINT) {
+                printf("Received signal %d, shutting down\n", signal_number);
+                return 0;
+            }
+            if (signal_number == SIGHUP) {
+                printf("Received SIGHUP, reloading irrigation_log.json\n");
+                for (int s = 0; s < num_sites; s++) {
+                    if (!sites[s].failed && load_irrigation(&sites[s]) != 0)
+                        fprintf(stderr, "error: reload of %s failed, keeping the last zone table\n", sites[s].json_path);
+                }
+                check_controllers(sites, num_sites);
             }
+            // EAGAIN (the run is due or the fleet file is due) and EINTR go around and check the time again
+        }
+
+        run_sites(sites, num_sites, num_threads);
+        fflush(stdout);
+
+        if (stop_requested(&sites[0])) {
+            printf("Shutting down after the watering run\n");
+            return 0;
+        }
+    }
+}
+
+
+int main(int argc, char **argv){
+    // printf("Example of using CMake input file, \n     Irrigation Major Version %d \n     Irrigation Minor Version %d \n", Irrigation_VERSION_MAJOR, Irrigation_VERSION_MINOR);
+    // the single site: the working directory, the broker and station built in through IrrigationConfig.h
+    site_config defaults = {.name = "", .dir = "", .station = CIMIS_STATION, .mqtt_host = MQTT_HOST, .mqtt_port = 1883,
+        .mqtt_user = MQTT_SSID_SECRET, .mqtt_password = MQTT_PASSWORD_SECRET};
+    site_config site_configs[MAX_SITES];
+    const char *sites_path = NULL;
+    const char *socket_path = STATUS_SOCKET_FILE;
+    int run_hour = DAEMON_RUN_HOUR, run_minute = 0;
+    int daemon = 0, num_threads = 0;
+    replay_options replay = {.weather_path = NULL, .output_path = REPLAY_FILE, .first_day = -1, .last_day = -1};
+    sweep_options sweep = {.weather_path = NULL, .output_path = SWEEP_FILE, .first_day = -1, .last_day = -1,
+        .grid_steps = SWEEP_DEFAULT_STEPS, .num_samples = 0, .seed = 1, .num_workers = 0};
+    const char *json_path = IRRIGATION_FILE;
+    int status;
+
+    metrics_init();
+
+    for (int a = 1; a < argc; a++) {
+        if (strcmp(argv[a], "--daemon") == 0) {
+            daemon = 1;
+        } else if (strcmp(argv[a], "--at") == 0 && a + 1 < argc && sscanf(argv[a + 1], "%d:%d", &run_hour, &run_minute) == 2
+                && run_hour >= 0 && run_hour < 24 && run_minute >= 0 && run_minute < 60) {
+            a++;
+        } else if (strcmp(argv[a], "--replay") == 0 && a + 1 < argc) {
+            replay.weather_path = argv[++a];
+        } else if (strcmp(argv[a], "--sweep") == 0 && a + 1 < argc) {
+            sweep.weather_path = argv[++a];
+        } else if (strcmp(argv[a], "--from") == 0 && a + 1 < argc && (replay.first_day = cimis_epoch_day(argv[a + 1])) >= 0) {
+            sweep.first_day = replay.first_day;
+            a++;
+        } else if (strcmp(argv[a], "--to") == 0 && a + 1 < argc && (replay.last_day = cimis_epoch_day(argv[a + 1])) >= 0) {
+            sweep.last_day = replay.last_day;
+            a++;
+        } else if (strcmp(argv[a], "--config") == 0 && a + 1 < argc) {
+            json_path = argv[++a];
+        } else if (strcmp(argv[a], "-o") == 0 && a + 1 < argc) {
+            replay.output_path = sweep.output_path = argv[++a];
+        } else if (strcmp(argv[a], "--grid") == 0 && a + 1 < argc && (sweep.grid_steps = atoi(argv[a + 1])) > 0) {
+            a++;
+        } else if (strcmp(argv[a], "--samples") == 0 && a + 1 < argc && (sweep.num_samples = atoi(argv[a + 1])) > 0) {
+            a++;
+        } else if (strcmp(argv[a], "--seed") == 0 && a + 1 < argc) {
+            sweep.seed = (unsigned int)strtoul(argv[++a], NULL, 10);
+        } else if (strcmp(argv[a], "--socket") == 0 && a + 1 < argc) {
+            socket_path = argv[++a];
+        } else if (strcmp(argv[a], "--sites") == 0 && a + 1 < argc) {
+            sites_path = argv[++a];
+        } else if (strcmp(argv[a], "--threads") == 0 && a + 1 < argc && (num_threads = atoi(argv[a + 1])) > 0) {
+            sweep.num_workers = num_threads;
+            a++;
+        } else {
+            fprintf(stderr, "usage: %s [--sites sites.json [--threads N]] [--daemon [--at HH:MM] [--socket irrigation.sock]]\n", argv[0]);
+            fprintf(stderr, "       %s --replay <cimis_*.json directory or file> [--from YYYY-MM-DD] [--to YYYY-MM-DD] [--config irrigation.json] [-o waterings.csv]\n", argv[0]);
+            fprintf(stderr, "       %s --sweep <cimis_*.json directory or file> [--grid N | --samples N [--seed N]] [--threads N] [--from YYYY-MM-DD] [--to YYYY-MM-DD] [--config irrigation.json] [-o sweep.csv]\n", argv[0]);
+            return 1;
         }
+    }
 
+    if (replay.weather_path || sweep.weather_path)
+        return run_replay(json_path, &replay, &sweep);
+
+    int num_sites = 1;
+    site_configs[0] = defaults;
+    if (sites_path && (num_sites = sites_load(sites_path, &defaults, site_configs, MAX_SITES)) < 0)
+        return 1;
+    if (num_threads <= 0)
+        num_threads = SITE_THREADS;
+
+    if (daemon) {
+        // block the stop and reload signals before any thread starts so only the main loop receives them
+        sigset_t signals;
+        sigemptyset(&signals);
+        sigaddset(&signals, SIGTERM);
+        sigaddset(&signals, SIGINT);
+        sigaddset(&signals, SIGHUP);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
     }
 
-    mosquitto_loop_stop(mosq, true);
+    // one HTTP session and one set of CIMIS stores for every site, validators are kept next to the stores
+    http_session cimis_http;
+    weather_cache weather;
+    if (http_session_init(&cimis_http, VALIDATORS_FILE) != 0) {
+        fprintf(stderr, "error: unable to start the CIMIS http session\n");
+        return 1;
+    }
+    weather_cache_init(&weather, &cimis_http, APP_KEY);
 
-    // create updated irrigation json file
-    if (json_dump_file(root_irr, "./irrigation_log.json", 0)) {
-        fprintf(stderr, "cannot save json to file\n");
+    //libmosquitto initialization, once for every site's client
+    mosquitto_lib_init();
+
+    irrigation_state *sites = calloc(num_sites, sizeof(irrigation_state));
+    int num_open = 0;
+    for (int s = 0; sites && s < num_sites; s++) {
+        if (site_open(&sites[s], &site_configs[s], &weather, daemon) != 0) {
+            // the other sites carry on without it
+            sites[s].failed = 1;
+            if (sites_path)
+                fprintf(stderr, "error: site %s could not start, see its log\n", site_configs[s].name);
+            continue;
+        }
+        num_open++;
     }
 
-    // clean up by closing the file and json root for irrigation file
-    fclose(open_last_file);
-    json_decref(root_irr);
-    // deallocate the CIMIS file_name string
-    free(file_name); 
-    //Clean up/destroy objects created by libmosquitto
-    mosquitto_disconnect(mosq);
-    mosquitto_destroy(mosq);
+    if (num_open == 0) {
+        status = 1;
+    } else {
+        check_controllers(sites, num_sites);
+        // a daemon without its status API still waters
+        if (daemon)
+            status_serve(socket_path);
+        status = daemon ? run_daemon(sites, num_sites, num_threads, run_hour, run_minute) : run_sites(sites, num_sites, num_threads);
+    }
+
+    // clean up the status API, MQTT sessions, CIMIS stores and the sites' zone configurations
+    status_serve_stop();
+    for (int s = 0; sites && s < num_sites; s++)
+        site_close(&sites[s]);
+    free(sites);
     mosquitto_lib_cleanup();
-    
-    return(0);
+    weather_cache_close(&weather);
+    http_session_cleanup(&cimis_http);
+    fleet_free();
+    status_free();
+
+    return(status);
 }
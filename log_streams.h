@@ -0,0 +1,40 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+where a module's messages go: the progress messages and the errors of one site's run. Passed to (or kept by)
+the modules a run goes through so that with several sites each site's messages land in its own log; NULL is
+the process's stdout and stderr (a single site, --replay, --sweep and the benchmarks). What belongs to the
+process rather than a site still goes to stderr: opening and saving the shared CIMIS stores, the HTTP session,
+the fleet file and the worker threads.
+*/
+
+#ifndef LOG_STREAMS_H
+#define LOG_STREAMS_H
+
+#include <stdio.h>
+
+typedef struct log_streams {
+    FILE *out;       // progress messages
+    FILE *err;       // errors and warnings
+} log_streams;
+
+#define LOG_OUT(log) ((log) ? (log)->out : stdout)
+#define LOG_ERR(log) ((log) ? (log)->err : stderr)
+
+#endif
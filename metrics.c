@@ -0,0 +1,211 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "metrics.h"
+
+// upper bounds in seconds of the ack latency past the relay runtime, the last bucket is +Inf
+static const double latency_bounds[METRICS_LATENCY_BUCKETS - 1] = {0.1, 0.25, 0.5, 1., 2.5, 5., 10.};
+
+static const char *span_names[NUM_SPANS] = {
+    "run", "config_load", "cimis_fetch", "cimis_parse", "balance", "demand", "mqtt_connect", "publish"
+};
+
+static const struct {
+    const char *name;
+    const char *help;
+} counter_info[NUM_COUNTERS] = {
+    {"irrigation_runs_total", "Watering runs started."},
+    {"irrigation_cimis_requests_total", "CIMIS requests made, retries included."},
+    {"irrigation_cimis_failures_total", "CIMIS requests that returned no usable data."},
+    {"irrigation_cimis_bytes_total", "Bytes of CIMIS responses parsed."},
+    {"irrigation_cimis_records_total", "Daily CIMIS records stored."},
+    {"irrigation_publishes_total", "Relay commands published."},
+    {"irrigation_acks_total", "Relay commands acknowledged on their done topic."},
+    {"irrigation_ack_timeouts_total", "Relay commands that missed their ack deadline."},
+    {"irrigation_unexpected_acks_total", "Acks that matched no waiting command (late, malformed or from an unknown topic)."},
+    {"irrigation_duplicate_acks_total", "Redelivered acks of a command that was already acked, dropped."},
+};
+
+static struct {
+    pthread_mutex_t lock;
+    double span_sum_s[NUM_SPANS];
+    double span_last_s[NUM_SPANS];
+    uint64_t span_count[NUM_SPANS];
+    uint64_t counters[NUM_COUNTERS];
+    metrics_controller controllers[METRICS_MAX_CONTROLLERS];
+    int num_controllers;
+    time_t start_time;
+} metrics = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+
+void metrics_init(void) {
+    pthread_mutex_lock(&metrics.lock);
+    metrics.start_time = time(NULL);
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+
+int64_t metrics_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+void metrics_span(int span, int64_t start_ns) {
+    metrics_span_ns(span, metrics_now_ns() - start_ns);
+}
+
+
+void metrics_span_ns(int span, int64_t elapsed_ns) {
+    double elapsed_s = elapsed_ns / 1e9;
+
+    pthread_mutex_lock(&metrics.lock);
+    metrics.span_sum_s[span] += elapsed_s;
+    metrics.span_last_s[span] = elapsed_s;
+    metrics.span_count[span]++;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+
+void metrics_count(int counter, int64_t amount) {
+    pthread_mutex_lock(&metrics.lock);
+    metrics.counters[counter] += amount;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+
+static metrics_controller *find_controller(long controller_num) {
+    /* caller holds the lock, controllers are added as their first ack or timeout comes in */
+    for (int c = 0; c < metrics.num_controllers; c++) {
+        if (metrics.controllers[c].controller_num == controller_num)
+            return &metrics.controllers[c];
+    }
+    if (metrics.num_controllers == METRICS_MAX_CONTROLLERS)
+        return NULL;
+
+    metrics_controller *controller = &metrics.controllers[metrics.num_controllers++];
+    memset(controller, 0, sizeof(metrics_controller));
+    controller->controller_num = controller_num;
+    return controller;
+}
+
+
+void metrics_ack(long controller_num, long latency_ms, long duration_ms) {
+    // an ESP timer running a little fast comes back before the runtime, that is no delay at all
+    double past_s = latency_ms > duration_ms ? (latency_ms - duration_ms) / 1e3 : 0.;
+    int bucket = 0;
+
+    while (bucket < METRICS_LATENCY_BUCKETS - 1 && past_s > latency_bounds[bucket])
+        bucket++;
+
+    pthread_mutex_lock(&metrics.lock);
+    metrics.counters[COUNTER_ACKS]++;
+    metrics_controller *controller = find_controller(controller_num);
+    if (controller) {
+        controller->buckets[bucket]++;
+        controller->count++;
+        controller->sum_s += past_s;
+    }
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+
+void metrics_ack_timeout(long controller_num) {
+    pthread_mutex_lock(&metrics.lock);
+    metrics.counters[COUNTER_ACK_TIMEOUTS]++;
+    metrics_controller *controller = find_controller(controller_num);
+    if (controller)
+        controller->timeouts++;
+    pthread_mutex_unlock(&metrics.lock);
+}
+
+
+int metrics_write(const char *path) {
+    /* write to a temporary file and rename it over the metrics so the collector never reads a partial file */
+    char tmp_path[128];
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *metrics_file = fopen(tmp_path, "w");
+    if (metrics_file == NULL) {
+        fprintf(stderr, "error: cannot write %s\n", tmp_path);
+        return -1;
+    }
+
+    pthread_mutex_lock(&metrics.lock);
+    fprintf(metrics_file, "# HELP irrigation_span_seconds_total Time spent in each stage of the watering runs.\n");
+    fprintf(metrics_file, "# TYPE irrigation_span_seconds_total counter\n");
+    for (int s = 0; s < NUM_SPANS; s++)
+        fprintf(metrics_file, "irrigation_span_seconds_total{span=\"%s\"} %.6f\n", span_names[s], metrics.span_sum_s[s]);
+    fprintf(metrics_file, "# HELP irrigation_span_calls_total Times each stage ran.\n");
+    fprintf(metrics_file, "# TYPE irrigation_span_calls_total counter\n");
+    for (int s = 0; s < NUM_SPANS; s++)
+        fprintf(metrics_file, "irrigation_span_calls_total{span=\"%s\"} %llu\n", span_names[s], (unsigned long long)metrics.span_count[s]);
+    fprintf(metrics_file, "# HELP irrigation_span_last_seconds Duration of the last time each stage ran.\n");
+    fprintf(metrics_file, "# TYPE irrigation_span_last_seconds gauge\n");
+    for (int s = 0; s < NUM_SPANS; s++)
+        fprintf(metrics_file, "irrigation_span_last_seconds{span=\"%s\"} %.6f\n", span_names[s], metrics.span_last_s[s]);
+
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+        fprintf(metrics_file, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[c].name, counter_info[c].help,
+            counter_info[c].name, counter_info[c].name, (unsigned long long)metrics.counters[c]);
+    }
+
+    fprintf(metrics_file, "# HELP irrigation_ack_delay_seconds Time from the end of the relay runtime to its ack, per controller.\n");
+    fprintf(metrics_file, "# TYPE irrigation_ack_delay_seconds histogram\n");
+    for (int c = 0; c < metrics.num_controllers; c++) {
+        const metrics_controller *controller = &metrics.controllers[c];
+        uint64_t cumulative = 0;
+
+        for (int b = 0; b < METRICS_LATENCY_BUCKETS - 1; b++) {
+            cumulative += controller->buckets[b];
+            fprintf(metrics_file, "irrigation_ack_delay_seconds_bucket{controller=\"%ld\",le=\"%g\"} %llu\n",
+                controller->controller_num, latency_bounds[b], (unsigned long long)cumulative);
+        }
+        fprintf(metrics_file, "irrigation_ack_delay_seconds_bucket{controller=\"%ld\",le=\"+Inf\"} %llu\n",
+            controller->controller_num, (unsigned long long)controller->count);
+        fprintf(metrics_file, "irrigation_ack_delay_seconds_sum{controller=\"%ld\"} %.3f\n", controller->controller_num, controller->sum_s);
+        fprintf(metrics_file, "irrigation_ack_delay_seconds_count{controller=\"%ld\"} %llu\n",
+            controller->controller_num, (unsigned long long)controller->count);
+    }
+    fprintf(metrics_file, "# HELP irrigation_controller_ack_timeouts_total Relay commands that missed their ack deadline, per controller.\n");
+    fprintf(metrics_file, "# TYPE irrigation_controller_ack_timeouts_total counter\n");
+    for (int c = 0; c < metrics.num_controllers; c++) {
+        fprintf(metrics_file, "irrigation_controller_ack_timeouts_total{controller=\"%ld\"} %llu\n",
+            metrics.controllers[c].controller_num, (unsigned long long)metrics.controllers[c].timeouts);
+    }
+
+    // lets the counters be told apart from a restart (cron runs start from zero every time)
+    fprintf(metrics_file, "# HELP irrigation_start_time_seconds Time the values started accumulating.\n");
+    fprintf(metrics_file, "# TYPE irrigation_start_time_seconds gauge\nirrigation_start_time_seconds %lld\n", (long long)metrics.start_time);
+    fprintf(metrics_file, "# HELP irrigation_metrics_time_seconds Time the metrics were written.\n");
+    fprintf(metrics_file, "# TYPE irrigation_metrics_time_seconds gauge\nirrigation_metrics_time_seconds %lld\n", (long long)time(NULL));
+    pthread_mutex_unlock(&metrics.lock);
+
+    if (fclose(metrics_file) != 0 || rename(tmp_path, path) != 0) {
+        fprintf(stderr, "error: cannot replace %s\n", path);
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
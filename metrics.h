@@ -0,0 +1,89 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+process-wide timing spans, counters and per-controller ack latency histograms for the watering runs.
+Recording is a clock read and a few adds under a mutex (the mosquitto thread records too), nothing is
+formatted until the metrics are written out in the Prometheus text format, meant for node_exporter's
+textfile collector (or anything else that scrapes a file). The values accumulate for the life of the
+process: one run per file with cron, every run since start in daemon mode.
+*/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#define METRICS_MAX_CONTROLLERS 256
+#define METRICS_LATENCY_BUCKETS 8
+
+// stages of a run, a span can be recorded any number of times per run
+enum {
+    SPAN_RUN = 0,        // one whole run_irrigation, relay runtimes included
+    SPAN_CONFIG_LOAD,    // mapping (and compiling when stale) the zone configuration
+    SPAN_CIMIS_FETCH,    // the concurrent CIMIS batch, parsing included
+    SPAN_CIMIS_PARSE,    // the stream parser alone, one per response summed over its chunks
+    SPAN_BALANCE,        // journal replay and the daily balance steps
+    SPAN_DEMAND,         // demand kernel and job list
+    SPAN_MQTT_CONNECT,
+    SPAN_PUBLISH,        // one mosquitto_publish call
+    NUM_SPANS
+};
+
+enum {
+    COUNTER_RUNS = 0,
+    COUNTER_CIMIS_REQUESTS,
+    COUNTER_CIMIS_FAILURES,
+    COUNTER_CIMIS_BYTES,
+    COUNTER_CIMIS_RECORDS,
+    COUNTER_PUBLISHES,
+    COUNTER_ACKS,
+    COUNTER_ACK_TIMEOUTS,
+    COUNTER_UNEXPECTED_ACKS,
+    COUNTER_DUPLICATE_ACKS,
+    NUM_COUNTERS
+};
+
+typedef struct metrics_controller {
+    long controller_num;
+    uint64_t buckets[METRICS_LATENCY_BUCKETS];   // acks per latency bucket, not cumulative
+    uint64_t count;
+    double sum_s;
+    uint64_t timeouts;
+} metrics_controller;
+
+// marks the time the values start accumulating from, called once at startup
+void metrics_init(void);
+
+// monotonic clock in nsec, the start of a span
+int64_t metrics_now_ns(void);
+
+// add the time since start_ns to span
+void metrics_span(int span, int64_t start_ns);
+// add one span of elapsed_ns that was timed in pieces
+void metrics_span_ns(int span, int64_t elapsed_ns);
+void metrics_count(int counter, int64_t amount);
+
+// an ack arrived latency_ms after the command, the relay was told to stay on duration_ms: the histogram is of
+// the time past the runtime (broker, WiFi and ESP timer drift), which doesn't grow with the watering
+void metrics_ack(long controller_num, long latency_ms, long duration_ms);
+void metrics_ack_timeout(long controller_num);
+
+// write every metric to path (through a temporary file so a scrape never sees half of it)
+int metrics_write(const char *path);
+
+#endif
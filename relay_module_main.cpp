@@ -25,6 +25,8 @@ to compute correct irrigation timing for the various garden locations.
 #include "ESP8266WiFi.h"
 // see https://electrosome.com/connecting-esp8266-wifi/ for basic connectivity code setting esp8266 to station mode
 #include <MQTT.h> // see https://github.com/256dpi/arduino-mqtt and for example usage, https://esp32io.com/tutorials/esp32-mqtt. Requires https://github.com/256dpi/lwmqtt
+#include <LittleFS.h> // the schedule survives a reset in flash
+#include <time.h>     // wall clock from NTP, to know how long the controller was down
 
 
 // Wifi information header  
@@ -33,72 +35,589 @@ to compute correct irrigation timing for the various garden locations.
 const char ssid[] = WIFI_SSID_SECRET;
 const char password[] = WIFI_PASSWORD_SECRET;
 
-const char client_id[] = "esp1_node";
+// this ESP's number in the garden sections ("Controller" in irrigation_log.json), it takes its commands on
+// <topic>/cmd and reports the finished relays on <topic>/done, the topic is irrigation/<id> unless the
+// controller has a "Topic" of its own in irrigation_log.json
+#ifndef CONTROLLER_ID
+#define CONTROLLER_ID "1"
+#endif
+#ifndef CONTROLLER_TOPIC
+#define CONTROLLER_TOPIC "irrigation/" CONTROLLER_ID
+#endif
+
+const char client_id[] = "esp" CONTROLLER_ID "_node";
+const char cmd_topic[] = CONTROLLER_TOPIC "/cmd";
+const char done_topic[] = CONTROLLER_TOPIC "/done";
+const char status_topic[] = CONTROLLER_TOPIC "/status";
+const unsigned long controller_num = strtoul(CONTROLLER_ID, NULL, 10);
 const char host_id[] = MQTT_HOST;
 const char mqtt_ssid[] = MQTT_SSID_SECRET;
 const char mqtt_password[] = MQTT_PASSWORD_SECRET;
 
-String controller_num = String("1 ");   // ESP number for this garden section (0 == offline), add space to make processing easier
+// a night's schedule is one frame of the relay protocol (relay_protocol.h on the server) and has to fit in one MQTT
+// packet with its topic, RELAY_FRAME_MAX and SCHEDULE_MAX_ENTRIES in the server must stay within these
+#define PROTOCOL_VERSION 1
+#define SCHEDULE_MESSAGE_LEN 640
+#define SCHEDULE_MAX_ENTRIES 16
+#define RECENT_FRAMES 8                 // frames remembered to drop the ones QoS 1 delivers twice
 
 WiFiClient net;
-MQTTClient client;
+MQTTClient client(SCHEDULE_MESSAGE_LEN);
 
 unsigned long lastMillis = 0;
-unsigned long newTimer = 0;     // in msec, the amount of time that has passed since the relay turned on
-bool newTimerState = false;     // flag to determine when newTimer should be heeded
-unsigned long relayOnTimer = 0; // in msec, the amount of time the relay should stay ON to water the plants
 
-uint8_t relay_state2 = 0x0; 
-uint8_t relay_state3 = 0x0; 
-uint8_t relay_state4 = 0x0;
-uint8_t relay_state8 = 0x0;  // extra pin if needed
+// see https://randomnerdtutorials.com/esp8266-pinout-reference-gpios/
+// const int R1_GPIO = 15; // D8, pulled to ground and SPI (only ok as output pin)
+const int R2_GPIO = 13; // D7, MOSI
+const int R3_GPIO = 12; // D6, MISO
+const int R4_GPIO = 14; // D5, SCK
+// const int R5_GPIO = 16; // D0, WAKE
+const int R6_GPIO = 3;  // RX, don't use this as output especially if UART in is desirable
+const int R7_GPIO = 0;  // D3, FLASH, pulled to ground
+// using D4 pulled to low, means that the LED will always be on
+const int R8_GPIO = 2;  // D4, LED, pulled to ground, HIGH at boot
+
+// every relay runs on its own deadline, so several low-flow sections on this controller can water at once.
+// The table is shared with the timer interrupt, loop() only changes it with interrupts off
+typedef struct relay_timer {
+    int relay_num;              // the number used in the commands and in the done reports
+    int gpio;
+    bool on;
+    unsigned long started_ms;   // millis() when the relay turned on
+    unsigned long duration_ms;  // in msec, how long the relay stays ON to water the plants
+} relay_timer;
+
+volatile relay_timer relays[] = {
+    {2, R2_GPIO, false, 0, 0},
+    {3, R3_GPIO, false, 0, 0},
+    {4, R4_GPIO, false, 0, 0},
+    {8, R8_GPIO, false, 0, 0},  // extra pin if needed
+};
+const int NUM_RELAYS = sizeof(relays) / sizeof(relays[0]);
+
+// hardware timer 1 closes the valves: it is armed for the earliest relay deadline and its interrupt switches off
+// every relay that is due, so a valve closes within a millisecond of its runtime whatever loop() is busy with
+// 80 MHz / 256 = 312.5 ticks per msec, kept in integers: the interrupt calls arm_relay_timer and the soft float
+// helpers may not be in IRAM while a flash write has the cache off
+#define TIMER1_TICKS(ms) ((uint32_t)(ms) * 625 / 2)
+#define TIMER1_MAX_WAIT_MS 25000        // the counter is 23 bits, longer waits are re-armed on the way
+
+volatile uint32_t relay_gpio_on = 0;    // GPIO bits driven high, every change is one masked register write
+volatile uint32_t relays_finished = 0;  // bits of the relay table turned off by the interrupt, not reported yet
+volatile uint32_t relay_on_ms = 0;      // measured on time of every relay since boot, wraps (the server takes differences)
+
+// sections of the schedule, offsets are from the time the schedule arrived
+enum { ENTRY_PENDING = 0, ENTRY_RUNNING, ENTRY_DONE };   // ENTRY_DONE includes aborted and cancelled
+
+typedef struct schedule_entry {
+    uint32_t command_id;        // the server's id of the section's command, its done report names it
+    int32_t relay_num;
+    uint32_t duration_ms;
+    uint32_t offset_ms;
+    uint32_t state;
+} schedule_entry;
+
+schedule_entry schedule[SCHEDULE_MAX_ENTRIES];
+int schedule_size = 0;
+unsigned long schedule_received_ms = 0;
+uint32_t schedule_received_epoch = 0;   // wall clock when it arrived, 0 if NTP hadn't synced yet
+bool schedule_is_fallback = false;      // run from the cache, the server isn't waiting on its reports
+
+// the schedule and each section's progress are written to flash on every change (a few writes a night), after
+// a reset the section that was running is aborted (the valves come up closed) and the rest resumes on time if
+// the wall clock says the controller wasn't down for long, otherwise the rest is aborted too and the server
+// times those sections out and waters them again the next night
+#define SCHEDULE_FILE "/schedule.bin"
+#define FALLBACK_FILE "/fallback.bin"     // the last schedule from the server that ran to the end
+#define SCHEDULE_FILE_MAGIC 0x32535249    // "IRS2", files from before the command ids are ignored
+#define RESUME_WAIT_MS 30000              // how long after boot to wait for NTP before aborting the rest
+#define RESUME_MAX_LATE_MS 300000         // sections that should have started longer ago than this are aborted, the
+                                          // server waits this much longer for acks (RELAY_RESUME_MAX_LATE_MS)
+#define START_LATE_MS 1000                // a section starting later than this (resumed) gets its runtime from now
+
+// optional: without a schedule from the server for FALLBACK_AFTER_S, the cached one runs once a day at the time
+// of day it first arrived. The server's water balance and journal don't see those waterings (it will water the
+// same sections again once it is back), so it is off unless built with -DFALLBACK_SCHEDULE=1
+#ifndef FALLBACK_SCHEDULE
+#define FALLBACK_SCHEDULE 0
+#endif
+#define FALLBACK_AFTER_S (26 * 3600UL)
+#define FALLBACK_WINDOW_S 120
+
+typedef struct stored_schedule {
+    uint32_t magic;
+    uint32_t received_epoch;
+    uint32_t is_fallback;
+    uint32_t num_entries;
+    schedule_entry entries[SCHEDULE_MAX_ENTRIES];
+    uint32_t crc;
+} stored_schedule;
+
+stored_schedule fallback;               // num_entries == 0 when there is none
+bool resume_pending = false;            // restored after a reset, waiting for the wall clock
+uint32_t last_server_epoch = 0;         // when the server last sent a schedule
+uint32_t fallback_ran_epoch = 0;
+
+uint32_t recent_frames[RECENT_FRAMES];  // first command id of the last frames, 0 == empty
+int recent_next = 0;
+
+// sections that finished while the broker was out of reach, published in order once it is back
+#define DONE_QUEUE_LEN 16
+
+typedef struct done_report {
+    uint32_t command_id;
+    int relay_num;
+} done_report;
+
+done_report done_queue[DONE_QUEUE_LEN];
+int done_head = 0;
+int done_count = 0;
+
+// WiFi and broker connection, advanced one step per loop() so the relays keep being timed during an outage
+enum link_state { LINK_WIFI_WAIT, LINK_MQTT_CONNECT, LINK_UP };
+#define LINK_BACKOFF_MIN_MS 1000
+#define LINK_BACKOFF_MAX_MS 60000
+#define LINK_CONNECT_TIMEOUT_MS 1000    // how long one broker connect attempt may block loop()
+
+link_state mqtt_link = LINK_WIFI_WAIT;
+unsigned long link_retry_ms = 0;         // millis() of the next broker connect attempt
+unsigned long link_backoff_ms = LINK_BACKOFF_MIN_MS;
+uint32_t link_connects = 0;              // broker connections since boot, reported in the heartbeat
+
+// a heartbeat on the status topic every HEARTBEAT_INTERVAL_MS with the loop() timings since the last one,
+// FLEET_HEARTBEAT_S in the server
+#define HEARTBEAT_INTERVAL_MS 60000
+unsigned long heartbeat_ms = 0;
+uint32_t loop_passes = 0;
+uint32_t loop_total_us = 0;
+uint32_t loop_max_us = 0;
+
+volatile relay_timer *find_relay(int relay_num) {
+    for (int r = 0; r < NUM_RELAYS; r++) {
+        if (relays[r].relay_num == relay_num)
+            return &relays[r];
+    }
+    return NULL;
+}
+
+void link_step(unsigned long now) {
+  // never waits: the WiFi stack reconnects on its own, the broker is tried again with exponential backoff
+  switch (mqtt_link) {
+    case LINK_UP:
+      if (client.connected())
+        return;
+      mqtt_link = LINK_WIFI_WAIT;
+      link_retry_ms = now;
+      link_backoff_ms = LINK_BACKOFF_MIN_MS;
+      return;
+
+    case LINK_WIFI_WAIT:
+      if (WiFi.status() == WL_CONNECTED)
+        mqtt_link = LINK_MQTT_CONNECT;
+      return;
+
+    case LINK_MQTT_CONNECT:
+      if (WiFi.status() != WL_CONNECTED) {
+        mqtt_link = LINK_WIFI_WAIT;
+        return;
+      }
+      if ((long)(now - link_retry_ms) < 0)
+        return;
+
+      if (client.connect(client_id, mqtt_ssid, mqtt_password)) {
+        client.subscribe(cmd_topic, 1);
+        mqtt_link = LINK_UP;
+        link_backoff_ms = LINK_BACKOFF_MIN_MS;
+        link_connects++;
+      } else {
+        link_retry_ms = now + link_backoff_ms;
+        link_backoff_ms = link_backoff_ms * 2 < LINK_BACKOFF_MAX_MS ? link_backoff_ms * 2 : LINK_BACKOFF_MAX_MS;
+      }
+      return;
+  }
+}
 
-void connect() {
-//   Serial.print("checking wifi...");
-  while (WiFi.status() != WL_CONNECTED) {
-    Serial.print(".");
-    delay(1000);
+
+void queue_done(uint32_t command_id, int relay_num) {
+  // a full queue drops the oldest report, the server has timed that one out by then
+  if (done_count == DONE_QUEUE_LEN) {
+    done_head = (done_head + 1) % DONE_QUEUE_LEN;
+    done_count--;
   }
+  done_report *report = &done_queue[(done_head + done_count) % DONE_QUEUE_LEN];
+  report->command_id = command_id;
+  report->relay_num = relay_num;
+  done_count++;
+}
 
-//   Serial.print("\nconnecting...");
-  while (!client.connect(client_id, mqtt_ssid, mqtt_password)) {
-    Serial.print(".");
-    delay(1000);
+
+void flush_done() {
+  // one done frame per section that finished, oldest first, a failed publish stays queued for the next loop
+  while (mqtt_link == LINK_UP && done_count > 0) {
+    const done_report *report = &done_queue[done_head];
+    char body[40], frame[48];
+    int body_length = snprintf(body, sizeof(body), "D %lu %lu %d", controller_num, (unsigned long)report->command_id, report->relay_num);
+    int length = snprintf(frame, sizeof(frame), "IR%d %d %s", PROTOCOL_VERSION, body_length, body);
+    if (!client.publish(done_topic, frame, length, false, 1))
+      return;
+    // Serial.printf("The outgoing message will say that relay %d was on\n", report->relay_num);
+    done_head = (done_head + 1) % DONE_QUEUE_LEN;
+    done_count--;
   }
+}
 
-//   Serial.println("\nconnected!");
 
-  client.subscribe("/back_yard");
-  // client.unsubscribe("/back_yard");
+
+uint32_t uptime_seconds(unsigned long now) {
+  // millis() wraps every 49.7 days, the rollovers are counted so the server doesn't take the wrap for a restart
+  static unsigned long last_ms = 0;
+  static uint32_t rollovers = 0;
+
+  if (now < last_ms)
+    rollovers++;
+  last_ms = now;
+  return (uint32_t)((((uint64_t)rollovers << 32) | now) / 1000);
 }
 
 
+void heartbeat_step(unsigned long now) {
+  // uptime, free heap, WiFi signal, broker connections, loop() timings and relay on time, QoS 0: a lost one is
+  // just a gap on the server. Skipped while the broker is out of reach, the next one is sent once it is back
+  uint32_t uptime_s = uptime_seconds(now);    // every pass, so no rollover is missed however long the broker is away
+  if (mqtt_link != LINK_UP || now - heartbeat_ms < HEARTBEAT_INTERVAL_MS)
+    return;
+
+  char body[112], frame[128];
+  int body_length = snprintf(body, sizeof(body), "H %lu %lu %lu %ld %lu %lu %lu %lu", controller_num, (unsigned long)uptime_s,
+    (unsigned long)ESP.getFreeHeap(), (long)WiFi.RSSI(), (unsigned long)link_connects,
+    (unsigned long)(loop_passes ? loop_total_us / loop_passes : 0), (unsigned long)loop_max_us, (unsigned long)relay_on_ms);
+  int length = snprintf(frame, sizeof(frame), "IR%d %d %s", PROTOCOL_VERSION, body_length, body);
+  if (!client.publish(status_topic, frame, length, false, 0))
+    return;
+
+  heartbeat_ms = now;
+  loop_passes = 0;
+  loop_total_us = 0;
+  loop_max_us = 0;
+}
 
-void messageReceived(String &topic, String &payload) {
-//   Serial.println("incoming: " + topic + " - " + payload);
 
-  String relay_string = payload.substring(0,1);
-  String time_string = payload.substring(2);
-  
-  switch (relay_string.toInt())
-  // change global variable that leads to irrigation for the given garden sector, only three relays are in use
-  {
-    case 2:
-        relay_state2 = 0x1;
-        break;
-    case 3:
-        relay_state3 = 0x1;
-        break;
-    case 4:
-        relay_state4 = 0x1;
-        break;
-    case 8:
-        relay_state8 = 0x1;
-        break;
+bool parse_number(const char *bytes, int length, int *pos, unsigned long *value) {
+    // the next unsigned number in bytes from *pos, skipping any separators before it; false once there is none
+    while (*pos < length && (bytes[*pos] < '0' || bytes[*pos] > '9'))
+        (*pos)++;
+    if (*pos == length)
+        return false;
+
+    *value = 0;
+    while (*pos < length && bytes[*pos] >= '0' && bytes[*pos] <= '9') {
+        *value = *value * 10 + (bytes[*pos] - '0');
+        (*pos)++;
+    }
+    return true;
+}
+
+
+uint32_t wall_clock() {
+  // seconds since 1970, 0 until NTP has set the clock
+  time_t now = time(nullptr);
+  return now > 1600000000 ? (uint32_t)now : 0;
+}
+
+
+uint32_t schedule_crc(const stored_schedule *stored) {
+  // CRC-32 of everything before the crc field
+  const uint8_t *bytes = (const uint8_t *)stored;
+  uint32_t crc = 0xFFFFFFFF;
+
+  for (size_t i = 0; i < offsetof(stored_schedule, crc); i++) {
+    crc ^= bytes[i];
+    for (int bit = 0; bit < 8; bit++)
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+  }
+  return ~crc;
+}
+
+
+bool write_schedule_file(const char *path, const stored_schedule *stored) {
+  // through a temporary file, a reset mid-write leaves the last complete copy
+  char tmp_path[32];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  File file = LittleFS.open(tmp_path, "w");
+  if (!file)
+    return false;
+  bool written = file.write((const uint8_t *)stored, sizeof(stored_schedule)) == sizeof(stored_schedule);
+  file.close();
+  return written && LittleFS.rename(tmp_path, path);
+}
+
+
+bool read_schedule_file(const char *path, stored_schedule *stored) {
+  File file = LittleFS.open(path, "r");
+  if (!file)
+    return false;
+  bool complete = file.read((uint8_t *)stored, sizeof(stored_schedule)) == sizeof(stored_schedule);
+  file.close();
+  return complete && stored->magic == SCHEDULE_FILE_MAGIC && stored->num_entries <= SCHEDULE_MAX_ENTRIES
+    && stored->crc == schedule_crc(stored);
+}
+
+
+void save_schedule() {
+  // the schedule and its progress, or no file once every section is done
+  stored_schedule stored;
+  bool active = false;
+
+  for (int e = 0; e < schedule_size; e++) {
+    if (schedule[e].state != ENTRY_DONE)
+      active = true;
   }
+  if (!active) {
+    LittleFS.remove(SCHEDULE_FILE);
+    return;
+  }
+
+  memset(&stored, 0, sizeof(stored));
+  stored.magic = SCHEDULE_FILE_MAGIC;
+  stored.received_epoch = schedule_received_epoch;
+  stored.is_fallback = schedule_is_fallback;
+  stored.num_entries = schedule_size;
+  memcpy(stored.entries, schedule, schedule_size * sizeof(schedule_entry));
+  stored.crc = schedule_crc(&stored);
+  write_schedule_file(SCHEDULE_FILE, &stored);
+}
+
+
+void finish_schedule() {
+  // a schedule from the server that ran to the end becomes the fallback
+  if (schedule_is_fallback || schedule_received_epoch == 0)
+    return;
+
+  memset(&fallback, 0, sizeof(fallback));
+  fallback.magic = SCHEDULE_FILE_MAGIC;
+  fallback.received_epoch = schedule_received_epoch;
+  fallback.num_entries = schedule_size;
+  memcpy(fallback.entries, schedule, schedule_size * sizeof(schedule_entry));
+  fallback.crc = schedule_crc(&fallback);
+  write_schedule_file(FALLBACK_FILE, &fallback);
+}
+
+
+void restore_schedule() {
+  /* called once at boot, before any relay can be on */
+  stored_schedule stored;
+
+  if (!read_schedule_file(FALLBACK_FILE, &fallback))
+    fallback.num_entries = 0;
+  last_server_epoch = fallback.num_entries > 0 ? fallback.received_epoch : 0;
+
+  if (!read_schedule_file(SCHEDULE_FILE, &stored))
+    return;
+
+  schedule_size = stored.num_entries;
+  memcpy(schedule, stored.entries, schedule_size * sizeof(schedule_entry));
+  schedule_received_epoch = stored.received_epoch;
+  schedule_is_fallback = stored.is_fallback;
+  if (schedule_is_fallback)
+    fallback_ran_epoch = schedule_received_epoch;
+  else if (schedule_received_epoch > last_server_epoch)
+    last_server_epoch = schedule_received_epoch;
+
+  for (int e = 0; e < schedule_size; e++) {
+    if (schedule[e].state == ENTRY_RUNNING)
+      schedule[e].state = ENTRY_DONE;     // the reset cut it short, it isn't reported so the server doesn't log it
+    else if (schedule[e].state == ENTRY_PENDING)
+      resume_pending = true;
+  }
+  save_schedule();
+}
+
 
-  relayOnTimer = (unsigned long)time_string.toInt();
-  // Serial.printf("Relay will be on for %lu (in msec)\n", relayOnTimer);
+void resume_step(unsigned long now_ms) {
+  // put the restored schedule back on the millis() clock once the wall clock says how long the controller was down
+  if (!resume_pending)
+    return;
+
+  uint32_t epoch = wall_clock();
+  bool resume = epoch != 0 && schedule_received_epoch != 0 && epoch >= schedule_received_epoch
+    && epoch - schedule_received_epoch < 86400;
+  if (!resume && now_ms < RESUME_WAIT_MS)
+    return;
+
+  unsigned long elapsed_ms = resume ? (epoch - schedule_received_epoch) * 1000UL : 0;
+  schedule_received_ms = now_ms - elapsed_ms;
+  for (int e = 0; e < schedule_size; e++) {
+    if (schedule[e].state == ENTRY_PENDING && (!resume || elapsed_ms > schedule[e].offset_ms + RESUME_MAX_LATE_MS))
+      schedule[e].state = ENTRY_DONE;
+  }
+  resume_pending = false;
+  save_schedule();
+}
+
+
+void fallback_step(unsigned long now_ms) {
+  // run the cached schedule when the server has been silent for too long, at the time of day it used to arrive
+  if (!FALLBACK_SCHEDULE || fallback.num_entries == 0 || resume_pending)
+    return;
+  for (int e = 0; e < schedule_size; e++) {
+    if (schedule[e].state != ENTRY_DONE)
+      return;
+  }
+
+  uint32_t epoch = wall_clock();
+  if (epoch == 0 || epoch - last_server_epoch < FALLBACK_AFTER_S || epoch - fallback_ran_epoch < 86400 / 2
+      || (epoch - fallback.received_epoch) % 86400 >= FALLBACK_WINDOW_S)
+    return;
+
+  schedule_size = fallback.num_entries;
+  memcpy(schedule, fallback.entries, schedule_size * sizeof(schedule_entry));
+  for (int e = 0; e < schedule_size; e++)
+    schedule[e].state = ENTRY_PENDING;
+  schedule_received_ms = now_ms;
+  schedule_received_epoch = epoch;
+  schedule_is_fallback = true;
+  fallback_ran_epoch = epoch;
+  save_schedule();
+}
+
+
+void IRAM_ATTR arm_relay_timer(unsigned long now) {
+  // the earliest deadline of the relays that are on, nothing armed when they are all off
+  unsigned long wait_ms = TIMER1_MAX_WAIT_MS;
+  bool any_on = false;
+
+  for (int r = 0; r < NUM_RELAYS; r++) {
+    if (!relays[r].on)
+      continue;
+    unsigned long elapsed_ms = now - relays[r].started_ms;
+    unsigned long remaining_ms = elapsed_ms < relays[r].duration_ms ? relays[r].duration_ms - elapsed_ms : 0;
+    if (remaining_ms < wait_ms)
+      wait_ms = remaining_ms;
+    any_on = true;
+  }
+
+  if (!any_on) {
+    timer1_disable();
+    return;
+  }
+  timer1_enable(TIM_DIV256, TIM_EDGE, TIM_SINGLE);
+  timer1_write(TIMER1_TICKS(wait_ms > 0 ? wait_ms : 1));
+}
+
+
+void IRAM_ATTR relay_timer_isr() {
+  // switch off every relay past its deadline in one write to the GPIO clear register
+  // (unsigned subtraction is safe across the millis() rollover)
+  unsigned long now = millis();
+  uint32_t off_mask = 0;
+
+  for (int r = 0; r < NUM_RELAYS; r++) {
+    if (relays[r].on && now - relays[r].started_ms >= relays[r].duration_ms) {
+      relays[r].on = false;
+      relay_on_ms += now - relays[r].started_ms;
+      off_mask |= 1 << relays[r].gpio;
+      relays_finished |= 1 << r;
+    }
+  }
+  if (off_mask) {
+    GPOC = off_mask;
+    relay_gpio_on &= ~off_mask;
+  }
+  arm_relay_timer(now);
+}
+
+
+void start_relay(int relay_num, unsigned long started_ms, unsigned long duration_ms) {
+  // only the commanded relay's timer changes, the others keep running on their own deadlines
+  volatile relay_timer *relay = find_relay(relay_num);
+  if (relay == NULL)
+    return;
+
+  // a new command for a relay that is already on restarts it with the new runtime
+  noInterrupts();
+  if (relay->on)
+    relay_on_ms += millis() - relay->started_ms;
+  relay->on = true;
+  relay->started_ms = started_ms;
+  relay->duration_ms = duration_ms;
+  if (!(relay_gpio_on & (1 << relay->gpio))) {
+    // only a change is written, to the GPIO set register
+    GPOS = 1 << relay->gpio;
+    relay_gpio_on |= 1 << relay->gpio;
+  }
+  arm_relay_timer(millis());
+  interrupts();
+  // Serial.printf("Relay %d will be on for %lu (in msec)\n", relay_num, duration_ms);
+}
+
+
+bool frame_seen(uint32_t frame_id) {
+  // a frame is known by its first command id: one QoS 1 delivered twice is in the recent ones, or in the schedule
+  // restored from flash when the redelivery comes after a reset
+  for (int f = 0; f < RECENT_FRAMES; f++) {
+    if (recent_frames[f] == frame_id)
+      return true;
+  }
+  for (int e = 0; e < schedule_size; e++) {
+    if (schedule[e].command_id == frame_id)
+      return true;
+  }
+  recent_frames[recent_next] = frame_id;
+  recent_next = (recent_next + 1) % RECENT_FRAMES;
+  return false;
+}
+
+
+void messageReceived(MQTTClient *mqtt_client, char topic[], char bytes[], int length) {
+  // parses the payload buffer in place, no String is built so the heap doesn't fragment over months of uptime.
+  // Every message is a frame "IR<version> <body length> <body>":
+  //   "S <controller> <id> <relay> <msec> <offset msec>;..."   replace the schedule, each section starts offset msec from now
+  //   "C <controller> <id>"                                   drop the sections of the schedule that haven't started
+  int pos = 2;
+  unsigned long version, body_length, frame_controller, command_id, relay_num, duration_ms, offset_ms;
+
+  // another version, a frame cut short or one for another controller is dropped whole
+  if (length < 4 || bytes[0] != 'I' || bytes[1] != 'R' || !parse_number(bytes, length, &pos, &version)
+      || version != PROTOCOL_VERSION || !parse_number(bytes, length, &pos, &body_length) || pos + 1 + (long)body_length != length)
+    return;
+  char type = bytes[pos + 1];
+  pos += 2;
+  if (!parse_number(bytes, length, &pos, &frame_controller) || frame_controller != controller_num
+      || !parse_number(bytes, length, &pos, &command_id) || frame_seen(command_id))
+    return;
+
+  if (type == 'C') {
+    for (int e = 0; e < schedule_size; e++) {
+      if (schedule[e].state == ENTRY_PENDING)
+        schedule[e].state = ENTRY_DONE;
+    }
+    save_schedule();
+    return;
+  }
+
+  if (type == 'S') {
+    // the sections of the replaced schedule that are on keep their timers, they just aren't tracked any more
+    schedule_size = 0;
+    schedule_received_ms = millis();
+    schedule_received_epoch = wall_clock();
+    schedule_is_fallback = false;
+    resume_pending = false;
+    last_server_epoch = schedule_received_epoch;
+    do {
+      if (!parse_number(bytes, length, &pos, &relay_num) || !parse_number(bytes, length, &pos, &duration_ms)
+          || !parse_number(bytes, length, &pos, &offset_ms))
+        break;
+      schedule[schedule_size].command_id = command_id;
+      schedule[schedule_size].relay_num = (int)relay_num;
+      schedule[schedule_size].duration_ms = duration_ms;
+      schedule[schedule_size].offset_ms = offset_ms;
+      schedule[schedule_size].state = ENTRY_PENDING;
+      schedule_size++;
+    } while (schedule_size < SCHEDULE_MAX_ENTRIES && parse_number(bytes, length, &pos, &command_id));
+    save_schedule();
+    return;
+  }
  
   // Note: Do not use the client in the callback to publish, subscribe or
   // unsubscribe as it may cause deadlocks when other things arrive while
@@ -107,17 +626,6 @@ void messageReceived(String &topic, String &payload) {
 }
 
 
-// see https://randomnerdtutorials.com/esp8266-pinout-reference-gpios/
-// const int R1_GPIO = 15; // D8, pulled to ground and SPI (only ok as output pin)
-const int R2_GPIO = 13; // D7, MOSI
-const int R3_GPIO = 12; // D6, MISO
-const int R4_GPIO = 14; // D5, SCK
-// const int R5_GPIO = 16; // D0, WAKE
-const int R6_GPIO = 3;  // RX, don't use this as output especially if UART in is desirable
-const int R7_GPIO = 0;  // D3, FLASH, pulled to ground
-// using D4 pulled to low, means that the LED will always be on
-const int R8_GPIO = 2;  // D4, LED, pulled to ground, HIGH at boot
-
 void setup() {
     // Serial.begin(115200);
 
@@ -143,54 +651,105 @@ void setup() {
     // Connect to WiFi
     WiFi.begin(ssid, password);
 
+    WiFi.setAutoReconnect(true);
+
     client.begin(host_id, net);
-    client.onMessage(messageReceived);
+    // persistent session under the fixed client id, the broker keeps the schedules that come while it is offline
+    client.setCleanSession(false);
+    client.setTimeout(LINK_CONNECT_TIMEOUT_MS);
+    client.onMessageAdvanced(messageReceived);
 
-    connect();
-}
+    timer1_attachInterrupt(relay_timer_isr);
 
+    // UTC is enough, only differences and the time of day of the last schedule are used
+    configTime(0, 0, "pool.ntp.org");
+    LittleFS.begin();
+    restore_schedule();
+}
 
-void loop() {
 
-    client.loop();
-    delay(10);  // <- fixes some issues with WiFi stability
+void run_relays(unsigned long now) {
+    bool changed = false;
+
+    // start the scheduled sections whose offset has come, on the schedule's clock so loop delays don't add up. A
+    // section resumed after a reset can be up to RESUME_MAX_LATE_MS late, it still gets its whole runtime
+    for (int e = 0; e < schedule_size && !resume_pending; e++) {
+        if (schedule[e].state == ENTRY_PENDING && now - schedule_received_ms >= schedule[e].offset_ms) {
+            unsigned long due_ms = schedule_received_ms + schedule[e].offset_ms;
+            // a relay only tracks one section, one still on is cut short by the new start
+            for (int other = 0; other < schedule_size; other++) {
+                if (schedule[other].state == ENTRY_RUNNING && schedule[other].relay_num == schedule[e].relay_num)
+                    schedule[other].state = ENTRY_DONE;
+            }
+            start_relay(schedule[e].relay_num, now - due_ms > START_LATE_MS ? now : due_ms, schedule[e].duration_ms);
+            schedule[e].state = ENTRY_RUNNING;
+            changed = true;
+        }
+    }
 
-    if (!client.connected()) {
-        connect();
+    // the timer interrupt turned these off, report them
+    noInterrupts();
+    uint32_t finished = relays_finished;
+    relays_finished = 0;
+    interrupts();
+
+    for (int r = 0; r < NUM_RELAYS; r++) {
+        if (!(finished & (1 << r)))
+            continue;
+
+        for (int e = 0; e < schedule_size; e++) {
+            if (schedule[e].state == ENTRY_RUNNING && schedule[e].relay_num == relays[r].relay_num) {
+                schedule[e].state = ENTRY_DONE;
+                changed = true;
+                // a fallback run is not reported, the server isn't waiting on it
+                if (!schedule_is_fallback)
+                    queue_done(schedule[e].command_id, relays[r].relay_num);
+            }
+        }
     }
 
-    
-    if ((relay_state2 || relay_state3 || relay_state4 || relay_state8) && !newTimerState) {
-        // if any of the relay states is on, start a timer to turn them off in ~1 second
-        newTimer = millis();
-        newTimerState = true;
+    if (changed) {
+        bool all_done = true;
+        for (int e = 0; e < schedule_size; e++) {
+            if (schedule[e].state != ENTRY_DONE)
+                all_done = false;
+        }
+        if (all_done)
+            finish_schedule();
+        save_schedule();
     }
+}
 
-    // turn off any relays and reset timers
-    if ((millis() - newTimer > relayOnTimer) && newTimerState) {
-        int relayOn = relay_state8*8 + relay_state4*4 + relay_state3*3 + relay_state2*2;  // possible bc only one relay should ever be on at any one time
-        
-        client.publish("/relay_done", String(controller_num + relayOn));
-        // Serial.printf("The outgoing message will say that relay %d was on\n", relayOn);
-
-        relay_state2 = 0x0;
-        relay_state3 = 0x0;
-        relay_state4 = 0x0;
-        relay_state8 = 0x0;
-        newTimerState = false;
-        relayOnTimer = 0;
+
+void loop() {
+    // the relays are timed first on every pass, connected or not
+    unsigned long pass_start_us = micros();
+    resume_step(millis());
+    fallback_step(millis());
+    run_relays(millis());
+
+    link_step(millis());
+    if (mqtt_link == LINK_UP) {
+        client.loop();
     }
+    delay(10);  // <- fixes some issues with WiFi stability
 
-    digitalWrite(R2_GPIO, relay_state2);
-    digitalWrite(R3_GPIO, relay_state3); 
-    digitalWrite(R4_GPIO, relay_state4);
-    digitalWrite(R8_GPIO, relay_state8);
-    
+    // a broker connect attempt or incoming message may have taken a while
+    run_relays(millis());
+    flush_done();
+    heartbeat_step(millis());
+
+    // the whole pass, delay included, is how long a relay start or an incoming message can wait
+    uint32_t pass_us = micros() - pass_start_us;
+    loop_passes++;
+    loop_total_us += pass_us;
+    if (pass_us > loop_max_us)
+      loop_max_us = pass_us;
 
     // test by publishing a message roughly every 10 second.
     // if (millis() - lastMillis > 10000) {
     //     lastMillis = millis();
-    //     client.publish("/back_yard", "2 3000"); // test that the correct relay turns for the correct amount of time
+    //     client.publish(cmd_topic, "IR1 15 S 1 1 2 3000 0;"); // test that the correct relay turns for the correct amount of time
     // }
 
 }
@@ -0,0 +1,142 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "relay_protocol.h"
+
+
+void relay_frame_schedule(relay_frame *frame, long controller_num) {
+    frame->length = snprintf(frame->body, RELAY_FRAME_MAX, "S %ld", controller_num);
+    frame->num_entries = 0;
+}
+
+
+void relay_frame_cancel(relay_frame *frame, long controller_num, unsigned long command_id) {
+    frame->length = snprintf(frame->body, RELAY_FRAME_MAX, "C %ld %lu", controller_num, command_id);
+    frame->num_entries = 0;
+}
+
+
+int relay_frame_add(relay_frame *frame, unsigned long command_id, long relay_num, long duration_ms, long offset_ms) {
+    // the whole frame, header included, has to fit
+    int room = RELAY_FRAME_MAX - RELAY_FRAME_HEADER_MAX - frame->length;
+    int length = snprintf(frame->body + frame->length, room > 0 ? room : 0, " %lu %ld %ld %ld;", command_id, relay_num, duration_ms, offset_ms);
+
+    if (length >= room) {
+        frame->body[frame->length] = '\0';
+        return -1;
+    }
+    frame->length += length;
+    frame->num_entries++;
+    return 0;
+}
+
+
+int relay_frame_finish(const relay_frame *frame, char *out) {
+    return snprintf(out, RELAY_FRAME_MAX, "IR%d %d %s", RELAY_PROTOCOL_VERSION, frame->length, frame->body);
+}
+
+
+static int parse_field(const char **text, unsigned long *value, char separator) {
+    /* a decimal number followed by separator, no sign or padding, *text moves past the separator */
+    char *end;
+
+    if (**text < '0' || **text > '9')
+        return -1;
+    *value = strtoul(*text, &end, 10);
+    if (*end != separator)
+        return -1;
+    *text = separator ? end + 1 : end;
+    return 0;
+}
+
+
+static int parse_signed(const char **text, long *value, char separator) {
+    unsigned long magnitude;
+    int negative = **text == '-';
+
+    if (negative)
+        (*text)++;
+    if (parse_field(text, &magnitude, separator) != 0)
+        return -1;
+    *value = negative ? -(long)magnitude : (long)magnitude;
+    return 0;
+}
+
+
+static const char *frame_body(char *frame, const void *payload, int length, int max_length, char type) {
+    /* copy the payload into frame (max_length bytes) and check its header, the body after "<type> " or NULL */
+    const char *text = frame;
+    unsigned long version, body_length;
+
+    if (length <= 0 || length >= max_length)
+        return NULL;
+    memcpy(frame, payload, length);
+    frame[length] = '\0';
+    if (strlen(frame) != (size_t)length || strncmp(frame, "IR", 2) != 0)
+        return NULL;
+
+    text += 2;
+    if (parse_field(&text, &version, ' ') != 0 || version != RELAY_PROTOCOL_VERSION
+            || parse_field(&text, &body_length, ' ') != 0 || body_length != (unsigned long)(length - (text - frame)))
+        return NULL;
+    if (text[0] != type || text[1] != ' ')
+        return NULL;
+    return text + 2;
+}
+
+
+int relay_parse_done(const void *payload, int length, relay_done *done) {
+    /* strict: every field is a decimal number in its place and the body is exactly as long as the header says */
+    char frame[RELAY_DONE_MAX];
+    const char *text = frame_body(frame, payload, length, RELAY_DONE_MAX, 'D');
+    unsigned long controller_num, relay_num;
+
+    if (!text || parse_field(&text, &controller_num, ' ') != 0 || parse_field(&text, &done->command_id, ' ') != 0
+            || parse_field(&text, &relay_num, '\0') != 0)
+        return -1;
+    done->controller_num = (long)controller_num;
+    done->relay_num = (long)relay_num;
+    return 0;
+}
+
+
+int relay_parse_heartbeat(const void *payload, int length, relay_heartbeat *heartbeat) {
+    char frame[RELAY_HEARTBEAT_MAX];
+    const char *text = frame_body(frame, payload, length, RELAY_HEARTBEAT_MAX, 'H');
+    unsigned long controller_num;
+
+    if (!text || parse_field(&text, &controller_num, ' ') != 0 || parse_field(&text, &heartbeat->uptime_s, ' ') != 0
+            || parse_field(&text, &heartbeat->free_heap, ' ') != 0 || parse_signed(&text, &heartbeat->rssi, ' ') != 0
+            || parse_field(&text, &heartbeat->connects, ' ') != 0 || parse_field(&text, &heartbeat->loop_avg_us, ' ') != 0
+            || parse_field(&text, &heartbeat->loop_max_us, ' ') != 0 || parse_field(&text, &heartbeat->relay_on_ms, '\0') != 0)
+        return -1;
+    heartbeat->controller_num = (long)controller_num;
+    return 0;
+}
+
+
+int relay_format_done(char *out, size_t out_len, long controller_num, unsigned long command_id, long relay_num) {
+    char body[RELAY_DONE_MAX];
+    int body_length = snprintf(body, sizeof(body), "D %ld %lu %ld", controller_num, command_id, relay_num);
+
+    return snprintf(out, out_len, "IR%d %d %s", RELAY_PROTOCOL_VERSION, body_length, body);
+}
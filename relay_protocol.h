@@ -0,0 +1,88 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+framing of the messages between the runner and the ESP controllers. Every message is one frame,
+"IR<version> <body length> <body>", and is dropped whole when the version is unknown or the length
+doesn't match the payload (a truncated or garbled packet never half-runs a schedule). The bodies:
+  "S <controller> <id> <relay> <msec> <offset msec>;..."   the controller's part of a run, one command per section
+  "C <controller> <id>"                                   drop the sections that haven't started yet
+  "D <controller> <id> <relay>"                           controller to runner, command id finished
+  "H <controller> <uptime s> <free heap> <rssi> <connects> <loop avg us> <loop max us> <relay on msec>"
+                                                          controller to runner every minute, no id (QoS 0)
+Every command has a 32 bit id that is unique per runner process and rising (it starts from the wall
+clock), both ends go over QoS 1 with persistent sessions and drop the duplicates it can deliver by id,
+and each ack names the exact command it completes.
+*/
+
+#ifndef RELAY_PROTOCOL_H
+#define RELAY_PROTOCOL_H
+
+#include <stddef.h>
+
+#define RELAY_PROTOCOL_VERSION 1
+#define RELAY_FRAME_MAX 560          // longest frame, the ESP's 640 byte MQTT buffer also holds the topic and packet header
+#define RELAY_FRAME_HEADER_MAX 12    // "IR1 560 " with room to spare
+#define RELAY_DONE_MAX 64            // longest done frame
+#define RELAY_HEARTBEAT_MAX 128      // longest heartbeat frame
+#define RELAY_RESUME_MAX_LATE_MS 300000  // an ESP reset resumes sections up to this late with their whole runtime
+
+typedef struct relay_frame {
+    char body[RELAY_FRAME_MAX];
+    int length;
+    int num_entries;
+} relay_frame;
+
+typedef struct relay_done {
+    long controller_num;
+    unsigned long command_id;
+    long relay_num;
+} relay_done;
+
+// a controller's heartbeat, the counters are since it booted and the loop timings since its last heartbeat
+typedef struct relay_heartbeat {
+    long controller_num;
+    unsigned long uptime_s;
+    unsigned long free_heap;     // in bytes
+    long rssi;                   // in dBm
+    unsigned long connects;      // broker connections, every one after the first is a reconnect
+    unsigned long loop_avg_us;   // loop() pass
+    unsigned long loop_max_us;
+    unsigned long relay_on_ms;   // every relay's measured on time added up, wraps at 32 bits
+} relay_heartbeat;
+
+// start a schedule or a cancel body for controller_num
+void relay_frame_schedule(relay_frame *frame, long controller_num);
+void relay_frame_cancel(relay_frame *frame, long controller_num, unsigned long command_id);
+
+// add a section to a schedule, -1 (and the frame unchanged) if it doesn't fit in RELAY_FRAME_MAX
+int relay_frame_add(relay_frame *frame, unsigned long command_id, long relay_num, long duration_ms, long offset_ms);
+
+// the frame with its header in out (at least RELAY_FRAME_MAX bytes), returns its length
+int relay_frame_finish(const relay_frame *frame, char *out);
+
+// parse a done frame (payload is not NUL terminated), 0 or -1 if it isn't a well formed version 1 done frame
+int relay_parse_done(const void *payload, int length, relay_done *done);
+
+// parse a heartbeat frame, 0 or -1 if it isn't a well formed version 1 heartbeat
+int relay_parse_heartbeat(const void *payload, int length, relay_heartbeat *heartbeat);
+
+// the done frame of command_id, as the ESP sends it (for the benchmarks and tests), returns its length
+int relay_format_done(char *out, size_t out_len, long controller_num, unsigned long command_id, long relay_num);
+
+#endif
@@ -0,0 +1,322 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "replay.h"
+#include "cimis_stream.h"
+#include "water_balance.h"
+#include "zone_table.h"
+#include "metrics.h"
+
+typedef struct replay_file {
+    weather_station *stations;
+    int num_stations;
+    char file_station[CIMIS_STATION_LEN];  // from a cimis_<station>.json name, for records without a Station
+    int num_kept;
+    int num_ignored;
+    int failed;
+} replay_file;
+
+
+static int keep_record(void *ctx, const char *station, int32_t day, const cimis_day *record) {
+    /* stream parser callback, the records of stations no section uses are dropped */
+    replay_file *file = (replay_file *)ctx;
+    const char *id = station[0] != '\0' ? station : file->file_station;
+
+    for (int s = 0; s < file->num_stations; s++) {
+        weather_station *weather = &file->stations[s];
+        if (strcmp(weather->id, id) != 0)
+            continue;
+        if (!weather->store_open) {
+            memset(&weather->store, 0, sizeof(cimis_store));
+            snprintf(weather->store.station, CIMIS_STATION_LEN, "%s", weather->id);
+            weather->store_open = 1;
+        }
+        if (cimis_store_put(&weather->store, day, record) != 0) {
+            file->failed = 1;
+            return 1;
+        }
+        file->num_kept++;
+        return 0;
+    }
+    file->num_ignored++;
+    return 0;
+}
+
+
+static int read_response(const char *path, const char *name, weather_station *stations, int num_stations) {
+    /* feed one saved CIMIS response to the stream parser a chunk at a time, returns the records kept */
+    replay_file file;
+    cimis_stream stream;
+    static char chunk[REPLAY_READ_CHUNK];
+
+    memset(&file, 0, sizeof(file));
+    file.stations = stations;
+    file.num_stations = num_stations;
+    // cimis_<station>.json or cimis_<station>_<anything>.json
+    if (strncmp(name, "cimis_", 6) == 0)
+        snprintf(file.file_station, CIMIS_STATION_LEN, "%.*s", (int)strcspn(name + 6, "_."), name + 6);
+
+    FILE *response = fopen(path, "rb");
+    if (response == NULL) {
+        fprintf(stderr, "error: cannot read %s\n", path);
+        return -1;
+    }
+    cimis_stream_init(&stream, keep_record, &file, NULL);
+    size_t size;
+    while ((size = fread(chunk, 1, sizeof(chunk), response)) > 0) {
+        if (cimis_stream_feed(&stream, chunk, size) < size)
+            break;
+    }
+    fclose(response);
+
+    if (file.failed) {
+        fprintf(stderr, "error: unable to allocate the weather of %s\n", path);
+        return -1;
+    }
+    if (cimis_stream_finish(&stream) != 0)
+        fprintf(stderr, "error: %s is not a complete CIMIS response, %d records were kept from it\n", path, file.num_kept);
+    if (file.num_ignored > 0)
+        printf("%s: %d records of stations no section uses were skipped\n", path, file.num_ignored);
+    return file.num_kept;
+}
+
+
+int replay_load_weather(const char *weather_path, weather_station *stations, int num_stations) {
+    struct stat path_stat;
+    int num_records = 0;
+
+    if (stat(weather_path, &path_stat) != 0) {
+        fprintf(stderr, "error: cannot find %s\n", weather_path);
+        return -1;
+    }
+    if (!S_ISDIR(path_stat.st_mode)) {
+        const char *name = strrchr(weather_path, '/');
+        return read_response(weather_path, name ? name + 1 : weather_path, stations, num_stations);
+    }
+
+    DIR *dir = opendir(weather_path);
+    if (dir == NULL) {
+        fprintf(stderr, "error: cannot read the directory %s\n", weather_path);
+        return -1;
+    }
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        char path[512];
+        size_t length = strlen(entry->d_name);
+
+        if (strncmp(entry->d_name, "cimis_", 6) != 0 || length < 5 || strcmp(entry->d_name + length - 5, ".json") != 0)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s", weather_path, entry->d_name);
+        int num_kept = read_response(path, entry->d_name, stations, num_stations);
+        if (num_kept < 0) {
+            closedir(dir);
+            return -1;
+        }
+        num_records += num_kept;
+    }
+    closedir(dir);
+    return num_records;
+}
+
+
+void replay_close_weather(weather_station *stations, int num_stations) {
+    for (int s = 0; s < num_stations; s++) {
+        if (stations[s].store_open) {
+            cimis_store_close(&stations[s].store);
+            stations[s].store_open = 0;
+        }
+    }
+}
+
+
+int replay_weather_days(const weather_station *stations, int num_stations, int32_t *first_day, int32_t *last_day) {
+    /* the days every store covers between them, unless the range was given */
+    int32_t data_first = INT32_MAX, data_last = INT32_MIN;
+
+    for (int s = 0; s < num_stations; s++) {
+        if (!stations[s].store_open || stations[s].store.num_days == 0)
+            continue;
+        if (stations[s].store.first_day < data_first)
+            data_first = stations[s].store.first_day;
+        if (stations[s].store.first_day + stations[s].store.num_days - 1 > data_last)
+            data_last = stations[s].store.first_day + stations[s].store.num_days - 1;
+    }
+    if (*first_day < 0)
+        *first_day = data_first;
+    if (*last_day < 0)
+        *last_day = data_last;
+    if (*last_day < *first_day) {
+        fprintf(stderr, "error: no days of weather to replay\n");
+        return -1;
+    }
+    return 0;
+}
+
+
+void replay_write_csv_string(FILE *out, const char *value) {
+    // section names are free text, quoted with any quote doubled
+    fputc('"', out);
+    for (const char *c = value; *c; c++) {
+        if (*c == '"')
+            fputc('"', out);
+        fputc(*c, out);
+    }
+    fputc('"', out);
+}
+
+
+int replay_run(const zone_config *config, const replay_options *options) {
+    /* one simulated morning run per day: the balance takes the day's weather, the demand kernel picks the sections
+    past their threshold, and each of them is credited as if its controller had acked at once */
+    weather_station stations[MAX_STATIONS];
+    int num_stations = zone_config_stations(config, stations);
+    int num_sections = config->num_zones;
+    int64_t start_ns = metrics_now_ns();
+    char tmp_path[128];
+    int status = -1;
+
+    int num_records = replay_load_weather(options->weather_path, stations, num_stations);
+    if (num_records <= 0) {
+        if (num_records == 0)
+            fprintf(stderr, "error: %s has no weather for the stations of the zone configuration\n", options->weather_path);
+        replay_close_weather(stations, num_stations);
+        return -1;
+    }
+
+    int32_t first_day = options->first_day, last_day = options->last_day;
+    if (replay_weather_days(stations, num_stations, &first_day, &last_day) != 0) {
+        replay_close_weather(stations, num_stations);
+        return -1;
+    }
+
+    zone_table zones;
+    zone_weather *weather = malloc(num_sections * sizeof(zone_weather) + 1);
+    double *total_gallons = calloc(num_sections + 1, sizeof(double));
+    double *total_ms = calloc(num_sections + 1, sizeof(double));
+    int *num_waterings = calloc(num_sections + 1, sizeof(int));
+    water_balance balance;
+    FILE *out = NULL;
+
+    memset(&balance, 0, sizeof(balance));
+    if (zone_table_init(&zones, num_sections) != 0 || !weather || !total_gallons || !total_ms || !num_waterings) {
+        fprintf(stderr, "error: unable to allocate the replay of %d sections\n", num_sections);
+        goto done;
+    }
+    // every section starts the season at field capacity
+    zone_config_fill(config, stations, &zones, weather);
+    for (int i = 0; i < num_sections; i++) {
+        zones.last_day[i] = first_day - 1;
+        zones.depletion[i] = 0.f;
+    }
+    if (water_balance_init(&balance, "", &zones, NULL) != 0)
+        goto done;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", options->output_path);
+    out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "error: cannot write %s\n", tmp_path);
+        goto done;
+    }
+    fprintf(out, "date,section,controller,relay,demand_gallons,gallons,runtime_s\n");
+
+    int total_waterings = 0;
+    uint64_t seq = 0;
+    for (int32_t day = first_day; day <= last_day; day++) {
+        char date[16];
+
+        // the export is all there will be, a day missing from it is skipped rather than waited for
+        water_balance_advance(&balance, weather, stations, day, 0);
+        zone_demand_kernel(&zones);
+
+        // the run that sees day's weather is the next morning's
+        cimis_day_string(day + 1, date, sizeof(date));
+        for (int i = 0; i < num_sections; i++) {
+            if (zones.water_demand[i] <= 0.f || zones.relay_num[i] <= 0 || zones.controller_num[i] <= 0)
+                continue;
+
+            // the same event record_watering logs for an ack
+            watering_event event;
+            memset(&event, 0, sizeof(event));
+            event.seq = ++seq;
+            event.time = (int64_t)(day + 1) * 86400;
+            event.day = day + 1;
+            event.duration_ms = (long)zones.runtime_ms[i];
+            event.gallons = event.duration_ms * zones.flow_gph[i] / 3600000.;
+            event.controller_num = zones.controller_num[i];
+            event.relay_num = zones.relay_num[i];
+            snprintf(event.zone, ZONE_NAME_LEN, "%s", zones.name[i]);
+
+            fprintf(out, "%s,", date);
+            replay_write_csv_string(out, zones.name[i]);
+            fprintf(out, ",%d,%d,%.3f,%.3f,%.1f\n", event.controller_num, event.relay_num, zones.water_demand[i],
+                event.gallons, event.duration_ms / 1000.);
+            water_balance_irrigate(&balance, &event);
+
+            total_gallons[i] += event.gallons;
+            total_ms[i] += event.duration_ms;
+            num_waterings[i]++;
+            total_waterings++;
+        }
+    }
+
+    if (fclose(out) != 0 || rename(tmp_path, options->output_path) != 0) {
+        fprintf(stderr, "error: cannot replace %s\n", options->output_path);
+        remove(tmp_path);
+        out = NULL;
+        goto done;
+    }
+    out = NULL;
+
+    char first_buffer[16], last_buffer[16];
+    double season_gallons = 0.;
+    cimis_day_string(first_day, first_buffer, sizeof(first_buffer));
+    cimis_day_string(last_day, last_buffer, sizeof(last_buffer));
+    printf("---------------------------------------------------------------------\n");
+    printf("   Section    |   Waterings   |    Gallons    |   Runtime (min)\n");
+    printf("---------------------------------------------------------------------\n");
+    for (int i = 0; i < num_sections; i++) {
+        printf("   %s   |   %d   |   %.1f   |   %.1f\n", zones.name[i], num_waterings[i], total_gallons[i], total_ms[i] / 60000.);
+        season_gallons += total_gallons[i];
+    }
+    printf("---------------------------------------------------------------------\n");
+    printf("Replayed %s to %s (%d days, %d CIMIS records) over %d sections: %d waterings, %.1f gallons in %.3f sec\n",
+        first_buffer, last_buffer, last_day - first_day + 1, num_records, num_sections, total_waterings, season_gallons,
+        (metrics_now_ns() - start_ns) / 1e9);
+    printf("Waterings written to %s\n", options->output_path);
+    status = 0;
+
+done:
+    if (out) {
+        fclose(out);
+        remove(tmp_path);
+    }
+    water_balance_free(&balance);
+    zone_table_free(&zones);
+    free(num_waterings);
+    free(total_ms);
+    free(total_gallons);
+    free(weather);
+    replay_close_weather(stations, num_stations);
+    return status;
+}
@@ -0,0 +1,63 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+season replay: runs the water balance and demand model over historical CIMIS data on a virtual clock, one
+simulated morning run per day with every watering acked on the spot, no sleeps, no broker and no HTTP.
+The weather comes from saved CIMIS responses (cimis_<station>.json or cimis_<station>_<anything>.json in
+a directory, or one multi-month export) parsed by the same stream parser the runner uses, into stores
+that only live in memory, so the cimis_<station>.dat files and irrigation_balance.dat are never touched.
+Every watering is written as a CSV row of the run date, section, gallons and runtime.
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "weather.h"
+#include "zone_config.h"
+
+#define REPLAY_READ_CHUNK 65536   // bytes of a saved response fed to the stream parser at a time
+
+typedef struct replay_options {
+    const char *weather_path;   // directory of cimis_*.json files or a single CIMIS response
+    const char *output_path;    // CSV of the waterings
+    int32_t first_day;          // first day of weather to simulate, -1 for the first day in the data
+    int32_t last_day;           // last day of weather, -1 for the last day in the data
+} replay_options;
+
+// load every daily record of the stations in the table from options->weather_path into in-memory stores (the
+// stations' store_open is set, the stores are not saved); returns the number of records kept, -1 on an error
+int replay_load_weather(const char *weather_path, weather_station *stations, int num_stations);
+
+// close the in-memory stores without saving them (weather_close would write them over the local ones)
+void replay_close_weather(weather_station *stations, int num_stations);
+
+// fill in a first or last day of -1 with the first or last day the open stores have; -1 if the range is empty
+int replay_weather_days(const weather_station *stations, int num_stations, int32_t *first_day, int32_t *last_day);
+
+// a free text CSV field, quoted with any quote doubled
+void replay_write_csv_string(FILE *out, const char *value);
+
+// simulate every day of the options' range over the sections of config, writing the waterings to options->output_path
+// and a per-section summary to stdout; returns 0 on success, -1 on an error
+int replay_run(const zone_config *config, const replay_options *options);
+
+#endif
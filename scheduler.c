@@ -0,0 +1,185 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scheduler.h"
+
+
+static int compare_longest_first(const void *a, const void *b) {
+    /* qsort comparison, longest running jobs are packed first so the short ones fill in the gaps */
+    const irrigation_job *job_a = (const irrigation_job *)a;
+    const irrigation_job *job_b = (const irrigation_job *)b;
+
+    if (job_a->duration_ms != job_b->duration_ms)
+        return (job_a->duration_ms < job_b->duration_ms) ? 1 : -1;
+    // keep the order of the irrigation JSON for equal runtimes
+    return job_a->section - job_b->section;
+}
+
+
+void scheduler_init(dispatch_scheduler *sched, irrigation_job *jobs, int num_jobs, water_source *sources, int num_sources) {
+    qsort(jobs, num_jobs, sizeof(irrigation_job), compare_longest_first);
+
+    for (int i = 0; i < num_jobs; i++) {
+        jobs[i].state = JOB_PENDING;
+    }
+    for (int s = 0; s < num_sources; s++) {
+        sources[s].in_use_gph = 0.;
+        sources[s].running = 0;
+    }
+
+    sched->jobs = jobs;
+    sched->num_jobs = num_jobs;
+    sched->sources = sources;
+    sched->num_sources = num_sources;
+    sched->num_running = 0;
+    sched->num_done = 0;
+}
+
+
+static int relay_busy(const dispatch_scheduler *sched, long controller_num, long relay_num) {
+    /* the ESPs time each relay on its own, only a relay that is already on has to wait (sections sharing it) */
+    for (int i = 0; i < sched->num_jobs; i++) {
+        const irrigation_job *job = &sched->jobs[i];
+        if (job->state == JOB_RUNNING && job->controller_num == controller_num && job->relay_num == relay_num)
+            return 1;
+    }
+    return 0;
+}
+
+
+static int fits_source(const water_source *source, float flow_gph) {
+    if (source->running == 0) {
+        // a section always gets to run on an idle source, even if it alone is over the budget
+        return 1;
+    }
+    if (source->max_gph <= 0.) {
+        // no budget declared, keep the old behavior of one section at a time (pressure problems otherwise)
+        return 0;
+    }
+    return source->in_use_gph + flow_gph <= source->max_gph;
+}
+
+
+int scheduler_next(const dispatch_scheduler *sched) {
+    for (int i = 0; i < sched->num_jobs; i++) {
+        const irrigation_job *job = &sched->jobs[i];
+
+        if (job->state != JOB_PENDING)
+            continue;
+        if (!fits_source(&sched->sources[job->source], job->flow_gph))
+            continue;
+        if (relay_busy(sched, job->controller_num, job->relay_num))
+            continue;
+
+        return i;
+    }
+    return -1;
+}
+
+
+void scheduler_start(dispatch_scheduler *sched, int job) {
+    irrigation_job *curr_job = &sched->jobs[job];
+    water_source *source = &sched->sources[curr_job->source];
+
+    curr_job->state = JOB_RUNNING;
+    source->in_use_gph += curr_job->flow_gph;
+    source->running++;
+    sched->num_running++;
+}
+
+
+void scheduler_finish(dispatch_scheduler *sched, int job) {
+    irrigation_job *curr_job = &sched->jobs[job];
+    water_source *source = &sched->sources[curr_job->source];
+
+    if (curr_job->state != JOB_RUNNING)
+        return;
+
+    curr_job->state = JOB_DONE;
+    source->in_use_gph -= curr_job->flow_gph;
+    source->running--;
+    if (source->running == 0) {
+        source->in_use_gph = 0.;   // don't let float rounding accumulate
+    }
+    sched->num_running--;
+    sched->num_done++;
+}
+
+
+long scheduler_plan(irrigation_job *jobs, int num_jobs, water_source *sources, int num_sources, long *start_ms) {
+    /* run the scheduler against a virtual clock, every relay finishing exactly on time */
+    dispatch_scheduler sched;
+    long *end_ms = malloc(num_jobs * sizeof(long) + 1);
+    long now_ms = 0;
+
+    if (!end_ms)
+        return -1;
+
+    scheduler_init(&sched, jobs, num_jobs, sources, num_sources);
+
+    while (sched.num_done < sched.num_jobs) {
+        int next;
+        while ((next = scheduler_next(&sched)) >= 0) {
+            scheduler_start(&sched, next);
+            end_ms[next] = now_ms + jobs[next].duration_ms;
+            if (start_ms)
+                start_ms[next] = now_ms;
+        }
+
+        // advance to the earliest finishing job
+        long earliest = -1;
+        for (int i = 0; i < num_jobs; i++) {
+            if (jobs[i].state == JOB_RUNNING && (earliest < 0 || end_ms[i] < earliest))
+                earliest = end_ms[i];
+        }
+        if (earliest < 0)
+            break;
+        now_ms = earliest;
+        for (int i = 0; i < num_jobs; i++) {
+            if (jobs[i].state == JOB_RUNNING && end_ms[i] <= now_ms)
+                scheduler_finish(&sched, i);
+        }
+    }
+
+    // leave the jobs and sources as scheduler_init does, ready to be dispatched
+    scheduler_init(&sched, jobs, num_jobs, sources, num_sources);
+    free(end_ms);
+    return now_ms;
+}
+
+
+long scheduler_estimate_ms(const irrigation_job *jobs, int num_jobs, const water_source *sources, int num_sources) {
+    /* plan a copy, the caller's jobs and sources stay as they are */
+    irrigation_job *sim_jobs = malloc(num_jobs * sizeof(irrigation_job) + 1);
+    water_source *sim_sources = malloc(num_sources * sizeof(water_source) + 1);
+    long total_ms = -1;
+
+    if (sim_jobs && sim_sources) {
+        memcpy(sim_jobs, jobs, num_jobs * sizeof(irrigation_job));
+        memcpy(sim_sources, sources, num_sources * sizeof(water_source));
+        total_ms = scheduler_plan(sim_jobs, num_jobs, sim_sources, num_sources, NULL);
+    }
+
+    free(sim_jobs);
+    free(sim_sources);
+    return total_ms;
+}
@@ -0,0 +1,76 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+packs the garden sections that need water into concurrent runs so that sections on different
+relays (of the same or different controllers) can be watered at the same time, as long as the total flow drawn from each water
+source stays under the budget the plumbing can deliver (declared in the irrigation JSON)
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#define MAX_WATER_SOURCES 16
+#define WATER_SOURCE_NAME_LEN 32
+
+typedef struct water_source {
+    char name[WATER_SOURCE_NAME_LEN];
+    float max_gph;       // in gal/hr, the most flow the source can deliver at a usable pressure (<= 0 means one section at a time)
+    float in_use_gph;    // in gal/hr, flow drawn by the sections currently running on this source
+    int running;         // number of sections currently running on this source
+} water_source;
+
+typedef struct irrigation_job {
+    int section;         // index of the garden section being watered
+    long controller_num; // the ESP module's number for that section of the garden
+    long relay_num;      // the relay number of that garden section
+    int source;          // index into the water source table
+    float flow_gph;      // in gal/hr, the flow the section draws while its relay is on
+    long duration_ms;    // in msec, how long the relay stays on
+    unsigned long command_id;  // id of the command that runs it, set when it is dispatched
+    int state;           // JOB_PENDING, JOB_RUNNING or JOB_DONE
+} irrigation_job;
+
+enum { JOB_PENDING = 0, JOB_RUNNING, JOB_DONE };
+
+typedef struct dispatch_scheduler {
+    irrigation_job *jobs;
+    int num_jobs;
+    water_source *sources;
+    int num_sources;
+    int num_running;
+    int num_done;
+} dispatch_scheduler;
+
+// sorts the jobs longest first and clears the running state of every source
+void scheduler_init(dispatch_scheduler *sched, irrigation_job *jobs, int num_jobs, water_source *sources, int num_sources);
+
+// index of the next pending job that fits in the flow budget and whose relay is idle, -1 if none fit right now
+int scheduler_next(const dispatch_scheduler *sched);
+
+void scheduler_start(dispatch_scheduler *sched, int job);
+void scheduler_finish(dispatch_scheduler *sched, int job);
+
+// simulates the schedule assuming every relay runs exactly its duration and sets start_ms[i] (if not NULL) to the
+// msec after the start at which jobs[i] turns on; the jobs are left sorted and pending as scheduler_init leaves them
+// returns the expected total time in msec
+long scheduler_plan(irrigation_job *jobs, int num_jobs, water_source *sources, int num_sources, long *start_ms);
+
+// the same on a copy of the jobs and sources
+long scheduler_estimate_ms(const irrigation_job *jobs, int num_jobs, const water_source *sources, int num_sources);
+
+#endif
@@ -0,0 +1,117 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include <jansson.h>     // json parser for C, see https://jansson.readthedocs.io/en/latest/ for documentation
+
+#include "sites.h"
+
+
+static int copy_string(json_t *site, const char *key, char *out, size_t size, const char *name) {
+    /* an optional string field, 0 when it is absent (out keeps its default) or fits, -1 otherwise */
+    json_t *value = json_object_get(site, key);
+
+    if (!value)
+        return 0;
+    if (!json_is_string(value) || json_string_value(value)[0] == '\0' || strlen(json_string_value(value)) >= size) {
+        fprintf(stderr, "error: %s of site %s is not a string of 1 to %zu characters\n", key, name, size - 1);
+        return -1;
+    }
+    snprintf(out, size, "%s", json_string_value(value));
+    return 0;
+}
+
+
+int sites_load(const char *path, const site_config *defaults, site_config *sites, int max_sites) {
+    json_error_t error;
+    int num_sites = 0;
+
+    json_t *root = json_load_file(path, 0, &error);
+    if (!root) {
+        fprintf(stderr, "error: %s line %d: %s\n", path, error.line, error.text);
+        return -1;
+    }
+    json_t *Sites = json_object_get(root, "Sites");
+    if (!json_is_array(Sites) || json_array_size(Sites) == 0) {
+        fprintf(stderr, "error: %s has no \"Sites\" array\n", path);
+        json_decref(root);
+        return -1;
+    }
+    if ((int)json_array_size(Sites) > max_sites) {
+        fprintf(stderr, "error: %s lists %zu sites, at most %d can run in one process\n", path, json_array_size(Sites), max_sites);
+        json_decref(root);
+        return -1;
+    }
+
+    size_t i;
+    json_t *get_site;
+    json_array_foreach(Sites, i, get_site) {
+        site_config *site = &sites[num_sites];
+        json_t *Name = json_object_get(get_site, "Name");
+        json_t *Port = json_object_get(get_site, "MqttPort");
+
+        *site = *defaults;
+        site->name[0] = site->dir[0] = '\0';
+        if (!json_is_string(Name) || copy_string(get_site, "Name", site->name, SITE_NAME_LEN, "?") != 0) {
+            fprintf(stderr, "error: site %zu of %s has no usable Name\n", i, path);
+            json_decref(root);
+            return -1;
+        }
+        // two sites in one directory would write over each other's balance and journal
+        if (copy_string(get_site, "Dir", site->dir, SITE_DIR_LEN, site->name) != 0 || site->dir[0] == '\0'
+                || copy_string(get_site, "Station", site->station, CIMIS_STATION_LEN, site->name) != 0
+                || copy_string(get_site, "MqttHost", site->mqtt_host, SITE_MQTT_LEN, site->name) != 0
+                || copy_string(get_site, "MqttUser", site->mqtt_user, SITE_MQTT_LEN, site->name) != 0
+                || copy_string(get_site, "MqttPassword", site->mqtt_password, SITE_MQTT_LEN, site->name) != 0) {
+            fprintf(stderr, "error: site %s of %s needs a Dir and usable MQTT and Station fields\n", site->name, path);
+            json_decref(root);
+            return -1;
+        }
+        if (Port) {
+            if (!json_is_integer(Port) || json_integer_value(Port) <= 0 || json_integer_value(Port) > 65535) {
+                fprintf(stderr, "error: MqttPort of site %s is not a port number\n", site->name);
+                json_decref(root);
+                return -1;
+            }
+            site->mqtt_port = (int)json_integer_value(Port);
+        }
+        for (int s = 0; s < num_sites; s++) {
+            if (strcmp(sites[s].name, site->name) == 0 || strcmp(sites[s].dir, site->dir) == 0) {
+                fprintf(stderr, "error: sites %s and %s share a Name or Dir\n", sites[s].name, site->name);
+                json_decref(root);
+                return -1;
+            }
+        }
+        num_sites++;
+    }
+
+    json_decref(root);
+    return num_sites;
+}
+
+
+int site_path(const site_config *site, const char *name, char *buffer, size_t size) {
+    int length = site->dir[0] != '\0' ? snprintf(buffer, size, "%s/%s", site->dir, name) : snprintf(buffer, size, "%s", name);
+    if (length < 0 || (size_t)length >= size) {
+        fprintf(stderr, "error: the path of %s in %s is too long\n", name, site->dir);
+        return -1;
+    }
+    return 0;
+}
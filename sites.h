@@ -0,0 +1,57 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+the gardens one process runs with --sites, listed in a JSON file, e.g.
+    {"Sites": [
+        {"Name": "home", "Dir": "sites/home"},
+        {"Name": "ranch", "Dir": "sites/ranch", "Station": "80", "MqttHost": "10.0.4.2", "MqttPort": 1883,
+         "MqttUser": "ranch", "MqttPassword": "secret"}
+    ]}
+Each site keeps its irrigation_log.json, water balance, watering journal and log in its own directory and
+talks to its own broker; the MQTT and station fields that are left out take the values built into the binary.
+*/
+
+#ifndef SITES_H
+#define SITES_H
+
+#include "cimis_store.h"
+
+#define MAX_SITES 32
+#define SITE_NAME_LEN 32
+#define SITE_DIR_LEN 40         // leaves room for <dir>/irrigation_snapshot.dat in the 64 byte paths
+#define SITE_MQTT_LEN 64
+
+typedef struct site_config {
+    char name[SITE_NAME_LEN];
+    char dir[SITE_DIR_LEN];             // "" for the working directory
+    char station[CIMIS_STATION_LEN];    // CIMIS station of the sections that name none
+    char mqtt_host[SITE_MQTT_LEN];
+    int mqtt_port;
+    char mqtt_user[SITE_MQTT_LEN];
+    char mqtt_password[SITE_MQTT_LEN];
+} site_config;
+
+// parse path into sites, the fields a site leaves out are copied from defaults; returns how many sites, -1 when
+// the file doesn't parse or a site has no usable Name or Dir (every site has to be right before any of them runs)
+int sites_load(const char *path, const site_config *defaults, site_config *sites, int max_sites);
+
+// dir/name (or name alone for the working directory) into buffer, -1 if it doesn't fit
+int site_path(const site_config *site, const char *name, char *buffer, size_t size);
+
+#endif
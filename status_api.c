@@ -0,0 +1,672 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "status_api.h"
+#include "zone_config.h"
+
+typedef struct status_zone {
+    char name[ZONE_NAME_LEN];
+    long controller_num;
+    long relay_num;
+    float depletion;
+    float taw;
+    float mad;
+    float water_demand;
+    float runtime_ms;
+} status_zone;
+
+typedef struct status_command_entry {
+    unsigned long command_id;
+    long controller_num;
+    long relay_num;
+    char zone[ZONE_NAME_LEN];
+    long start_ms;
+    long duration_ms;
+    time_t sent;
+    time_t done;
+    long latency_ms;
+    int state;
+} status_command_entry;
+
+typedef struct status_site_entry {
+    char name[32];
+    int running;
+    time_t run_start;
+    time_t run_end;
+    int result;
+    int32_t day;                  // of the balance in zones
+    status_zone *zones;
+    int num_zones;
+    int capacity;
+    status_command_entry commands[STATUS_MAX_COMMANDS];
+    int num_commands;
+} status_site_entry;
+
+typedef struct status_ack {
+    long controller_num;
+    int site;
+    long relay_num;
+    unsigned long command_id;
+    time_t time;
+    long latency_ms;
+} status_ack;
+
+typedef struct status_station {
+    char id[CIMIS_STATION_LEN];
+    int32_t first_day;            // first and last day with a CIMIS record, -1 before any
+    int32_t last_day;
+    int32_t num_days;             // days with a record
+    int32_t num_gaps;             // days between the first and last without one
+    int dirty;                    // days not saved yet
+} status_station;
+
+static struct {
+    pthread_mutex_t lock;
+    status_site_entry *sites[STATUS_MAX_SITES];
+    int num_sites;
+    time_t next_run;
+    status_ack acks[STATUS_MAX_CONTROLLERS];
+    int num_acks;
+    status_station stations[STATUS_MAX_STATIONS];
+    int num_stations;
+    time_t cache_time;
+} board = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static const char *state_names[] = {"waiting", "acked", "timeout", "cancelled"};
+
+static struct {
+    int fd;
+    char path[108];
+    pthread_t thread;
+    int running;
+} server = {.fd = -1};
+
+// one response, the buffer is the server thread's and grows to the largest answer
+typedef struct response {
+    char *data;
+    size_t length;
+    size_t capacity;
+    int failed;
+} response;
+
+
+int status_site(const char *name) {
+    int site = -1;
+
+    pthread_mutex_lock(&board.lock);
+    for (int s = 0; s < board.num_sites; s++) {
+        if (strcmp(board.sites[s]->name, name) == 0)
+            site = s;
+    }
+    if (site < 0 && board.num_sites < STATUS_MAX_SITES) {
+        status_site_entry *entry = calloc(1, sizeof(status_site_entry));
+        if (entry) {
+            snprintf(entry->name, sizeof(entry->name), "%s", name);
+            entry->day = -1;
+            site = board.num_sites;
+            board.sites[board.num_sites++] = entry;
+        }
+    }
+    pthread_mutex_unlock(&board.lock);
+    return site;
+}
+
+
+void status_run_start(int site, time_t now) {
+    if (site < 0)
+        return;
+    pthread_mutex_lock(&board.lock);
+    board.sites[site]->running = 1;
+    board.sites[site]->run_start = now;
+    board.sites[site]->num_commands = 0;
+    pthread_mutex_unlock(&board.lock);
+}
+
+
+void status_run_end(int site, time_t now, int result) {
+    if (site < 0)
+        return;
+    pthread_mutex_lock(&board.lock);
+    board.sites[site]->running = 0;
+    board.sites[site]->run_end = now;
+    board.sites[site]->result = result;
+    pthread_mutex_unlock(&board.lock);
+}
+
+
+void status_next_run(time_t next) {
+    pthread_mutex_lock(&board.lock);
+    board.next_run = next;
+    pthread_mutex_unlock(&board.lock);
+}
+
+
+int status_zones(int site, const zone_table *zones, int32_t day) {
+    /* the names are copied too, a reload unmaps the configuration they point into */
+    if (site < 0)
+        return -1;
+    pthread_mutex_lock(&board.lock);
+    status_site_entry *entry = board.sites[site];
+    if (zones->num_zones > entry->capacity) {
+        status_zone *grown = realloc(entry->zones, zones->num_zones * sizeof(status_zone));
+        if (!grown) {
+            pthread_mutex_unlock(&board.lock);
+            return -1;
+        }
+        entry->zones = grown;
+        entry->capacity = zones->num_zones;
+    }
+    for (int i = 0; i < zones->num_zones; i++) {
+        status_zone *zone = &entry->zones[i];
+
+        snprintf(zone->name, ZONE_NAME_LEN, "%s", zones->name[i]);
+        zone->controller_num = zones->controller_num[i];
+        zone->relay_num = zones->relay_num[i];
+        zone->depletion = zones->depletion[i];
+        zone->taw = zones->taw[i];
+        zone->mad = zones->mad[i];
+        zone->water_demand = zones->water_demand[i];
+        zone->runtime_ms = zones->runtime_ms[i];
+    }
+    entry->num_zones = zones->num_zones;
+    entry->day = day;
+    pthread_mutex_unlock(&board.lock);
+    return 0;
+}
+
+
+void status_command(int site, unsigned long command_id, long controller_num, long relay_num, const char *zone,
+        long start_ms, long duration_ms, time_t sent) {
+    if (site < 0)
+        return;
+    pthread_mutex_lock(&board.lock);
+    status_site_entry *entry = board.sites[site];
+    if (entry->num_commands < STATUS_MAX_COMMANDS) {
+        status_command_entry *command = &entry->commands[entry->num_commands++];
+
+        memset(command, 0, sizeof(status_command_entry));
+        command->command_id = command_id;
+        command->controller_num = controller_num;
+        command->relay_num = relay_num;
+        snprintf(command->zone, ZONE_NAME_LEN, "%s", zone);
+        command->start_ms = start_ms;
+        command->duration_ms = duration_ms;
+        command->sent = sent;
+        command->state = STATUS_WAITING;
+    }
+    pthread_mutex_unlock(&board.lock);
+}
+
+
+void status_command_done(int site, unsigned long command_id, int state, long latency_ms, time_t now) {
+    if (site < 0)
+        return;
+    pthread_mutex_lock(&board.lock);
+    status_site_entry *entry = board.sites[site];
+    for (int c = 0; c < entry->num_commands; c++) {
+        status_command_entry *command = &entry->commands[c];
+
+        if (command->command_id != command_id)
+            continue;
+        command->state = state;
+        command->done = now;
+        command->latency_ms = latency_ms;
+        if (state != STATUS_ACKED)
+            break;
+
+        // the controller's last ack, controllers are added as their first ack comes in
+        int a = 0;
+        while (a < board.num_acks && board.acks[a].controller_num != command->controller_num)
+            a++;
+        if (a == board.num_acks && board.num_acks < STATUS_MAX_CONTROLLERS)
+            board.num_acks++;
+        if (a < board.num_acks) {
+            board.acks[a].controller_num = command->controller_num;
+            board.acks[a].site = site;
+            board.acks[a].relay_num = command->relay_num;
+            board.acks[a].command_id = command_id;
+            board.acks[a].time = now;
+            board.acks[a].latency_ms = latency_ms;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&board.lock);
+}
+
+
+void status_cache(const weather_station *stations, int num_stations, time_t now) {
+    pthread_mutex_lock(&board.lock);
+    board.num_stations = 0;
+    for (int s = 0; s < num_stations && s < STATUS_MAX_STATIONS; s++) {
+        const cimis_store *store = &stations[s].store;
+        status_station *station = &board.stations[board.num_stations++];
+
+        snprintf(station->id, CIMIS_STATION_LEN, "%s", stations[s].id);
+        station->first_day = station->last_day = -1;
+        station->num_days = station->num_gaps = 0;
+        station->dirty = stations[s].store_open && store->dirty;
+        for (int32_t d = 0; stations[s].store_open && d < store->num_days; d++) {
+            if (!(store->days[d].flags & CIMIS_DAY_PRESENT))
+                continue;
+            if (station->first_day < 0)
+                station->first_day = store->first_day + d;
+            station->last_day = store->first_day + d;
+            station->num_days++;
+        }
+        if (station->num_days > 0)
+            station->num_gaps = station->last_day - station->first_day + 1 - station->num_days;
+    }
+    board.cache_time = now;
+    pthread_mutex_unlock(&board.lock);
+}
+
+
+static int reserve(response *out, size_t length) {
+    /* room for length more bytes and a terminating NUL */
+    if (out->failed)
+        return -1;
+    if (out->capacity - out->length > length)
+        return 0;
+    size_t capacity = out->capacity ? out->capacity * 2 : 4096;
+    while (capacity - out->length <= length)
+        capacity *= 2;
+    char *data = realloc(out->data, capacity);
+    if (!data) {
+        out->failed = 1;
+        return -1;
+    }
+    out->data = data;
+    out->capacity = capacity;
+    return 0;
+}
+
+
+static void append(response *out, const char *format, ...) {
+    /* printf onto the end of the response, growing it as needed */
+    va_list args;
+
+    while (!out->failed) {
+        size_t room = out->capacity - out->length;
+
+        va_start(args, format);
+        int length = room ? vsnprintf(out->data + out->length, room, format, args) : 0;
+        va_end(args);
+        if (length < 0) {
+            out->failed = 1;
+            return;
+        }
+        if (room && (size_t)length < room) {
+            out->length += length;
+            return;
+        }
+        reserve(out, length ? length : 64);
+    }
+}
+
+
+static void append_string(response *out, const char *text) {
+    /* a JSON string, the zone names come from people's configuration files; at most 6 bytes per character */
+    if (reserve(out, 6 * strlen(text) + 2) != 0)
+        return;
+    char *end = out->data + out->length;
+
+    *end++ = '"';
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            *end++ = '\\';
+            *end++ = *c;
+        } else if (*c < 0x20) {
+            end += sprintf(end, "\\u%04x", *c);
+        } else {
+            *end++ = *c;
+        }
+    }
+    *end++ = '"';
+    *end = '\0';
+    out->length = end - out->data;
+}
+
+
+static void append_day(response *out, int32_t day) {
+    char buffer[16];
+
+    if (day < 0) {
+        append(out, "null");
+        return;
+    }
+    cimis_day_string(day, buffer, sizeof(buffer));
+    append(out, "\"%s\"", buffer);
+}
+
+
+static int selected(const status_site_entry *entry, const char *site) {
+    return site[0] == '\0' || strcmp(entry->name, site) == 0;
+}
+
+
+static void answer_status(response *out) {
+    append(out, "{\"time\":%lld,\"next_run\":%lld,\"sites\":[", (long long)time(NULL), (long long)board.next_run);
+    for (int s = 0; s < board.num_sites; s++) {
+        const status_site_entry *entry = board.sites[s];
+        int num_demand = 0, num_waiting = 0;
+        double gallons = 0.;
+
+        for (int i = 0; i < entry->num_zones; i++) {
+            if (entry->zones[i].water_demand > 0.f) {
+                num_demand++;
+                gallons += entry->zones[i].water_demand;
+            }
+        }
+        for (int c = 0; c < entry->num_commands; c++)
+            num_waiting += entry->commands[c].state == STATUS_WAITING;
+
+        append(out, "%s{\"site\":", s ? "," : "");
+        append_string(out, entry->name);
+        append(out, ",\"running\":%d,\"run_start\":%lld,\"run_end\":%lld,\"result\":%d,\"day\":",
+            entry->running, (long long)entry->run_start, (long long)entry->run_end, entry->result);
+        append_day(out, entry->day);
+        append(out, ",\"sections\":%d,\"sections_in_demand\":%d,\"demand_gallons\":%.3f,\"commands\":%d,\"waiting\":%d}",
+            entry->num_zones, num_demand, gallons, entry->num_commands, num_waiting);
+    }
+    append(out, "]}\n");
+}
+
+
+static void answer_zones(response *out, const char *site) {
+    int first = 1;
+
+    append(out, "{\"sites\":[");
+    for (int s = 0; s < board.num_sites; s++) {
+        const status_site_entry *entry = board.sites[s];
+
+        if (!selected(entry, site))
+            continue;
+        append(out, "%s{\"site\":", first ? "" : ",");
+        append_string(out, entry->name);
+        append(out, ",\"day\":");
+        append_day(out, entry->day);
+        append(out, ",\"zones\":[");
+        for (int i = 0; i < entry->num_zones; i++) {
+            const status_zone *zone = &entry->zones[i];
+
+            append(out, "%s{\"name\":", i ? "," : "");
+            append_string(out, zone->name);
+            append(out, ",\"controller\":%ld,\"relay\":%ld,\"depletion\":%.3f,\"taw\":%.3f,\"mad\":%.3f,\"demand\":%.3f,\"runtime_ms\":%.0f}",
+                zone->controller_num, zone->relay_num, zone->depletion, zone->taw, zone->mad, zone->water_demand, zone->runtime_ms);
+        }
+        append(out, "]}");
+        first = 0;
+    }
+    append(out, "]}\n");
+}
+
+
+static void answer_commands(response *out, const char *site) {
+    int first = 1;
+
+    append(out, "{\"sites\":[");
+    for (int s = 0; s < board.num_sites; s++) {
+        const status_site_entry *entry = board.sites[s];
+
+        if (!selected(entry, site))
+            continue;
+        append(out, "%s{\"site\":", first ? "" : ",");
+        append_string(out, entry->name);
+        append(out, ",\"commands\":[");
+        for (int c = 0; c < entry->num_commands; c++) {
+            const status_command_entry *command = &entry->commands[c];
+
+            append(out, "%s{\"id\":%lu,\"controller\":%ld,\"relay\":%ld,\"zone\":", c ? "," : "",
+                command->command_id, command->controller_num, command->relay_num);
+            append_string(out, command->zone);
+            append(out, ",\"start_ms\":%ld,\"duration_ms\":%ld,\"sent\":%lld,\"state\":\"%s\"",
+                command->start_ms, command->duration_ms, (long long)command->sent, state_names[command->state]);
+            if (command->state != STATUS_WAITING)
+                append(out, ",\"done\":%lld,\"latency_ms\":%ld", (long long)command->done, command->latency_ms);
+            append(out, "}");
+        }
+        append(out, "]}");
+        first = 0;
+    }
+    append(out, "]}\n");
+}
+
+
+static void answer_acks(response *out) {
+    append(out, "{\"acks\":[");
+    for (int a = 0; a < board.num_acks; a++) {
+        const status_ack *ack = &board.acks[a];
+
+        append(out, "%s{\"controller\":%ld,\"site\":", a ? "," : "", ack->controller_num);
+        append_string(out, board.sites[ack->site]->name);
+        append(out, ",\"relay\":%ld,\"id\":%lu,\"time\":%lld,\"latency_ms\":%ld}",
+            ack->relay_num, ack->command_id, (long long)ack->time, ack->latency_ms);
+    }
+    append(out, "]}\n");
+}
+
+
+static void answer_cache(response *out) {
+    append(out, "{\"updated\":%lld,\"stations\":[", (long long)board.cache_time);
+    for (int s = 0; s < board.num_stations; s++) {
+        const status_station *station = &board.stations[s];
+
+        append(out, "%s{\"station\":", s ? "," : "");
+        append_string(out, station->id);
+        append(out, ",\"first_day\":");
+        append_day(out, station->first_day);
+        append(out, ",\"last_day\":");
+        append_day(out, station->last_day);
+        append(out, ",\"days\":%d,\"gaps\":%d,\"unsaved\":%d}", station->num_days, station->num_gaps, station->dirty);
+    }
+    append(out, "]}\n");
+}
+
+
+static void answer(response *out, char *request) {
+    /* one request line: a query, optionally followed by a site name, or a control request */
+    char *site = strchr(request, ' ');
+
+    if (site)
+        *site++ = '\0';
+    else
+        site = "";
+
+    // the controls are the daemon's own signals, the main loop picks them up like a kill from the shell
+    if (strcmp(request, "reload") == 0 || strcmp(request, "stop") == 0) {
+        kill(getpid(), request[0] == 'r' ? SIGHUP : SIGTERM);
+        append(out, "{\"ok\":1}\n");
+        return;
+    }
+
+    pthread_mutex_lock(&board.lock);
+    if (strcmp(request, "status") == 0)
+        answer_status(out);
+    else if (strcmp(request, "zones") == 0)
+        answer_zones(out, site);
+    else if (strcmp(request, "commands") == 0)
+        answer_commands(out, site);
+    else if (strcmp(request, "acks") == 0)
+        answer_acks(out);
+    else if (strcmp(request, "cache") == 0)
+        answer_cache(out);
+    else
+        append(out, "{\"error\":\"unknown request, one of status, zones [site], commands [site], acks, cache, reload, stop\"}\n");
+    pthread_mutex_unlock(&board.lock);
+}
+
+
+static int write_all(int fd, const char *data, size_t length) {
+    while (length > 0) {
+        ssize_t written = send(fd, data, length, MSG_NOSIGNAL);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        data += written;
+        length -= written;
+    }
+    return 0;
+}
+
+
+static void serve_client(int fd, response *out) {
+    /* answer request lines until the client closes the connection or goes quiet for a second */
+    char request[STATUS_REQUEST_MAX];
+    size_t length = 0;
+    struct timeval timeout = {.tv_sec = 1, .tv_usec = 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    for (;;) {
+        ssize_t received = recv(fd, request + length, sizeof(request) - length, 0);
+        if (received < 0 && errno == EINTR)
+            continue;
+        if (received <= 0)
+            return;
+        length += received;
+
+        char *newline;
+        while ((newline = memchr(request, '\n', length)) != NULL) {
+            size_t line_length = newline - request;
+
+            *newline = '\0';
+            if (line_length > 0 && request[line_length - 1] == '\r')
+                request[line_length - 1] = '\0';
+            out->length = 0;
+            out->failed = 0;
+            answer(out, request);
+            if (out->failed || write_all(fd, out->data, out->length) != 0)
+                return;
+            length -= line_length + 1;
+            memmove(request, newline + 1, length);
+        }
+        if (length == sizeof(request)) {
+            const char *too_long = "{\"error\":\"request too long\"}\n";
+            write_all(fd, too_long, strlen(too_long));
+            return;
+        }
+    }
+}
+
+
+static void *serve(void *arg) {
+    /* one client at a time, a request is answered in microseconds */
+    response out = {0};
+    (void)arg;
+
+    for (;;) {
+        int fd = accept(server.fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;      // status_serve_stop shut the socket down
+        }
+        serve_client(fd, &out);
+        close(fd);
+    }
+    free(out.data);
+    return NULL;
+}
+
+
+int status_serve(const char *path) {
+    struct sockaddr_un address;
+
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "error: status socket path %s is too long\n", path);
+        return -1;
+    }
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", path);
+
+    server.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.fd < 0) {
+        fprintf(stderr, "error: cannot create the status socket\n");
+        return -1;
+    }
+    // a socket left behind by a daemon that was killed is replaced, one that still answers is not
+    if (connect(server.fd, (struct sockaddr *)&address, sizeof(address)) == 0) {
+        fprintf(stderr, "error: %s is in use by another process, no status API\n", path);
+        close(server.fd);
+        server.fd = -1;
+        return -1;
+    }
+    close(server.fd);
+    unlink(path);
+
+    server.fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server.fd < 0 || bind(server.fd, (struct sockaddr *)&address, sizeof(address)) != 0
+            || chmod(path, 0660) != 0 || listen(server.fd, 8) != 0) {
+        fprintf(stderr, "error: cannot listen on %s, no status API\n", path);
+        if (server.fd >= 0)
+            close(server.fd);
+        server.fd = -1;
+        return -1;
+    }
+    snprintf(server.path, sizeof(server.path), "%s", path);
+    if (pthread_create(&server.thread, NULL, serve, NULL) != 0) {
+        fprintf(stderr, "error: cannot start the status API thread\n");
+        close(server.fd);
+        unlink(path);
+        server.fd = -1;
+        return -1;
+    }
+    server.running = 1;
+    return 0;
+}
+
+
+void status_serve_stop(void) {
+    if (!server.running)
+        return;
+    // wakes the accept up with an error
+    shutdown(server.fd, SHUT_RDWR);
+    pthread_join(server.thread, NULL);
+    close(server.fd);
+    unlink(server.path);
+    server.fd = -1;
+    server.running = 0;
+}
+
+
+void status_free(void) {
+    pthread_mutex_lock(&board.lock);
+    for (int s = 0; s < board.num_sites; s++) {
+        free(board.sites[s]->zones);
+        free(board.sites[s]);
+    }
+    board.num_sites = 0;
+    board.num_acks = 0;
+    board.num_stations = 0;
+    pthread_mutex_unlock(&board.lock);
+}
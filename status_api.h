@@ -0,0 +1,74 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+in-memory status board of the running process and a local query API over a Unix socket. The runs copy what
+they computed onto the board as they go (every section's balance and demand, the relay commands of the run and
+their acks, the last ack of every controller, the CIMIS stores), a server thread answers each request line on
+the socket with one line of JSON formatted from the board. Nothing is read from disk and the runs are never
+waited on: the board has its own mutex, held for the copy and for the formatting.
+*/
+
+#ifndef STATUS_API_H
+#define STATUS_API_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "zone_table.h"
+#include "weather.h"
+
+#define STATUS_MAX_SITES 32
+#define STATUS_MAX_COMMANDS 256      // commands of a site's last run that are kept, as many as can wait on acks
+#define STATUS_MAX_CONTROLLERS 256
+#define STATUS_MAX_STATIONS 64
+#define STATUS_REQUEST_MAX 128       // a request line longer than this is refused
+
+// state of a relay command on the board
+enum { STATUS_WAITING = 0, STATUS_ACKED, STATUS_TIMEOUT, STATUS_CANCELLED };
+
+// the board's index of the site with this name ("" for the single site), added the first time; -1 when full
+int status_site(const char *name);
+
+// a site's run started (clears the commands of its previous run) or ended with result
+void status_run_start(int site, time_t now);
+void status_run_end(int site, time_t now, int result);
+
+// when the daemon runs next, 0 when it doesn't
+void status_next_run(time_t next);
+
+// copy every section of the zone table, its balance as of day and the demand the kernel computed from it
+int status_zones(int site, const zone_table *zones, int32_t day);
+
+// a command handed to its controller, start_ms and duration_ms into the run
+void status_command(int site, unsigned long command_id, long controller_num, long relay_num, const char *zone,
+    long start_ms, long duration_ms, time_t sent);
+// the command was acked latency_ms after it was sent, timed out or was cancelled (one of STATUS_*)
+void status_command_done(int site, unsigned long command_id, int state, long latency_ms, time_t now);
+
+// copy the CIMIS stores' coverage, the caller holds the cache's read lock
+void status_cache(const weather_station *stations, int num_stations, time_t now);
+
+// listen on the Unix socket at path and answer requests on a thread until status_serve_stop
+int status_serve(const char *path);
+void status_serve_stop(void);
+
+// free the board, after the server has stopped
+void status_free(void);
+
+#endif
@@ -0,0 +1,388 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sweep.h"
+#include "replay.h"
+#include "weather.h"
+#include "zone_table.h"
+#include "work_pool.h"
+#include "metrics.h"
+
+#define SWEEP_MAX_DEFICIT_DAYS 65535   // the per section count is a short
+
+typedef struct sweep_point {
+    double gallons;
+    long deficit_days;
+    int candidate;
+} sweep_point;
+
+typedef struct sweep_context {
+    const zone_table *base;            // the sections with the shipped coefficients
+    int num_zones;
+    int num_days;
+    const float *eto;                  // [day * base->capacity + section], padding lanes 0
+    const float *precip;
+    const sweep_candidate *candidates;
+    int num_candidates;
+
+    // per candidate and section results, [candidate * num_zones + section]
+    float *gallons;
+    uint16_t *deficit_days;
+
+    // per worker scratch
+    zone_table model[WORK_POOL_MAX_WORKERS];    // the controller, with the candidate's coefficients
+    zone_table plants[WORK_POOL_MAX_WORKERS];   // the root zones, with the shipped ones
+    sweep_point *points[WORK_POOL_MAX_WORKERS];
+
+    // per section (and one more for all of them) ranked candidates
+    sweep_point **fronts;
+    int *front_sizes;
+    int failed;
+} sweep_context;
+
+
+static int build_candidates(const sweep_options *options, sweep_candidate **out) {
+    /* the shipped coefficients first, then the grid or the random sample */
+    int steps = options->grid_steps > 0 ? options->grid_steps : SWEEP_DEFAULT_STEPS;
+    long num_candidates = options->num_samples > 0 ? options->num_samples + 1L : (long)steps * steps * steps + 1;
+
+    if (num_candidates > SWEEP_MAX_CANDIDATES) {
+        fprintf(stderr, "error: %ld candidates, the sweep takes at most %d\n", num_candidates, SWEEP_MAX_CANDIDATES);
+        return -1;
+    }
+    sweep_candidate *candidates = malloc(num_candidates * sizeof(sweep_candidate));
+    if (!candidates) {
+        fprintf(stderr, "error: unable to allocate %ld candidates\n", num_candidates);
+        return -1;
+    }
+    candidates[0].drip_efficiency = DRIP_EFFICIENCY;
+    candidates[0].effective_precip = EFFECTIVE_PRECIP_FRACTION;
+    candidates[0].pf_scale = 1.f;
+
+    if (options->num_samples > 0) {
+        unsigned int seed = options->seed;
+        for (long c = 1; c < num_candidates; c++) {
+            candidates[c].drip_efficiency = SWEEP_EFFICIENCY_MIN + (SWEEP_EFFICIENCY_MAX - SWEEP_EFFICIENCY_MIN) * rand_r(&seed) / (float)RAND_MAX;
+            candidates[c].effective_precip = SWEEP_PRECIP_MIN + (SWEEP_PRECIP_MAX - SWEEP_PRECIP_MIN) * rand_r(&seed) / (float)RAND_MAX;
+            candidates[c].pf_scale = SWEEP_PF_SCALE_MIN + (SWEEP_PF_SCALE_MAX - SWEEP_PF_SCALE_MIN) * rand_r(&seed) / (float)RAND_MAX;
+        }
+    } else {
+        // with one step a coefficient stays at its shipped value
+        long c = 1;
+        for (int e = 0; e < steps; e++) {
+            for (int p = 0; p < steps; p++) {
+                for (int f = 0; f < steps; f++, c++) {
+                    candidates[c].drip_efficiency = steps > 1 ? SWEEP_EFFICIENCY_MIN + (SWEEP_EFFICIENCY_MAX - SWEEP_EFFICIENCY_MIN) * e / (steps - 1) : DRIP_EFFICIENCY;
+                    candidates[c].effective_precip = steps > 1 ? SWEEP_PRECIP_MIN + (SWEEP_PRECIP_MAX - SWEEP_PRECIP_MIN) * p / (steps - 1) : EFFECTIVE_PRECIP_FRACTION;
+                    candidates[c].pf_scale = steps > 1 ? SWEEP_PF_SCALE_MIN + (SWEEP_PF_SCALE_MAX - SWEEP_PF_SCALE_MIN) * f / (steps - 1) : 1.f;
+                }
+            }
+        }
+    }
+    *out = candidates;
+    return (int)num_candidates;
+}
+
+
+static void evaluate_candidate(void *arg, int worker, int c) {
+    /* one season with the candidate's coefficients deciding the waterings, the same kernels as a real run */
+    sweep_context *ctx = (sweep_context *)arg;
+    const zone_table *base = ctx->base;
+    const sweep_candidate *candidate = &ctx->candidates[c];
+    zone_table *model = &ctx->model[worker];
+    zone_table *plants = &ctx->plants[worker];
+    float *gallons = ctx->gallons + (size_t)c * ctx->num_zones;
+    uint16_t *deficit_days = ctx->deficit_days + (size_t)c * ctx->num_zones;
+    size_t column = base->capacity * sizeof(float);
+
+    memcpy(plants->PF, base->PF, column);
+    for (int i = 0; i < base->capacity; i++)
+        model->PF[i] = base->PF[i] * candidate->pf_scale;
+    memcpy(model->LA, base->LA, column);
+    memcpy(plants->LA, base->LA, column);
+    memcpy(model->taw, base->taw, column);
+    memcpy(plants->taw, base->taw, column);
+    memcpy(model->mad, base->mad, column);
+    memcpy(plants->mad, base->mad, column);
+    memcpy(model->flow_gph, base->flow_gph, column);
+    memcpy(plants->flow_gph, base->flow_gph, column);
+    // the season starts at field capacity
+    memset(model->depletion, 0, column);
+    memset(plants->depletion, 0, column);
+    model->drip_efficiency = candidate->drip_efficiency;
+    model->effective_precip = candidate->effective_precip;
+
+    for (int i = 0; i < ctx->num_zones; i++) {
+        gallons[i] = 0.f;
+        deficit_days[i] = 0;
+    }
+
+    for (int d = 0; d < ctx->num_days; d++) {
+        const float *eto = ctx->eto + (size_t)d * base->capacity;
+        const float *precip = ctx->precip + (size_t)d * base->capacity;
+
+        memcpy(model->eto, eto, column);
+        memcpy(plants->eto, eto, column);
+        memcpy(model->precip, precip, column);
+        memcpy(plants->precip, precip, column);
+        zone_balance_kernel(model);
+        zone_balance_kernel(plants);
+        zone_demand_kernel(model);
+
+        for (int i = 0; i < ctx->num_zones; i++) {
+            if (model->water_demand[i] > 0.f && base->relay_num[i] > 0 && base->controller_num[i] > 0) {
+                // the runtime the controller would be sent, credited to both as water_balance_irrigate does
+                long duration_ms = (long)model->runtime_ms[i];
+                float delivered = duration_ms * model->flow_gph[i] / 3600000.;
+                float depletion = model->depletion[i] - delivered * model->drip_efficiency;
+                model->depletion[i] = depletion > 0.f ? depletion : 0.f;
+                depletion = plants->depletion[i] - delivered * plants->drip_efficiency;
+                plants->depletion[i] = depletion > 0.f ? depletion : 0.f;
+                gallons[i] += delivered;
+            }
+            if (plants->depletion[i] > 0.f && plants->depletion[i] >= plants->mad[i] * plants->taw[i]
+                    && deficit_days[i] < SWEEP_MAX_DEFICIT_DAYS)
+                deficit_days[i]++;
+        }
+    }
+}
+
+
+static int compare_points(const void *a, const void *b) {
+    const sweep_point *left = (const sweep_point *)a, *right = (const sweep_point *)b;
+
+    if (left->gallons != right->gallons)
+        return left->gallons < right->gallons ? -1 : 1;
+    if (left->deficit_days != right->deficit_days)
+        return left->deficit_days < right->deficit_days ? -1 : 1;
+    return left->candidate - right->candidate;
+}
+
+
+static int pareto_front(sweep_point *points, int num_points) {
+    /* keep the points no other point beats on both water and deficit days, from the least water up; returns how many */
+    int num_front = 0;
+    long fewest_deficit = -1;
+
+    qsort(points, num_points, sizeof(sweep_point), compare_points);
+    for (int p = 0; p < num_points; p++) {
+        // anything after a point uses at least as much water, it has to have fewer deficit days to stay
+        if (fewest_deficit >= 0 && points[p].deficit_days >= fewest_deficit)
+            continue;
+        fewest_deficit = points[p].deficit_days;
+        points[num_front++] = points[p];
+    }
+    return num_front;
+}
+
+
+static void rank_section(void *arg, int worker, int i) {
+    /* the front of one section, i == num_zones is all the sections together */
+    sweep_context *ctx = (sweep_context *)arg;
+    sweep_point *points = ctx->points[worker];
+
+    for (int c = 0; c < ctx->num_candidates; c++) {
+        points[c].candidate = c;
+        if (i < ctx->num_zones) {
+            points[c].gallons = ctx->gallons[(size_t)c * ctx->num_zones + i];
+            points[c].deficit_days = ctx->deficit_days[(size_t)c * ctx->num_zones + i];
+            continue;
+        }
+        points[c].gallons = 0.;
+        points[c].deficit_days = 0;
+        for (int z = 0; z < ctx->num_zones; z++) {
+            points[c].gallons += ctx->gallons[(size_t)c * ctx->num_zones + z];
+            points[c].deficit_days += ctx->deficit_days[(size_t)c * ctx->num_zones + z];
+        }
+    }
+
+    int num_front = pareto_front(points, ctx->num_candidates);
+    ctx->fronts[i] = malloc(num_front * sizeof(sweep_point) + 1);
+    if (!ctx->fronts[i]) {
+        ctx->failed = 1;
+        return;
+    }
+    memcpy(ctx->fronts[i], points, num_front * sizeof(sweep_point));
+    ctx->front_sizes[i] = num_front;
+}
+
+
+static void write_front(FILE *out, const char *section, const sweep_point *front, int num_front, const sweep_candidate *candidates) {
+    for (int r = 0; r < num_front; r++) {
+        const sweep_candidate *candidate = &candidates[front[r].candidate];
+        replay_write_csv_string(out, section);
+        fprintf(out, ",%d,%.3f,%.3f,%.3f,%.1f,%ld\n", r + 1, candidate->drip_efficiency, candidate->effective_precip,
+            candidate->pf_scale, front[r].gallons, front[r].deficit_days);
+    }
+}
+
+
+int sweep_run(const zone_config *config, const sweep_options *options) {
+    weather_station stations[MAX_STATIONS];
+    int num_stations = zone_config_stations(config, stations);
+    int num_sections = config->num_zones;
+    int num_workers = options->num_workers > 0 ? options->num_workers : work_pool_default_workers();
+    int64_t start_ns = metrics_now_ns();
+    sweep_candidate *candidates = NULL;
+    sweep_context ctx;
+    zone_table base;
+    char tmp_path[128];
+    int status = -1;
+
+    memset(&ctx, 0, sizeof(ctx));
+    memset(&base, 0, sizeof(base));
+    if (num_workers > WORK_POOL_MAX_WORKERS)
+        num_workers = WORK_POOL_MAX_WORKERS;
+
+    int num_records = replay_load_weather(options->weather_path, stations, num_stations);
+    if (num_records <= 0) {
+        if (num_records == 0)
+            fprintf(stderr, "error: %s has no weather for the stations of the zone configuration\n", options->weather_path);
+        replay_close_weather(stations, num_stations);
+        return -1;
+    }
+    int32_t first_day = options->first_day, last_day = options->last_day;
+    if (replay_weather_days(stations, num_stations, &first_day, &last_day) != 0) {
+        replay_close_weather(stations, num_stations);
+        return -1;
+    }
+
+    int num_candidates = build_candidates(options, &candidates);
+    if (num_candidates < 0) {
+        replay_close_weather(stations, num_stations);
+        return -1;
+    }
+
+    // every section's daily weather is the same for all the candidates, weighted once up front
+    zone_weather *weather = malloc(num_sections * sizeof(zone_weather) + 1);
+    if (zone_table_init(&base, num_sections) != 0 || !weather)
+        goto done;
+    zone_config_fill(config, stations, &base, weather);
+
+    int num_days = last_day - first_day + 1;
+    float *eto = calloc((size_t)num_days * base.capacity, sizeof(float));
+    float *precip = calloc((size_t)num_days * base.capacity, sizeof(float));
+    ctx.eto = eto;
+    ctx.precip = precip;
+    ctx.gallons = malloc((size_t)num_candidates * num_sections * sizeof(float) + 1);
+    ctx.deficit_days = malloc((size_t)num_candidates * num_sections * sizeof(uint16_t) + 1);
+    ctx.fronts = calloc(num_sections + 1, sizeof(sweep_point *));
+    ctx.front_sizes = calloc(num_sections + 1, sizeof(int));
+    if (!eto || !precip || !ctx.gallons || !ctx.deficit_days || !ctx.fronts || !ctx.front_sizes) {
+        fprintf(stderr, "error: unable to allocate the sweep of %d candidates over %d sections and %d days\n",
+            num_candidates, num_sections, num_days);
+        goto done;
+    }
+    for (int d = 0; d < num_days; d++) {
+        for (int i = 0; i < num_sections; i++) {
+            cimis_results day_weather = zone_weather_day(&weather[i], stations, first_day + d);
+            if (day_weather.parse_errors > 0)
+                continue;
+            eto[(size_t)d * base.capacity + i] = day_weather.Et0;
+            precip[(size_t)d * base.capacity + i] = day_weather.precip;
+        }
+    }
+
+    ctx.base = &base;
+    ctx.num_zones = num_sections;
+    ctx.num_days = num_days;
+    ctx.candidates = candidates;
+    ctx.num_candidates = num_candidates;
+    for (int w = 0; w < num_workers; w++) {
+        ctx.points[w] = malloc(num_candidates * sizeof(sweep_point));
+        if (zone_table_init(&ctx.model[w], num_sections) != 0 || zone_table_init(&ctx.plants[w], num_sections) != 0 || !ctx.points[w]) {
+            fprintf(stderr, "error: unable to allocate the scratch of %d sweep workers\n", num_workers);
+            goto done;
+        }
+    }
+
+    int num_ran = work_pool_run(num_workers, num_candidates, evaluate_candidate, &ctx);
+    double evaluate_s = (metrics_now_ns() - start_ns) / 1e9;
+    work_pool_run(num_workers, num_sections + 1, rank_section, &ctx);
+    if (ctx.failed) {
+        fprintf(stderr, "error: unable to allocate the ranked candidates\n");
+        goto done;
+    }
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", options->output_path);
+    FILE *out = fopen(tmp_path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "error: cannot write %s\n", tmp_path);
+        goto done;
+    }
+    fprintf(out, "section,rank,drip_efficiency,effective_precip,pf_scale,gallons,deficit_days\n");
+    write_front(out, "(all sections)", ctx.fronts[num_sections], ctx.front_sizes[num_sections], candidates);
+    for (int i = 0; i < num_sections; i++)
+        write_front(out, base.name[i], ctx.fronts[i], ctx.front_sizes[i], candidates);
+    if (fclose(out) != 0 || rename(tmp_path, options->output_path) != 0) {
+        fprintf(stderr, "error: cannot replace %s\n", options->output_path);
+        remove(tmp_path);
+        goto done;
+    }
+
+    // the shipped coefficients next to the candidates that beat them on one count or both
+    double shipped_gallons = 0.;
+    long shipped_deficit = 0;
+    for (int i = 0; i < num_sections; i++) {
+        shipped_gallons += ctx.gallons[i];
+        shipped_deficit += ctx.deficit_days[i];
+    }
+    char first_buffer[16], last_buffer[16];
+    cimis_day_string(first_day, first_buffer, sizeof(first_buffer));
+    cimis_day_string(last_day, last_buffer, sizeof(last_buffer));
+    printf("---------------------------------------------------------------------\n");
+    printf("  Efficiency  |  Rain  |  PF scale  |   Gallons   |  Deficit days\n");
+    printf("---------------------------------------------------------------------\n");
+    printf("   %.3f   |   %.3f   |   %.3f   |   %.1f   |   %ld   (shipped)\n", DRIP_EFFICIENCY, EFFECTIVE_PRECIP_FRACTION, 1.f,
+        shipped_gallons, shipped_deficit);
+    const sweep_point *front = ctx.fronts[num_sections];
+    for (int r = 0; r < ctx.front_sizes[num_sections]; r++) {
+        const sweep_candidate *candidate = &candidates[front[r].candidate];
+        printf("   %.3f   |   %.3f   |   %.3f   |   %.1f   |   %ld\n", candidate->drip_efficiency, candidate->effective_precip,
+            candidate->pf_scale, front[r].gallons, front[r].deficit_days);
+    }
+    printf("---------------------------------------------------------------------\n");
+    printf("Swept %d candidates over %s to %s (%d days) and %d sections on %d threads in %.3f sec (%.3f sec in total)\n",
+        num_candidates, first_buffer, last_buffer, num_days, num_sections, num_ran, evaluate_s, (metrics_now_ns() - start_ns) / 1e9);
+    printf("Ranked candidates of every section written to %s\n", options->output_path);
+    status = 0;
+
+done:
+    for (int w = 0; w < WORK_POOL_MAX_WORKERS; w++) {
+        zone_table_free(&ctx.model[w]);
+        zone_table_free(&ctx.plants[w]);
+        free(ctx.points[w]);
+    }
+    for (int i = 0; ctx.fronts && i <= num_sections; i++)
+        free(ctx.fronts[i]);
+    free(ctx.fronts);
+    free(ctx.front_sizes);
+    free(ctx.deficit_days);
+    free(ctx.gallons);
+    free((void *)ctx.precip);
+    free((void *)ctx.eto);
+    free(weather);
+    zone_table_free(&base);
+    free(candidates);
+    replay_close_weather(stations, num_stations);
+    return status;
+}
@@ -0,0 +1,70 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+what-if sweep of the model coefficients over a season of saved CIMIS data (the same weather as --replay).
+Every candidate sets the drip efficiency, the effective share of the rain and a scale on every section's
+PF, from a grid or a random sample, and is evaluated on its own thread of a work stealing pool.
+There is no measured soil moisture to score a candidate against, so the plants are taken to follow the
+shipped model (DRIP_EFFICIENCY, EFFECTIVE_PRECIP_FRACTION and the configured PF): the candidate only
+decides when and how long each section is watered, and a deficit day is a day the plants' root zone is
+still past its allowed depletion after the morning run. The result is, for all sections together and for
+each section, the candidates no other candidate beats on both water used and deficit days, ranked from
+the least water to the most. Days missing from the data add no ETo or rain (a live run would wait for them).
+*/
+
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include <stdint.h>
+
+#include "zone_config.h"
+
+// ranges of the swept coefficients
+#define SWEEP_EFFICIENCY_MIN 0.5f
+#define SWEEP_EFFICIENCY_MAX 0.95f
+#define SWEEP_PRECIP_MIN 0.f
+#define SWEEP_PRECIP_MAX 1.f
+#define SWEEP_PF_SCALE_MIN 0.5f
+#define SWEEP_PF_SCALE_MAX 1.5f
+
+#define SWEEP_DEFAULT_STEPS 10        // grid points per coefficient, 1000 candidates
+#define SWEEP_MAX_CANDIDATES 100000   // the results are a float and a short per candidate and section
+
+typedef struct sweep_candidate {
+    float drip_efficiency;
+    float effective_precip;
+    float pf_scale;          // multiplies every section's PF
+} sweep_candidate;
+
+typedef struct sweep_options {
+    const char *weather_path;   // directory of cimis_*.json files or a single CIMIS response, as for --replay
+    const char *output_path;    // CSV of the ranked candidates
+    int32_t first_day;          // -1 for the first day in the data
+    int32_t last_day;           // -1 for the last day in the data
+    int grid_steps;             // points per coefficient when num_samples is 0
+    int num_samples;            // random candidates instead of the grid
+    unsigned int seed;
+    int num_workers;            // 0 for every core
+} sweep_options;
+
+// evaluate every candidate (the shipped coefficients are always the first) over the sections of config, write the
+// ranked candidates to options->output_path and the ones of all sections together to stdout; 0 on success, -1 on an error
+int sweep_run(const zone_config *config, const sweep_options *options);
+
+#endif
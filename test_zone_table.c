@@ -0,0 +1,104 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// zone table kernels at 100k+ sections against the scalar SLIDE formulas, padding lanes included
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "zone_table.h"
+
+#define TEST_ZONES 100003      // not a whole number of SIMD batches, the last batch has padding lanes
+#define MS_PER_HOUR 3600000.f
+
+
+static int close_enough(float got, float expected) {
+    return fabsf(got - expected) <= 1e-4f * fmaxf(1.f, fabsf(expected));
+}
+
+
+int main(void) {
+    zone_table table;
+    int failures = 0;
+
+    if (zone_table_init(&table, TEST_ZONES) != 0)
+        return 1;
+    if (table.capacity % ZONE_LANES != 0 || table.capacity < TEST_ZONES) {
+        fprintf(stderr, "error: capacity %d for %d sections\n", table.capacity, TEST_ZONES);
+        return 1;
+    }
+
+    // a spread of sections: dry and wet days, some past their MAD, some without emitters
+    srand(1);
+    for (int i = 0; i < TEST_ZONES; i++) {
+        table.eto[i] = (rand() % 40) / 100.f;
+        table.precip[i] = (i % 7 == 0) ? (rand() % 200) / 100.f : 0.f;
+        table.PF[i] = 0.2f + (rand() % 7) / 10.f;
+        table.LA[i] = 10.f + rand() % 500;
+        table.taw[i] = 5.f + rand() % 200;
+        table.mad[i] = 0.3f + (rand() % 4) / 10.f;
+        table.flow_gph[i] = (i % 13 == 0) ? 0.f : 0.5f + rand() % 20;
+        table.depletion[i] = table.taw[i] * (rand() % 100) / 100.f;
+    }
+
+    float *before = malloc(TEST_ZONES * sizeof(float));
+    if (!before)
+        return 1;
+    for (int i = 0; i < TEST_ZONES; i++)
+        before[i] = table.depletion[i];
+
+    zone_balance_kernel(&table);
+    zone_demand_kernel(&table);
+
+    for (int i = 0; i < TEST_ZONES; i++) {
+        float depletion = before[i] + (table.eto[i] * table.PF[i] - table.precip[i] * table.effective_precip)
+            * table.LA[i] * INCHES_TO_GALLONS_PER_FT2;
+        depletion = depletion > 0.f ? depletion : 0.f;
+        depletion = depletion < table.taw[i] ? depletion : table.taw[i];
+
+        int due = depletion > 0.f && depletion >= table.mad[i] * table.taw[i];
+        float demand = due ? depletion : 0.f;
+        float runtime = table.flow_gph[i] > 0.f ? demand * (MS_PER_HOUR / table.drip_efficiency) / table.flow_gph[i] : 0.f;
+
+        if (!close_enough(table.depletion[i], depletion) || !close_enough(table.water_demand[i], demand)
+                || !close_enough(table.runtime_ms[i], runtime)) {
+            if (failures++ < 10)
+                fprintf(stderr, "error: section %d depletion %f demand %f runtime %f, expected %f %f %f\n", i,
+                    table.depletion[i], table.water_demand[i], table.runtime_ms[i], depletion, demand, runtime);
+        }
+    }
+
+    // the padding lanes are computed with the rest and have to stay at 0
+    for (int i = TEST_ZONES; i < table.capacity; i++) {
+        if (table.depletion[i] != 0.f || table.water_demand[i] != 0.f || table.runtime_ms[i] != 0.f) {
+            fprintf(stderr, "error: padding lane %d depletion %f demand %f runtime %f\n", i,
+                table.depletion[i], table.water_demand[i], table.runtime_ms[i]);
+            failures++;
+        }
+    }
+
+    free(before);
+    zone_table_free(&table);
+    if (failures > 0) {
+        fprintf(stderr, "error: %d of %d sections differ from the scalar formulas\n", failures, TEST_ZONES);
+        return 1;
+    }
+    printf("%d sections match the scalar formulas\n", TEST_ZONES);
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "water_balance.h"
+
+static const char balance_magic[4] = {'I', 'R', 'W', 'B'};
+
+// on-disk layout (native byte order, the file is local)
+typedef struct balance_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t seq;
+    int32_t num_zones;
+    int32_t reserved;
+} balance_header;
+
+typedef struct balance_record {
+    char zone[ZONE_NAME_LEN];
+    float depletion;
+    int32_t last_day;
+} balance_record;
+
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(((const zone_name *)a)->name, ((const zone_name *)b)->name);
+}
+
+
+int water_balance_find(const water_balance *balance, const char *zone) {
+    /* binary search of the sorted name index */
+    int low = 0, high = balance->num_zones - 1;
+
+    while (low <= high) {
+        int mid = (low + high) / 2;
+        int order = strcmp(balance->by_name[mid].name, zone);
+        if (order == 0)
+            return balance->by_name[mid].index;
+        if (order < 0)
+            low = mid + 1;
+        else
+            high = mid - 1;
+    }
+    return -1;
+}
+
+
+int water_balance_init(water_balance *balance, const char *path, zone_table *table, const log_streams *log) {
+    /* an empty balance over the sections in table, nothing is read */
+    memset(balance, 0, sizeof(water_balance));
+    balance->log = log;
+    snprintf(balance->path, sizeof(balance->path), "%s", path);
+    balance->table = table;
+    balance->num_zones = table->num_zones;
+
+    balance->by_name = malloc(table->num_zones * sizeof(zone_name) + 1);
+    if (!balance->by_name) {
+        fprintf(LOG_ERR(log), "error: unable to allocate the water balance of %d sections\n", table->num_zones);
+        return -1;
+    }
+    for (int i = 0; i < table->num_zones; i++) {
+        balance->by_name[i].name = table->name[i];
+        balance->by_name[i].index = i;
+    }
+    qsort(balance->by_name, table->num_zones, sizeof(zone_name), compare_names);
+    return 0;
+}
+
+
+int water_balance_load(water_balance *balance, const char *path, zone_table *table, const log_streams *log) {
+    balance_header header;
+    balance_record record;
+    int restored = 0;
+
+    if (water_balance_init(balance, path, table, log) != 0)
+        return -1;
+
+    FILE *balance_file = fopen(path, "rb");
+    if (balance_file == NULL) {
+        // first run with a water balance, every section starts where the caller put it
+        return 1;
+    }
+
+    if (fread(&header, sizeof(header), 1, balance_file) != 1 || memcmp(header.magic, balance_magic, 4) != 0
+            || header.version != WATER_BALANCE_VERSION || header.record_size != sizeof(balance_record) || header.num_zones < 0) {
+        fprintf(LOG_ERR(log), "error: %s is not a version %d water balance, starting a new one\n", path, WATER_BALANCE_VERSION);
+        fclose(balance_file);
+        return 1;
+    }
+
+    for (int32_t r = 0; r < header.num_zones; r++) {
+        if (fread(&record, sizeof(record), 1, balance_file) != 1) {
+            fprintf(LOG_ERR(log), "error: %s is truncated, the remaining sections start a new balance\n", path);
+            fclose(balance_file);
+            return 1;
+        }
+        record.zone[ZONE_NAME_LEN - 1] = '\0';
+
+        // sections removed from the configuration are dropped on the next save
+        int i = water_balance_find(balance, record.zone);
+        if (i < 0)
+            continue;
+        table->depletion[i] = record.depletion < table->taw[i] ? record.depletion : table->taw[i];
+        table->last_day[i] = record.last_day;
+        restored++;
+    }
+    fclose(balance_file);
+
+    balance->seq = header.seq;
+    fprintf(LOG_OUT(log), "Water balance of %d sections restored from %s\n", restored, path);
+    return 0;
+}
+
+
+int water_balance_save(water_balance *balance) {
+    /* write to a temporary file and rename it over the balance so a crash never leaves half a file */
+    const zone_table *table = balance->table;
+    const log_streams *log = balance->log;
+    balance_header header;
+    balance_record record;
+    char tmp_path[80];
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, balance_magic, 4);
+    header.version = WATER_BALANCE_VERSION;
+    header.record_size = sizeof(balance_record);
+    header.seq = balance->seq;
+    header.num_zones = balance->num_zones;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", balance->path);
+    FILE *balance_file = fopen(tmp_path, "wb");
+    if (balance_file == NULL) {
+        fprintf(LOG_ERR(log), "error: cannot write %s\n", tmp_path);
+        return -1;
+    }
+    int status = fwrite(&header, sizeof(header), 1, balance_file) == 1 ? 0 : -1;
+    for (int i = 0; i < balance->num_zones && status == 0; i++) {
+        memset(&record, 0, sizeof(record));
+        snprintf(record.zone, ZONE_NAME_LEN, "%s", table->name[i]);
+        record.depletion = table->depletion[i];
+        record.last_day = table->last_day[i];
+        if (fwrite(&record, sizeof(record), 1, balance_file) != 1)
+            status = -1;
+    }
+    if (status != 0) {
+        fprintf(LOG_ERR(log), "error: cannot write %s\n", tmp_path);
+        fclose(balance_file);
+        remove(tmp_path);
+        return -1;
+    }
+    if (fclose(balance_file) != 0 || rename(tmp_path, balance->path) != 0) {
+        fprintf(LOG_ERR(log), "error: cannot replace %s\n", balance->path);
+        remove(tmp_path);
+        return -1;
+    }
+    return 0;
+}
+
+
+void water_balance_free(water_balance *balance) {
+    free(balance->by_name);
+    balance->by_name = NULL;
+    balance->num_zones = 0;
+}
+
+
+int water_balance_irrigate(void *ctx, const watering_event *event) {
+    water_balance *balance = (water_balance *)ctx;
+    zone_table *table = balance->table;
+
+    int i = water_balance_find(balance, event->zone);
+    if (i >= 0) {
+        // the emitters deliver gallons, the roots get drip_efficiency of it, the rest is lost
+        float depletion = table->depletion[i] - event->gallons * table->drip_efficiency;
+        table->depletion[i] = depletion > 0.f ? depletion : 0.f;
+    }
+    if (event->seq > balance->seq)
+        balance->seq = event->seq;
+    return 0;
+}
+
+
+int water_balance_advance(water_balance *balance, const zone_weather *weather, const weather_station *stations, int32_t through_day,
+        int wait_days) {
+    /* one balance kernel pass per day over every section, the sections that already have the day (or are waiting
+    on it) get no ETo or rain and stay unchanged */
+    zone_table *table = balance->table;
+    const log_streams *log = balance->log;
+    int32_t oldest = through_day - BALANCE_MAX_CATCHUP_DAYS;
+    int32_t first_day = through_day + 1;
+    int num_days = 0, num_skipped = 0;
+
+    for (int i = 0; i < table->num_zones; i++) {
+        if (table->last_day[i] < oldest) {
+            table->last_day[i] = oldest;
+            num_skipped++;
+        }
+        if (table->last_day[i] + 1 < first_day)
+            first_day = table->last_day[i] + 1;
+    }
+    if (num_skipped > 0)
+        fprintf(LOG_OUT(log), "%d sections were more than %d days behind, the days before that are skipped\n", num_skipped, BALANCE_MAX_CATCHUP_DAYS);
+
+    for (int32_t day = first_day; day <= through_day; day++) {
+        int num_waiting = 0;
+
+        for (int i = 0; i < table->num_zones; i++) {
+            table->eto[i] = 0.f;
+            table->precip[i] = 0.f;
+            if (table->last_day[i] != day - 1)
+                continue;
+
+            cimis_results day_weather = zone_weather_day(&weather[i], stations, day);
+            if (day_weather.parse_errors > 0) {
+                if (day > through_day - wait_days) {
+                    // CIMIS may still report it, the section waits for the day
+                    num_waiting++;
+                    continue;
+                }
+                // too old to arrive any more, the day adds nothing
+                table->last_day[i] = day;
+                continue;
+            }
+            table->eto[i] = day_weather.Et0;
+            table->precip[i] = day_weather.precip;
+            table->last_day[i] = day;
+        }
+
+        zone_balance_kernel(table);
+        num_days++;
+        if (num_waiting > 0) {
+            char day_buffer[16];
+            cimis_day_string(day, day_buffer, sizeof(day_buffer));
+            fprintf(LOG_ERR(log), "error: no CIMIS data for %s yet, %d sections wait for it\n", day_buffer, num_waiting);
+        }
+    }
+    return num_days;
+}
@@ -0,0 +1,75 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+root zone water balance of every garden section (checkbook method of the BMP scheduling reference):
+the depletion grows with each day's crop water use (ETo * PF) and shrinks with effective rain and the
+water delivered by confirmed waterings, a section is watered back to field capacity once its depletion
+reaches its allowed fraction (MAD) of the total available water. The depletion and the last day applied
+are saved per section in irrigation_balance.dat, so each run only adds the new days of weather.
+*/
+
+#ifndef WATER_BALANCE_H
+#define WATER_BALANCE_H
+
+#include <stdint.h>
+
+#include "zone_table.h"
+#include "weather.h"
+#include "watering_journal.h"
+
+#define WATER_BALANCE_VERSION 1
+
+#ifndef BALANCE_MAX_CATCHUP_DAYS
+#define BALANCE_MAX_CATCHUP_DAYS 30   // older gaps (e.g. the controller was off for the winter) are skipped
+#endif
+
+typedef struct zone_name {
+    const char *name;
+    int32_t index;
+} zone_name;
+
+typedef struct water_balance {
+    char path[64];
+    uint64_t seq;            // last watering journal record included in the depletions
+    zone_table *table;       // depletion and last_day columns are the balance
+    zone_name *by_name;      // sections sorted by name
+    int num_zones;
+    const log_streams *log;  // where its messages go
+} water_balance;
+
+// the name index of the sections in table, their depletion and last_day are left as they are; -1 if out of memory
+int water_balance_init(water_balance *balance, const char *path, zone_table *table, const log_streams *log);
+// restore the saved depletion and last day of the sections in table (matched by name), the other sections keep the
+// depletion and last_day they come with; returns 1 if there is no usable saved balance, -1 if out of memory
+int water_balance_load(water_balance *balance, const char *path, zone_table *table, const log_streams *log);
+int water_balance_save(water_balance *balance);
+void water_balance_free(water_balance *balance);
+
+// index of the section in the table, -1 if it isn't there
+int water_balance_find(const water_balance *balance, const char *zone);
+
+// credit a confirmed watering (watering_callback for watering_journal_replay, ctx is the balance)
+int water_balance_irrigate(void *ctx, const watering_event *event);
+
+// add every day of weather up to through_day to each section; sections wait for a day among the last wait_days
+// that CIMIS hasn't reported yet (CIMIS_REFETCH_DAYS live, 0 on historical data where a missing day never comes),
+// older days without data are skipped; returns the number of days advanced
+int water_balance_advance(water_balance *balance, const zone_weather *weather, const weather_station *stations, int32_t through_day,
+    int wait_days);
+
+#endif
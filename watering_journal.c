@@ -0,0 +1,453 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "watering_journal.h"
+
+static const char record_magic[4] = {'I', 'R', 'J', '1'};
+static const char snapshot_magic[4] = {'I', 'R', 'S', 'N'};
+
+// on-disk layouts (native byte order, the files are local)
+typedef struct journal_record {
+    char magic[4];
+    uint32_t crc;              // CRC32 of everything after this field
+    uint64_t seq;
+    int64_t time;
+    int32_t day;
+    float gallons;
+    int32_t controller_num;
+    int32_t relay_num;
+    int32_t duration_ms;
+    int32_t reserved;
+    char zone[ZONE_NAME_LEN];
+} journal_record;
+
+typedef struct snapshot_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t record_size;
+    uint64_t seq;              // last journal record included
+    int32_t num_zones;
+    uint32_t crc;              // CRC32 of the zone records
+} snapshot_header;
+
+#define RECORD_CRC_OFFSET (offsetof(journal_record, crc) + sizeof(uint32_t))
+
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+
+static void build_crc_table(void) {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+
+static uint32_t crc32(uint32_t crc, const void *data, size_t size) {
+    /* CRC-32 (IEEE, reflected), the table is built once, the sites' journals append from several threads */
+    const uint8_t *bytes = (const uint8_t *)data;
+
+    pthread_once(&crc_table_once, build_crc_table);
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+
+static uint64_t hash_name(const char *name) {
+    /* FNV-1a */
+    uint64_t hash = 14695981039346656037ULL;
+    for (; *name; name++) {
+        hash ^= (uint8_t)*name;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+
+static int find_slot(const watering_journal *journal, const char *zone) {
+    /* slot holding zone, or the empty slot where it belongs */
+    int slot = (int)(hash_name(zone) & (journal->num_slots - 1));
+
+    while (journal->slots[slot] >= 0 && strcmp(journal->zones[journal->slots[slot]].zone, zone) != 0)
+        slot = (slot + 1) & (journal->num_slots - 1);
+    return slot;
+}
+
+
+static int rehash(watering_journal *journal, int num_slots) {
+    int32_t *slots = malloc(num_slots * sizeof(int32_t));
+    if (!slots)
+        return -1;
+    free(journal->slots);
+    journal->slots = slots;
+    journal->num_slots = num_slots;
+    memset(journal->slots, 0xff, num_slots * sizeof(int32_t));
+
+    for (int z = 0; z < journal->num_zones; z++)
+        journal->slots[find_slot(journal, journal->zones[z].zone)] = z;
+    return 0;
+}
+
+
+static zone_watering *zone_state(watering_journal *journal, const char *zone) {
+    /* the section's state, added (never watered) if it is new */
+    int slot = find_slot(journal, zone);
+    if (journal->slots[slot] >= 0)
+        return &journal->zones[journal->slots[slot]];
+
+    if (journal->num_zones == journal->capacity) {
+        int capacity = journal->capacity ? journal->capacity * 2 : 64;
+        zone_watering *zones = realloc(journal->zones, capacity * sizeof(zone_watering));
+        if (!zones)
+            return NULL;
+        journal->zones = zones;
+        journal->capacity = capacity;
+    }
+    // keep the hash at most half full
+    if (2 * (journal->num_zones + 1) > journal->num_slots) {
+        if (rehash(journal, journal->num_slots * 2) != 0)
+            return NULL;
+        slot = find_slot(journal, zone);
+    }
+
+    zone_watering *state = &journal->zones[journal->num_zones];
+    memset(state, 0, sizeof(zone_watering));
+    snprintf(state->zone, ZONE_NAME_LEN, "%s", zone);
+    state->last_day = -1;
+    journal->slots[slot] = journal->num_zones++;
+    return state;
+}
+
+
+static int apply_record(watering_journal *journal, const journal_record *record) {
+    zone_watering *state = zone_state(journal, record->zone);
+    if (!state)
+        return -1;
+
+    if (record->time >= state->last_time) {
+        state->last_time = record->time;
+        state->last_day = record->day;
+        state->last_gallons = record->gallons;
+    }
+    state->total_gallons += record->gallons;
+    state->num_waterings++;
+    return 0;
+}
+
+
+static int load_snapshot(watering_journal *journal) {
+    const log_streams *log = journal->log;
+    snapshot_header header;
+
+    FILE *snapshot_file = fopen(journal->snapshot_path, "rb");
+    if (snapshot_file == NULL) {
+        // never compacted yet
+        return 0;
+    }
+
+    if (fread(&header, sizeof(header), 1, snapshot_file) != 1 || memcmp(header.magic, snapshot_magic, 4) != 0
+            || header.version != WATERING_JOURNAL_VERSION || header.record_size != sizeof(zone_watering) || header.num_zones < 0) {
+        fprintf(LOG_ERR(log), "error: %s is not a version %d watering snapshot\n", journal->snapshot_path, WATERING_JOURNAL_VERSION);
+        fclose(snapshot_file);
+        return -1;
+    }
+
+    zone_watering *zones = malloc(header.num_zones * sizeof(zone_watering) + 1);
+    if (!zones || fread(zones, sizeof(zone_watering), header.num_zones, snapshot_file) != (size_t)header.num_zones
+            || crc32(0, zones, header.num_zones * sizeof(zone_watering)) != header.crc) {
+        fprintf(LOG_ERR(log), "error: %s is truncated or corrupt\n", journal->snapshot_path);
+        free(zones);
+        fclose(snapshot_file);
+        return -1;
+    }
+    fclose(snapshot_file);
+
+    for (int z = 0; z < header.num_zones; z++) {
+        zones[z].zone[ZONE_NAME_LEN - 1] = '\0';
+        zone_watering *state = zone_state(journal, zones[z].zone);
+        if (!state) {
+            free(zones);
+            return -1;
+        }
+        *state = zones[z];
+    }
+    free(zones);
+
+    journal->snapshot_seq = header.seq;
+    journal->next_seq = header.seq + 1;
+    return 0;
+}
+
+
+static int replay_journal(watering_journal *journal) {
+    /* apply every intact record, a torn or corrupt tail (crash during an append) is cut off */
+    const log_streams *log = journal->log;
+    journal_record record;
+    long good_end = 0;
+
+    FILE *journal_file = fopen(journal->path, "rb");
+    if (journal_file == NULL)
+        return 0;
+
+    while (fread(&record, sizeof(record), 1, journal_file) == 1) {
+        if (memcmp(record.magic, record_magic, 4) != 0
+                || crc32(0, (const char *)&record + RECORD_CRC_OFFSET, sizeof(record) - RECORD_CRC_OFFSET) != record.crc)
+            break;
+        record.zone[ZONE_NAME_LEN - 1] = '\0';
+
+        // records already in the snapshot are left over from a compaction that stopped before truncating
+        if (record.seq > journal->snapshot_seq && apply_record(journal, &record) != 0) {
+            fclose(journal_file);
+            return -1;
+        }
+        if (record.seq >= journal->next_seq)
+            journal->next_seq = record.seq + 1;
+        journal->num_records++;
+        good_end += sizeof(record);
+    }
+
+    fseek(journal_file, 0, SEEK_END);
+    long size = ftell(journal_file);
+    fclose(journal_file);
+
+    if (size != good_end) {
+        fprintf(LOG_ERR(log), "error: %s has %ld bytes of torn or corrupt records after record %d, dropping them\n",
+            journal->path, size - good_end, journal->num_records);
+        if (truncate(journal->path, good_end) != 0) {
+            fprintf(LOG_ERR(log), "error: cannot truncate %s\n", journal->path);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+int watering_journal_open(watering_journal *journal, const char *prefix, const log_streams *log) {
+    memset(journal, 0, sizeof(watering_journal));
+    journal->log = log;
+    snprintf(journal->path, sizeof(journal->path), "%s_journal.dat", prefix);
+    snprintf(journal->snapshot_path, sizeof(journal->snapshot_path), "%s_snapshot.dat", prefix);
+    snprintf(journal->history_path, sizeof(journal->history_path), "%s_history.dat", prefix);
+    journal->next_seq = 1;
+
+    if (rehash(journal, 128) != 0 || load_snapshot(journal) != 0 || replay_journal(journal) != 0) {
+        watering_journal_close(journal);
+        return -1;
+    }
+
+    journal->file = fopen(journal->path, "ab");
+    if (journal->file == NULL) {
+        fprintf(LOG_ERR(log), "error: cannot open %s for appending\n", journal->path);
+        watering_journal_close(journal);
+        return -1;
+    }
+
+    fprintf(LOG_OUT(log), "Replayed %d watering records of %d sections from %s\n", journal->num_records, journal->num_zones, journal->path);
+    return 0;
+}
+
+
+void watering_journal_close(watering_journal *journal) {
+    if (journal->file)
+        fclose(journal->file);
+    free(journal->zones);
+    free(journal->slots);
+    journal->file = NULL;
+    journal->zones = NULL;
+    journal->slots = NULL;
+    journal->num_zones = journal->capacity = journal->num_slots = 0;
+}
+
+
+int watering_journal_append(watering_journal *journal, watering_event *event) {
+    const log_streams *log = journal->log;
+    journal_record record;
+
+    memset(&record, 0, sizeof(record));
+    memcpy(record.magic, record_magic, 4);
+    record.seq = event->seq = journal->next_seq;
+    record.time = event->time;
+    record.day = event->day;
+    record.gallons = event->gallons;
+    record.controller_num = event->controller_num;
+    record.relay_num = event->relay_num;
+    record.duration_ms = event->duration_ms;
+    snprintf(record.zone, ZONE_NAME_LEN, "%s", event->zone);
+    record.crc = crc32(0, (const char *)&record + RECORD_CRC_OFFSET, sizeof(record) - RECORD_CRC_OFFSET);
+
+    // the event only counts once it is on disk
+    if (fwrite(&record, sizeof(record), 1, journal->file) != 1 || fflush(journal->file) != 0 || fdatasync(fileno(journal->file)) != 0) {
+        fprintf(LOG_ERR(log), "error: cannot append to %s\n", journal->path);
+        return -1;
+    }
+    journal->next_seq++;
+    journal->num_records++;
+
+    if (apply_record(journal, &record) != 0)
+        return -1;
+
+    if (journal->num_records >= WATERING_COMPACT_RECORDS)
+        return watering_journal_compact(journal);
+    return 0;
+}
+
+
+static int archive_journal(watering_journal *journal) {
+    /* append the journal records to the history file */
+    char buffer[64 * sizeof(journal_record)];
+    size_t size;
+    int status = 0;
+
+    FILE *journal_file = fopen(journal->path, "rb");
+    if (journal_file == NULL)
+        return -1;
+    FILE *history_file = fopen(journal->history_path, "ab");
+    if (history_file == NULL) {
+        fclose(journal_file);
+        return -1;
+    }
+
+    while ((size = fread(buffer, 1, sizeof(buffer), journal_file)) > 0) {
+        if (fwrite(buffer, 1, size, history_file) != size) {
+            status = -1;
+            break;
+        }
+    }
+    if (fflush(history_file) != 0 || fdatasync(fileno(history_file)) != 0)
+        status = -1;
+    fclose(history_file);
+    fclose(journal_file);
+    return status;
+}
+
+
+int watering_journal_compact(watering_journal *journal) {
+    /* history first, then the snapshot (temporary file renamed over it), then the journal is emptied; a crash in
+    between leaves records that are skipped by sequence number on replay (and may repeat in the history) */
+    const log_streams *log = journal->log;
+    snapshot_header header;
+    char tmp_path[80];
+
+    if (journal->num_records == 0)
+        return 0;
+
+    if (archive_journal(journal) != 0) {
+        fprintf(LOG_ERR(log), "error: cannot append the journal to %s\n", journal->history_path);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, snapshot_magic, 4);
+    header.version = WATERING_JOURNAL_VERSION;
+    header.record_size = sizeof(zone_watering);
+    header.seq = journal->next_seq - 1;
+    header.num_zones = journal->num_zones;
+    header.crc = crc32(0, journal->zones, journal->num_zones * sizeof(zone_watering));
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", journal->snapshot_path);
+    FILE *snapshot_file = fopen(tmp_path, "wb");
+    if (snapshot_file == NULL) {
+        fprintf(LOG_ERR(log), "error: cannot write %s\n", tmp_path);
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, snapshot_file) != 1
+            || fwrite(journal->zones, sizeof(zone_watering), journal->num_zones, snapshot_file) != (size_t)journal->num_zones
+            || fflush(snapshot_file) != 0 || fdatasync(fileno(snapshot_file)) != 0) {
+        fprintf(LOG_ERR(log), "error: cannot write %s\n", tmp_path);
+        fclose(snapshot_file);
+        remove(tmp_path);
+        return -1;
+    }
+    if (fclose(snapshot_file) != 0 || rename(tmp_path, journal->snapshot_path) != 0) {
+        fprintf(LOG_ERR(log), "error: cannot replace %s\n", journal->snapshot_path);
+        remove(tmp_path);
+        return -1;
+    }
+    journal->snapshot_seq = header.seq;
+
+    // start an empty journal, appends keep going to the (new) end of the file
+    if (fflush(journal->file) != 0 || ftruncate(fileno(journal->file), 0) != 0) {
+        fprintf(LOG_ERR(log), "error: cannot truncate %s\n", journal->path);
+        return -1;
+    }
+    journal->num_records = 0;
+
+    fprintf(LOG_OUT(log), "Compacted the watering journal into %s (%d sections)\n", journal->snapshot_path, journal->num_zones);
+    return 0;
+}
+
+
+static int replay_file(const char *path, uint64_t *after_seq, watering_callback on_event, void *ctx) {
+    /* hand the intact records after *after_seq to on_event, *after_seq follows the last one */
+    journal_record record;
+    watering_event event;
+    int status = 0;
+
+    FILE *replay = fopen(path, "rb");
+    if (replay == NULL)
+        return 0;
+
+    while (status == 0 && fread(&record, sizeof(record), 1, replay) == 1) {
+        if (memcmp(record.magic, record_magic, 4) != 0
+                || crc32(0, (const char *)&record + RECORD_CRC_OFFSET, sizeof(record) - RECORD_CRC_OFFSET) != record.crc)
+            break;
+        if (record.seq <= *after_seq)
+            continue;
+
+        event.seq = record.seq;
+        event.time = record.time;
+        event.day = record.day;
+        event.gallons = record.gallons;
+        event.controller_num = record.controller_num;
+        event.relay_num = record.relay_num;
+        event.duration_ms = record.duration_ms;
+        memcpy(event.zone, record.zone, ZONE_NAME_LEN);
+        event.zone[ZONE_NAME_LEN - 1] = '\0';
+
+        status = on_event(ctx, &event);
+        *after_seq = record.seq;
+    }
+    fclose(replay);
+    return status;
+}
+
+
+int watering_journal_replay(const watering_journal *journal, uint64_t after_seq, watering_callback on_event, void *ctx) {
+    if (after_seq < journal->snapshot_seq && replay_file(journal->history_path, &after_seq, on_event, ctx) != 0)
+        return -1;
+    return replay_file(journal->path, &after_seq, on_event, ctx);
+}
+
+
+const zone_watering *watering_journal_find(const watering_journal *journal, const char *zone) {
+    int slot = find_slot(journal, zone);
+    return journal->slots[slot] >= 0 ? &journal->zones[journal->slots[slot]] : NULL;
+}
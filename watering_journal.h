@@ -0,0 +1,95 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+append-only journal of confirmed watering events. Each event is one fixed size record with a sequence
+number and a CRC32, appended and synced as soon as the ESP acks, so a crash loses at most the record being
+written (a torn or corrupt tail is cut off on the next open). Every WATERING_COMPACT_RECORDS events the
+journal is compacted: its records move to the history file (the full watering log, never read back
+at startup) and the per-section state (last watering, totals) is saved as a snapshot. Startup replays the
+snapshot plus the few records appended since.
+*/
+
+#ifndef WATERING_JOURNAL_H
+#define WATERING_JOURNAL_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "zone_config.h"
+
+#define WATERING_JOURNAL_VERSION 1
+
+#ifndef WATERING_COMPACT_RECORDS
+#define WATERING_COMPACT_RECORDS 1024   // journal records replayed at most before they are compacted
+#endif
+
+typedef struct watering_event {
+    uint64_t seq;              // set by watering_journal_append
+    int64_t time;              // seconds since the Epoch the ack arrived
+    int32_t day;               // local day number since 1970-01-01 of the watering
+    float gallons;             // delivered by the emitters (runtime * flow)
+    int32_t controller_num;
+    int32_t relay_num;
+    int32_t duration_ms;
+    char zone[ZONE_NAME_LEN];
+} watering_event;
+
+typedef int (*watering_callback)(void *ctx, const watering_event *event);
+
+typedef struct zone_watering {
+    char zone[ZONE_NAME_LEN];
+    int64_t last_time;
+    double total_gallons;      // everything logged for the section
+    int32_t last_day;
+    float last_gallons;
+    int32_t num_waterings;
+    int32_t reserved;
+} zone_watering;
+
+typedef struct watering_journal {
+    char path[64];             // <prefix>_journal.dat, the records since the last compaction
+    char snapshot_path[64];    // <prefix>_snapshot.dat
+    char history_path[64];     // <prefix>_history.dat, every compacted record
+    FILE *file;                // open for appending
+    uint64_t next_seq;
+    uint64_t snapshot_seq;     // last record folded into the snapshot
+    int num_records;           // records in the journal file
+    zone_watering *zones;      // replayed state per section
+    int num_zones;
+    int capacity;
+    int32_t *slots;            // open addressing hash of zone names, -1 when empty
+    int num_slots;
+    const log_streams *log;    // where its messages go
+} watering_journal;
+
+// load the snapshot, replay the journal (cutting off a torn tail) and open it for appending
+int watering_journal_open(watering_journal *journal, const char *prefix, const log_streams *log);
+void watering_journal_close(watering_journal *journal);
+
+// append and sync one event, then update the section's state; compacts when the journal is long enough
+int watering_journal_append(watering_journal *journal, watering_event *event);
+int watering_journal_compact(watering_journal *journal);
+
+// call on_event for every logged event with a sequence number after after_seq, in order; the history file is
+// only read when some of them were already compacted
+int watering_journal_replay(const watering_journal *journal, uint64_t after_seq, watering_callback on_event, void *ctx);
+
+// the section's replayed state, NULL if it was never logged
+const zone_watering *watering_journal_find(const watering_journal *journal, const char *zone);
+
+#endif
@@ -0,0 +1,411 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "weather.h"
+#include "cimis_stream.h"
+#include "metrics.h"
+
+#ifndef CIMIS_REQUEST_ATTEMPTS
+#define CIMIS_REQUEST_ATTEMPTS 3   // tries per CIMIS request, retries reuse the open connections
+#endif
+
+#define EARTH_RADIUS_KM 6371.0
+
+
+int weather_station_index(weather_station *stations, int *num_stations, const char *id, const log_streams *log) {
+    for (int s = 0; s < *num_stations; s++) {
+        if (strcmp(stations[s].id, id) == 0)
+            return s;
+    }
+    if (*num_stations >= MAX_STATIONS) {
+        fprintf(LOG_ERR(log), "error: more than %d CIMIS stations, ignoring station %s\n", MAX_STATIONS, id);
+        return -1;
+    }
+
+    weather_station *station = &stations[(*num_stations)++];
+    memset(station, 0, sizeof(weather_station));
+    snprintf(station->id, CIMIS_STATION_LEN, "%s", id);
+    return *num_stations - 1;
+}
+
+
+typedef struct cimis_response {
+    cimis_stream stream;
+    int64_t parse_ns;          // time in the parser, summed over the chunks
+} cimis_response;
+
+
+static size_t write_response(void *ptr, size_t size, size_t nmemb, void *ctx) {
+    /* hand each chunk of the GET response straight to the CIMIS stream parser, nothing is buffered */
+    cimis_response *response = (cimis_response *)ctx;
+    int64_t start_ns = metrics_now_ns();
+    size_t consumed = cimis_stream_feed(&response->stream, (const char *)ptr, size * nmemb);
+
+    // parsing runs inside the transfer, timing it here separates it from the network time; the response's span
+    // is recorded once it is finished
+    response->parse_ns += metrics_now_ns() - start_ns;
+    metrics_count(COUNTER_CIMIS_BYTES, consumed);
+    return consumed;
+}
+
+
+static int store_cimis_record(void *ctx, const char *station, int32_t day, const cimis_day *record) {
+    /* stream parser callback, saves each daily record into the per-day store as soon as it is parsed */
+    cimis_store *store = (cimis_store *)ctx;
+
+    if (station[0] != '\0' && strcmp(station, store->station) != 0) {
+        return 0;
+    }
+    return cimis_store_put(store, day, record);
+}
+
+
+static int store_has_days(const cimis_store *store, int32_t first_day, int32_t last_day) {
+    /* every day of the range has a record, possibly incomplete */
+    for (int32_t day = first_day; day <= last_day; day++) {
+        if (!cimis_store_get(store, day))
+            return 0;
+    }
+    return 1;
+}
+
+
+static char *cimis_url(const char *app_key, const char *station, int32_t first_day, int32_t last_day) {
+    /* set up the url link with the API key, weather station number, and start and end dates for the data (obtain daily weather data) */
+    char start_buffer[16], end_buffer[16];
+    const char *format = "https://et.water.ca.gov/api/data?appKey=%s&targets=%s&startDate=%s&endDate=%s";
+
+    // format the strings according to the format specified by CIMIS
+    cimis_day_string(first_day, start_buffer, sizeof(start_buffer));
+    cimis_day_string(last_day, end_buffer, sizeof(end_buffer));
+
+    int length = snprintf(NULL, 0, format, app_key, station, start_buffer, end_buffer);
+    char *full_url = malloc(length + 1);
+    if (full_url)
+        snprintf(full_url, length + 1, format, app_key, station, start_buffer, end_buffer);
+    return full_url;
+}
+
+
+int weather_update(http_session *session, const char *app_key, weather_station *stations, int num_stations, int32_t start_day, int32_t end_day,
+        const log_streams *log) {
+    http_request requests[MAX_STATIONS];
+    int pending[MAX_STATIONS];      // station index of every request still to be made
+    char *urls[MAX_STATIONS] = {0};
+    int32_t requested[MAX_STATIONS][2];  // first and last day of every station's request
+    int usable[MAX_STATIONS] = {0};
+    int num_pending = 0;
+    int num_unusable = 0;
+
+    cimis_response *responses = malloc(num_stations * sizeof(cimis_response) + 1);
+    if (!responses)
+        return num_stations;
+
+    // the per-day store keeps every day already downloaded, only the days it is missing are requested from CIMIS
+    for (int s = 0; s < num_stations; s++) {
+        int32_t first_missing, last_missing;
+
+        if (!stations[s].store_open) {
+            if (cimis_store_open(&stations[s].store, stations[s].id) != 0)
+                continue;
+            stations[s].store_open = 1;
+        }
+        usable[s] = 1;
+
+        int num_missing = cimis_store_missing(&stations[s].store, start_day, end_day, &first_missing, &last_missing);
+        if (num_missing == 0) {
+            fprintf(LOG_OUT(log), "Station %s: all %d days are already stored in %s\n", stations[s].id, end_day - start_day + 1, stations[s].store.path);
+            continue;
+        }
+
+        urls[s] = cimis_url(app_key, stations[s].id, first_missing, last_missing);
+        requested[s][0] = first_missing;
+        requested[s][1] = last_missing;
+        if (!urls[s])
+            continue;
+        fprintf(LOG_OUT(log), "Station %s: %d days are not stored yet, requesting them from CIMIS\n", stations[s].id, num_missing);
+        pending[num_pending++] = s;
+    }
+
+    // every station in one concurrent batch, the failed ones are tried again on the same connections
+    for (int attempt = 1; attempt <= CIMIS_REQUEST_ATTEMPTS && num_pending > 0; attempt++) {
+        int still_pending = 0;
+        int num_failed = 0;
+
+        for (int p = 0; p < num_pending; p++) {
+            int s = pending[p];
+            // records go into the store while the response downloads, memory stays bounded by the stream parser
+            cimis_stream_init(&responses[s].stream, store_cimis_record, &stations[s].store, log);
+            responses[s].parse_ns = 0;
+            requests[p] = (http_request){.url = urls[s], .on_data = write_response, .ctx = &responses[s]};
+        }
+        http_get_many(session, requests, num_pending);
+        metrics_count(COUNTER_CIMIS_REQUESTS, num_pending);
+
+        for (int p = 0; p < num_pending; p++) {
+            int s = pending[p];
+            int parsed = -1;
+            if (requests[p].result == HTTP_OK) {
+                // one parse span per response
+                int64_t start_ns = metrics_now_ns();
+                parsed = cimis_stream_finish(&responses[s].stream);
+                metrics_span_ns(SPAN_CIMIS_PARSE, responses[s].parse_ns + metrics_now_ns() - start_ns);
+            }
+            if (requests[p].result == HTTP_NOT_MODIFIED && !store_has_days(&stations[s].store, requested[s][0], requested[s][1])) {
+                // the validators outlived the days they validated (the store was deleted), ask again without them
+                fprintf(LOG_OUT(log), "Station %s: CIMIS data has not changed but the store lacks those days, requesting them again in full\n", stations[s].id);
+                http_session_forget(session, urls[s]);
+                pending[still_pending++] = s;
+            } else if (requests[p].result == HTTP_NOT_MODIFIED) {
+                fprintf(LOG_OUT(log), "Station %s: CIMIS data has not changed since the last request, using the stored days\n", stations[s].id);
+            } else if (parsed == 0) {
+                fprintf(LOG_OUT(log), "Station %s: CIMIS data obtained for %d days and stored in %s\n", stations[s].id, responses[s].stream.num_records, stations[s].store.path);
+                metrics_count(COUNTER_CIMIS_RECORDS, responses[s].stream.num_records);
+            } else {
+                metrics_count(COUNTER_CIMIS_FAILURES, 1);
+                num_failed++;
+                if (requests[p].result == HTTP_OK) {
+                    // the body was not usable, make sure the next request downloads it in full
+                    http_session_forget(session, urls[s]);
+                }
+                pending[still_pending++] = s;
+            }
+        }
+        num_pending = still_pending;
+
+        if (num_failed > 0 && attempt < CIMIS_REQUEST_ATTEMPTS) {
+            fprintf(LOG_ERR(log), "error: CIMIS request attempt %d of %d failed for %d stations, retrying\n", attempt, CIMIS_REQUEST_ATTEMPTS, num_failed);
+            sleep(attempt * 2);
+        }
+    }
+    for (int p = 0; p < num_pending; p++) {
+        // carry on with what is stored (and whatever records arrived), the window check fails if whole days are missing
+        fprintf(LOG_ERR(log), "error: CIMIS request failed for station %s, using the stored days only\n", stations[pending[p]].id);
+    }
+
+    for (int s = 0; s < num_stations; s++) {
+        free(urls[s]);
+        if (!usable[s]) {
+            stations[s].window = (cimis_results){.Et0 = 0., .precip = 0., .parse_errors = 1};
+            num_unusable++;
+            continue;
+        }
+
+        cimis_store_save(&stations[s].store);
+        stations[s].window = cimis_store_window(&stations[s].store, start_day, end_day, log);
+
+        if (stations[s].window.parse_errors > 0) {
+            fprintf(LOG_ERR(log), "ERROR: station %s has %d days without ETo in the CIMIS store.\n", stations[s].id, stations[s].window.parse_errors);
+            num_unusable++;
+        } else {
+            fprintf(LOG_OUT(log), "Station %s: CIMIS Et0 reads %.2f, precip reads %.2f\n", stations[s].id, stations[s].window.Et0, stations[s].window.precip);
+        }
+    }
+
+    free(responses);
+    return num_unusable;
+}
+
+
+void weather_close(weather_station *stations, int num_stations) {
+    for (int s = 0; s < num_stations; s++) {
+        if (stations[s].store_open) {
+            cimis_store_save(&stations[s].store);
+            cimis_store_close(&stations[s].store);
+            stations[s].store_open = 0;
+        }
+    }
+}
+
+
+void weather_cache_init(weather_cache *cache, http_session *session, const char *app_key) {
+    memset(cache, 0, sizeof(weather_cache));
+    pthread_rwlock_init(&cache->lock, NULL);
+    pthread_mutex_init(&cache->update_lock, NULL);
+    cache->session = session;
+    cache->app_key = app_key;
+}
+
+
+int weather_cache_update(weather_cache *cache, const weather_station *stations, int num_stations, int *map, int32_t start_day, int32_t end_day,
+        const log_streams *log) {
+    /* weather_update works on a table of stations, it runs on copies of the site's entries so the sites reading
+    the stores aren't held up by the CIMIS requests and retries, the copies replace the entries once it is done */
+    weather_station batch[MAX_STATIONS];
+    int num_copied = 0;
+    int num_unusable = -1;
+
+    pthread_mutex_lock(&cache->update_lock);
+    // only this thread changes the stores while it holds update_lock, the write lock is for adding stations
+    pthread_rwlock_wrlock(&cache->lock);
+    for (int s = 0; s < num_stations; s++) {
+        int c = 0;
+        while (c < cache->num_stations && strcmp(cache->stations[c].id, stations[s].id) != 0)
+            c++;
+        if (c == cache->num_stations) {
+            if (cache->num_stations == WEATHER_CACHE_MAX_STATIONS) {
+                fprintf(LOG_ERR(log), "error: the sites use more than %d CIMIS stations, station %s can't be added\n", WEATHER_CACHE_MAX_STATIONS, stations[s].id);
+                break;
+            }
+            memset(&cache->stations[c], 0, sizeof(weather_station));
+            memcpy(cache->stations[c].id, stations[s].id, CIMIS_STATION_LEN);
+            cache->stations[c].lat = stations[s].lat;
+            cache->stations[c].lon = stations[s].lon;
+            cache->stations[c].has_location = stations[s].has_location;
+            cache->num_stations++;
+        }
+        map[s] = c;
+        batch[s] = cache->stations[c];
+        if (batch[s].store_open && cimis_store_copy(&batch[s].store, &cache->stations[c].store, log) != 0)
+            break;
+        num_copied++;
+    }
+    pthread_rwlock_unlock(&cache->lock);
+
+    if (num_copied < num_stations) {
+        weather_close(batch, num_copied);
+        pthread_mutex_unlock(&cache->update_lock);
+        return -1;
+    }
+
+    num_unusable = weather_update(cache->session, cache->app_key, batch, num_stations, start_day, end_day, log);
+
+    pthread_rwlock_wrlock(&cache->lock);
+    for (int s = 0; s < num_stations; s++) {
+        // the copy was saved by weather_update, the old days are only freed
+        cimis_store_close(&cache->stations[map[s]].store);
+        cache->stations[map[s]] = batch[s];
+    }
+    pthread_rwlock_unlock(&cache->lock);
+    pthread_mutex_unlock(&cache->update_lock);
+    return num_unusable;
+}
+
+
+void weather_cache_close(weather_cache *cache) {
+    pthread_rwlock_wrlock(&cache->lock);
+    weather_close(cache->stations, cache->num_stations);
+    cache->num_stations = 0;
+    pthread_rwlock_unlock(&cache->lock);
+}
+
+
+static double distance_km(double lat1, double lon1, double lat2, double lon2) {
+    /* great circle distance (haversine) */
+    double to_rad = M_PI / 180.;
+    double dlat = (lat2 - lat1) * to_rad;
+    double dlon = (lon2 - lon1) * to_rad;
+    double a = sin(dlat / 2) * sin(dlat / 2) + cos(lat1 * to_rad) * cos(lat2 * to_rad) * sin(dlon / 2) * sin(dlon / 2);
+    return 2. * EARTH_RADIUS_KM * atan2(sqrt(a), sqrt(1. - a));
+}
+
+
+void zone_weather_weights(zone_weather *zone, const weather_station *stations, int has_location, double lat, double lon, int mode) {
+    int located = has_location && zone->num_stations > 0;
+    double distance[MAX_ZONE_STATIONS];
+    double total = 0.;
+    int nearest = 0;
+
+    for (int k = 0; k < zone->num_stations; k++) {
+        if (!stations[zone->station[k]].has_location)
+            located = 0;
+    }
+
+    if (!located) {
+        for (int k = 0; k < zone->num_stations; k++)
+            zone->weight[k] = 1.f / zone->num_stations;
+        return;
+    }
+
+    for (int k = 0; k < zone->num_stations; k++) {
+        const weather_station *station = &stations[zone->station[k]];
+        distance[k] = distance_km(lat, lon, station->lat, station->lon);
+        if (distance[k] < distance[nearest])
+            nearest = k;
+    }
+
+    // a station (practically) on site, or nearest mode, takes all the weight
+    if (mode == WEIGHT_NEAREST || distance[nearest] < 0.1) {
+        for (int k = 0; k < zone->num_stations; k++)
+            zone->weight[k] = (k == nearest) ? 1.f : 0.f;
+        return;
+    }
+
+    for (int k = 0; k < zone->num_stations; k++)
+        total += 1. / (distance[k] * distance[k]);
+    for (int k = 0; k < zone->num_stations; k++)
+        zone->weight[k] = (float)((1. / (distance[k] * distance[k])) / total);
+}
+
+
+cimis_results zone_weather_results(const zone_weather *zone, const weather_station *stations) {
+    cimis_results zone_out = {.Et0 = 0., .precip = 0., .parse_errors = 0};
+    float total_weight = 0.;
+
+    for (int k = 0; k < zone->num_stations; k++) {
+        const weather_station *station = &stations[zone->station[k]];
+        if (station->window.parse_errors > 0 || zone->weight[k] <= 0.)
+            continue;
+        zone_out.Et0 += zone->weight[k] * station->window.Et0;
+        zone_out.precip += zone->weight[k] * station->window.precip;
+        total_weight += zone->weight[k];
+    }
+
+    if (total_weight <= 0.) {
+        // none of the section's stations has usable data
+        zone_out.parse_errors = 1;
+        return zone_out;
+    }
+
+    // renormalize when a station dropped out
+    zone_out.Et0 /= total_weight;
+    zone_out.precip /= total_weight;
+    return zone_out;
+}
+
+
+cimis_results zone_weather_day(const zone_weather *zone, const weather_station *stations, int32_t day) {
+    cimis_results zone_out = {.Et0 = 0., .precip = 0., .parse_errors = 0};
+    float total_weight = 0.;
+
+    for (int k = 0; k < zone->num_stations; k++) {
+        const weather_station *station = &stations[zone->station[k]];
+        const cimis_day *record = station->store_open ? cimis_store_get(&station->store, day) : NULL;
+        if (!record || !(record->flags & CIMIS_DAY_ETO_VALID) || zone->weight[k] <= 0.)
+            continue;
+        zone_out.Et0 += zone->weight[k] * record->eto;
+        if (record->flags & CIMIS_DAY_PRECIP_VALID)
+            zone_out.precip += zone->weight[k] * record->precip;
+        total_weight += zone->weight[k];
+    }
+
+    if (total_weight <= 0.) {
+        zone_out.parse_errors = 1;
+        return zone_out;
+    }
+
+    zone_out.Et0 /= total_weight;
+    zone_out.precip /= total_weight;
+    return zone_out;
+}
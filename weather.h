@@ -0,0 +1,99 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+weather for every garden section from one or more CIMIS stations. All the stations the sections use are
+brought up to date in one concurrent batch (only their missing days are requested), then each section's
+ETo and precipitation come from its nearest station or an inverse distance weighting of its stations
+*/
+
+#ifndef WEATHER_H
+#define WEATHER_H
+
+#include <pthread.h>
+
+#include "cimis_store.h"
+#include "http_session.h"
+#include "log_streams.h"
+
+#define MAX_STATIONS 32
+#define MAX_ZONE_STATIONS 4
+#define WEATHER_CACHE_MAX_STATIONS (4 * MAX_STATIONS)
+
+enum { WEIGHT_IDW = 0, WEIGHT_NEAREST };
+
+typedef struct weather_station {
+    char id[CIMIS_STATION_LEN];
+    double lat;          // in degrees, only used when has_location is set
+    double lon;
+    int has_location;
+    int store_open;      // the store is opened on the first update and kept in memory until weather_close
+    cimis_store store;
+    cimis_results window; // ETo and precipitation totals over the requested days
+} weather_station;
+
+typedef struct zone_weather {
+    int station[MAX_ZONE_STATIONS];    // indexes into the station table
+    float weight[MAX_ZONE_STATIONS];   // sum to 1
+    int num_stations;
+} zone_weather;
+
+// index of the station with this id, adding it (without a location) if there is room; -1 if the table is full
+int weather_station_index(weather_station *stations, int *num_stations, const char *id, const log_streams *log);
+
+// open every station's store (once), request the missing days of all of them concurrently, save the stores and
+// fill in each station's window over [start_day, end_day]; returns the number of stations without a usable window
+int weather_update(http_session *session, const char *app_key, weather_station *stations, int num_stations, int32_t start_day, int32_t end_day,
+    const log_streams *log);
+
+// close the stores kept open by weather_update
+void weather_close(weather_station *stations, int num_stations);
+
+// the stores of every station the sites of the process use, each station is stored and requested once however many
+// sites use it. An update fetches into copies of the stores outside the lock (one update at a time, the HTTP session
+// isn't shared between threads) and takes the write lock only to swap them in, the sites hold the read lock while
+// they read days from the stores
+typedef struct weather_cache {
+    pthread_rwlock_t lock;
+    pthread_mutex_t update_lock;
+    http_session *session;
+    const char *app_key;
+    weather_station stations[WEATHER_CACHE_MAX_STATIONS];
+    int num_stations;
+} weather_cache;
+
+void weather_cache_init(weather_cache *cache, http_session *session, const char *app_key);
+
+// weather_update of a site's stations (adding the ones the cache doesn't have yet), map[s] is set to the cache index
+// of stations[s]; returns the number of stations without a usable window, -1 if the cache is full
+int weather_cache_update(weather_cache *cache, const weather_station *stations, int num_stations, int *map, int32_t start_day, int32_t end_day,
+    const log_streams *log);
+
+// save and close every store
+void weather_cache_close(weather_cache *cache);
+
+// weights of the section's stations, by inverse distance squared (or all on the nearest one) when the section
+// and its stations have locations, equal weights otherwise
+void zone_weather_weights(zone_weather *zone, const weather_station *stations, int has_location, double lat, double lon, int mode);
+
+// the section's weighted ETo and precipitation, stations without a usable window are left out
+cimis_results zone_weather_results(const zone_weather *zone, const weather_station *stations);
+
+// the same for a single day from the stations' stores, parse_errors is set when none of them has the day's ETo
+cimis_results zone_weather_day(const zone_weather *zone, const weather_station *stations, int32_t day);
+
+#endif
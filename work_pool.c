@@ -0,0 +1,174 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "work_pool.h"
+
+// one worker's share of the items, [next, end), padded so two shares never sit on one cache line
+typedef struct work_share {
+    pthread_mutex_t lock;
+    int next;
+    int end;
+    char padding[64];
+} work_share;
+
+typedef struct work_pool {
+    work_share shares[WORK_POOL_MAX_WORKERS];
+    int num_workers;
+    work_item_fn fn;
+    void *ctx;
+} work_pool;
+
+typedef struct work_worker {
+    work_pool *pool;
+    int worker;
+} work_worker;
+
+
+int work_pool_default_workers(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cores < 1)
+        return 1;
+    return cores < WORK_POOL_MAX_WORKERS ? (int)cores : WORK_POOL_MAX_WORKERS;
+}
+
+
+static int take_item(work_share *share) {
+    /* the next item from the front of a share, -1 once it is empty */
+    int item = -1;
+
+    pthread_mutex_lock(&share->lock);
+    if (share->next < share->end)
+        item = share->next++;
+    pthread_mutex_unlock(&share->lock);
+    return item;
+}
+
+
+static int steal_items(work_pool *pool, int thief) {
+    /* move the back half of the fullest other share to the thief's (empty) share and return its first item,
+    -1 when every share is empty */
+    for (;;) {
+        int victim = -1, most = 0;
+
+        // steals are rare, the shares are each locked for the look (the count is checked again before taking)
+        for (int w = 0; w < pool->num_workers; w++) {
+            if (w == thief)
+                continue;
+            pthread_mutex_lock(&pool->shares[w].lock);
+            int left = pool->shares[w].end - pool->shares[w].next;
+            pthread_mutex_unlock(&pool->shares[w].lock);
+            if (left > most) {
+                most = left;
+                victim = w;
+            }
+        }
+        if (victim < 0)
+            return -1;
+
+        work_share *share = &pool->shares[victim];
+        int first = -1, end = 0;
+        pthread_mutex_lock(&share->lock);
+        int left = share->end - share->next;
+        if (left > 0) {
+            // a share of one goes whole, its owner may be busy with a long item
+            end = share->end;
+            first = share->end - (left + 1) / 2;
+            share->end = first;
+        }
+        pthread_mutex_unlock(&share->lock);
+        if (first < 0)
+            continue;   // emptied in the meantime, look again
+
+        work_share *own = &pool->shares[thief];
+        pthread_mutex_lock(&own->lock);
+        own->next = first + 1;
+        own->end = end;
+        pthread_mutex_unlock(&own->lock);
+        return first;
+    }
+}
+
+
+static void *work_thread(void *arg) {
+    work_worker *self = (work_worker *)arg;
+    work_pool *pool = self->pool;
+
+    for (;;) {
+        int item = take_item(&pool->shares[self->worker]);
+        if (item < 0)
+            item = steal_items(pool, self->worker);
+        if (item < 0)
+            return NULL;
+        pool->fn(pool->ctx, self->worker, item);
+    }
+}
+
+
+int work_pool_run(int num_workers, int num_items, work_item_fn fn, void *ctx) {
+    work_pool pool;
+    pthread_t threads[WORK_POOL_MAX_WORKERS];
+    work_worker workers[WORK_POOL_MAX_WORKERS];
+    int num_started = 0;
+
+    if (num_workers < 1)
+        num_workers = 1;
+    if (num_workers > WORK_POOL_MAX_WORKERS)
+        num_workers = WORK_POOL_MAX_WORKERS;
+    if (num_workers > num_items)
+        num_workers = num_items > 0 ? num_items : 1;
+
+    pool.num_workers = num_workers;
+    pool.fn = fn;
+    pool.ctx = ctx;
+    for (int w = 0; w < num_workers; w++) {
+        pthread_mutex_init(&pool.shares[w].lock, NULL);
+        pool.shares[w].next = (int)((long)num_items * w / num_workers);
+        pool.shares[w].end = (int)((long)num_items * (w + 1) / num_workers);
+    }
+
+    for (int w = 0; w < num_workers; w++) {
+        workers[w].pool = &pool;
+        workers[w].worker = w;
+        if (pthread_create(&threads[w], NULL, work_thread, &workers[w]) != 0) {
+            // the shares of the workers that didn't start are stolen by the ones that did
+            fprintf(stderr, "error: started %d of %d worker threads\n", num_started, num_workers);
+            break;
+        }
+        num_started++;
+    }
+    if (num_started == 0) {
+        // no threads at all, the caller runs everything as worker 0
+        pool.num_workers = 1;
+        pool.shares[0].next = 0;
+        pool.shares[0].end = num_items;
+        work_thread(&workers[0]);
+        num_started = 1;
+    } else {
+        for (int w = 0; w < num_started; w++)
+            pthread_join(threads[w], NULL);
+    }
+
+    for (int w = 0; w < num_workers; w++)
+        pthread_mutex_destroy(&pool.shares[w].lock);
+    return num_started;
+}
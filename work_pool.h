@@ -0,0 +1,41 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+
+bounded pool of worker threads for batches of independent items (sweep candidates, sites). Every worker
+starts with an equal share of the item numbers and takes them one at a time from the front of its share;
+a worker that runs out steals the back half of the fullest share it can find, so uneven items still keep
+every core busy to the end without a shared queue every worker contends on.
+*/
+
+#ifndef WORK_POOL_H
+#define WORK_POOL_H
+
+#define WORK_POOL_MAX_WORKERS 64
+
+// called once per item, worker is the 0 based number of the thread running it (for per-worker scratch)
+typedef void (*work_item_fn)(void *ctx, int worker, int item);
+
+// online cores, at least 1 and at most WORK_POOL_MAX_WORKERS
+int work_pool_default_workers(void);
+
+// run fn on items 0 .. num_items - 1 over num_workers threads and return once every item is done; items run
+// on the caller's thread when no thread can be started; returns the number of workers that ran
+int work_pool_run(int num_workers, int num_items, work_item_fn fn, void *ctx);
+
+#endif
@@ -0,0 +1,559 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <jansson.h>     // json parser for C, see https://jansson.readthedocs.io/en/latest/ for documentation
+
+#include "zone_config.h"
+
+static const char config_magic[4] = {'I', 'R', 'R', 'Z'};
+
+_Static_assert(sizeof(zone_config_header) % 8 == 0, "zone config header must keep the records aligned");
+_Static_assert(sizeof(zone_config_source) % 8 == 0, "zone config source records must stay aligned");
+_Static_assert(sizeof(zone_config_station) % 8 == 0, "zone config station records must stay aligned");
+_Static_assert(sizeof(zone_config_controller) % 8 == 0, "zone config controller records must stay aligned");
+_Static_assert(sizeof(zone_config_zone) % 8 == 0, "zone config section records must stay aligned");
+
+
+static int json_stamp(const char *json_path, int64_t *mtime_ns, int64_t *size) {
+    struct stat json_stat;
+
+    if (stat(json_path, &json_stat) != 0)
+        return -1;
+    *mtime_ns = (int64_t)json_stat.st_mtim.tv_sec * 1000000000 + json_stat.st_mtim.tv_nsec;
+    *size = json_stat.st_size;
+    return 0;
+}
+
+
+static float json_float(json_t *value) {
+    /* the irrigation JSON has numbers both as numbers and as strings ("PF": "1.0") */
+    if (json_is_string(value))
+        return strtof(json_string_value(value), NULL);
+    return (float)json_number_value(value);
+}
+
+
+static int compile_sources(json_t *root_irr, zone_config_source *sources, const log_streams *log) {
+    /* the flow budget of each water source, e.g.
+       "Sources": [{"Name": "Hose bib", "MaxGPH": 30.0}]
+    without a Sources array every section shares one source and runs one at a time */
+    json_t *Sources = json_object_get(root_irr, "Sources");
+    int num_sources = 0;
+
+    for (size_t i = 0; i < json_array_size(Sources) && num_sources < MAX_WATER_SOURCES; i++) {
+        json_t *get_source = json_array_get(Sources, i);
+        json_t *Name = json_object_get(get_source, "Name");
+        json_t *MaxGPH = json_object_get(get_source, "MaxGPH");
+
+        if (!json_is_string(Name)) {
+            fprintf(LOG_ERR(log), "error: water source %zu has no Name, skipping it\n", i);
+            continue;
+        }
+        snprintf(sources[num_sources].name, WATER_SOURCE_NAME_LEN, "%s", json_string_value(Name));
+        sources[num_sources].max_gph = json_is_number(MaxGPH) ? (float)json_number_value(MaxGPH) : 0.;
+        num_sources++;
+    }
+
+    if (num_sources == 0) {
+        snprintf(sources[0].name, WATER_SOURCE_NAME_LEN, "%s", "default");
+        num_sources = 1;
+    }
+    return num_sources;
+}
+
+
+static int compile_source_index(json_t *section, const zone_config_source *sources, int num_sources, const log_streams *log) {
+    /* index of the section's "Source", sections that don't declare one go on the first source */
+    json_t *Source = json_object_get(section, "Source");
+
+    if (json_is_string(Source)) {
+        for (int s = 0; s < num_sources; s++) {
+            if (strcmp(sources[s].name, json_string_value(Source)) == 0)
+                return s;
+        }
+        fprintf(LOG_ERR(log), "error: unknown water source %s, using %s\n", json_string_value(Source), sources[0].name);
+    }
+    return 0;
+}
+
+
+static int compare_controllers(const void *a, const void *b) {
+    int32_t id_a = ((const zone_config_controller *)a)->controller_num;
+    int32_t id_b = ((const zone_config_controller *)b)->controller_num;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+
+static int compare_ids(const void *a, const void *b) {
+    int32_t id_a = *(const int32_t *)a, id_b = *(const int32_t *)b;
+    return (id_a > id_b) - (id_a < id_b);
+}
+
+
+static void default_topic(zone_config_controller *controller) {
+    snprintf(controller->topic, CONTROLLER_TOPIC_LEN, "%s/%d", CONTROLLER_TOPIC_PREFIX, controller->controller_num);
+}
+
+
+static int compile_controllers(json_t *root_irr, const zone_config_zone *zones, size_t num_zones, zone_config_controller **controllers_out,
+        const log_streams *log) {
+    /* the MQTT topic of each controller, e.g.
+       "Controllers": [{"Id": 1, "Topic": "irrigation/back_yard"}]
+    every controller a section uses gets a record, the ones not listed (or without a Topic) are on irrigation/<id>.
+    The records are sorted by controller number; returns how many or -1 */
+    json_t *Controllers = json_object_get(root_irr, "Controllers");
+    size_t num_declared = json_array_size(Controllers);
+    zone_config_controller *controllers = calloc(num_declared + num_zones + 1, sizeof(zone_config_controller));
+    int32_t *used = malloc((num_zones + 1) * sizeof(int32_t));
+    int num_controllers = 0;
+
+    if (!controllers || !used) {
+        fprintf(LOG_ERR(log), "error: unable to allocate the controller routes\n");
+        free(controllers);
+        free(used);
+        return -1;
+    }
+
+    for (size_t i = 0; i < num_declared; i++) {
+        json_t *get_controller = json_array_get(Controllers, i);
+        json_t *Id = json_object_get(get_controller, "Id");
+        json_t *Topic = json_object_get(get_controller, "Topic");
+        zone_config_controller *controller = &controllers[num_controllers];
+
+        if (!json_is_integer(Id) || json_integer_value(Id) <= 0 || json_integer_value(Id) > INT32_MAX) {
+            fprintf(LOG_ERR(log), "error: controller %zu has no valid Id, skipping it\n", i);
+            continue;
+        }
+        controller->controller_num = (int32_t)json_integer_value(Id);
+        default_topic(controller);
+        if (json_is_string(Topic)) {
+            const char *topic = json_string_value(Topic);
+            // the done topic is subscribed to, a wildcard in it would take other controllers' acks
+            if (strlen(topic) == 0 || strlen(topic) >= CONTROLLER_TOPIC_LEN || strpbrk(topic, "+#"))
+                fprintf(LOG_ERR(log), "error: controller %d Topic %s is not a usable topic, using %s\n", controller->controller_num, topic, controller->topic);
+            else
+                snprintf(controller->topic, CONTROLLER_TOPIC_LEN, "%s", topic);
+        }
+        num_controllers++;
+    }
+
+    qsort(controllers, num_controllers, sizeof(zone_config_controller), compare_controllers);
+    int num_unique = 0;
+    for (int c = 0; c < num_controllers; c++) {
+        if (num_unique > 0 && controllers[num_unique - 1].controller_num == controllers[c].controller_num) {
+            fprintf(LOG_ERR(log), "error: controller %d is listed more than once, using topic %s\n",
+                controllers[c].controller_num, controllers[num_unique - 1].topic);
+            continue;
+        }
+        controllers[num_unique++] = controllers[c];
+    }
+    num_controllers = num_unique;
+
+    // the controllers the sections use that aren't listed, controller 0 is offline
+    size_t num_used = 0;
+    for (size_t z = 0; z < num_zones; z++) {
+        if (zones[z].controller_num > 0)
+            used[num_used++] = zones[z].controller_num;
+    }
+    qsort(used, num_used, sizeof(int32_t), compare_ids);
+    for (size_t u = 0; u < num_used; u++) {
+        zone_config_controller key = {.controller_num = used[u]};
+
+        if ((u > 0 && used[u] == used[u - 1])
+                || bsearch(&key, controllers, num_unique, sizeof(zone_config_controller), compare_controllers))
+            continue;
+        controllers[num_controllers].controller_num = used[u];
+        default_topic(&controllers[num_controllers]);
+        num_controllers++;
+    }
+    qsort(controllers, num_controllers, sizeof(zone_config_controller), compare_controllers);
+
+    free(used);
+    *controllers_out = controllers;
+    return num_controllers;
+}
+
+
+static int compile_stations(json_t *root_irr, weather_station *stations, const log_streams *log) {
+    /* the CIMIS stations with their locations for interpolation, e.g.
+       "Stations": [{"Id": "2", "Lat": 36.336, "Lon": -120.113}]
+    the stations the sections name are added as the sections are compiled */
+    json_t *Stations = json_object_get(root_irr, "Stations");
+    json_t *get_station;
+    size_t i;
+    int num_stations = 0;
+
+    json_array_foreach(Stations, i, get_station) {
+        json_t *Id = json_object_get(get_station, "Id");
+        json_t *Lat = json_object_get(get_station, "Lat");
+        json_t *Lon = json_object_get(get_station, "Lon");
+
+        if (!json_is_string(Id)) {
+            fprintf(LOG_ERR(log), "error: CIMIS station %zu has no Id, skipping it\n", i);
+            continue;
+        }
+        int s = weather_station_index(stations, &num_stations, json_string_value(Id), log);
+        if (s >= 0 && json_is_number(Lat) && json_is_number(Lon)) {
+            stations[s].lat = json_number_value(Lat);
+            stations[s].lon = json_number_value(Lon);
+            stations[s].has_location = 1;
+        }
+    }
+    return num_stations;
+}
+
+
+static void compile_zone_stations(json_t *section, weather_station *stations, int *num_stations, const char *default_station, zone_config_zone *zone,
+        const log_streams *log) {
+    /* the section's "Stations" (default_station if it names none), "Lat"/"Lon" for distance weighting and
+    "Interpolation": "nearest" to put all the weight on the closest station */
+    json_t *Section_stations = json_object_get(section, "Stations");
+    json_t *Lat = json_object_get(section, "Lat");
+    json_t *Lon = json_object_get(section, "Lon");
+    json_t *Interpolation = json_object_get(section, "Interpolation");
+    json_t *Id;
+    size_t k;
+
+    json_array_foreach(Section_stations, k, Id) {
+        if (zone->num_stations == MAX_ZONE_STATIONS) {
+            fprintf(LOG_ERR(log), "error: only the first %d stations of section %s are used\n", MAX_ZONE_STATIONS, zone->name);
+            break;
+        }
+        int s = json_is_string(Id) ? weather_station_index(stations, num_stations, json_string_value(Id), log) : -1;
+        if (s >= 0)
+            zone->station[zone->num_stations++] = s;
+    }
+    if (zone->num_stations == 0) {
+        int s = weather_station_index(stations, num_stations, default_station, log);
+        if (s >= 0)
+            zone->station[zone->num_stations++] = s;
+    }
+
+    if (json_is_number(Lat) && json_is_number(Lon)) {
+        zone->lat = json_number_value(Lat);
+        zone->lon = json_number_value(Lon);
+        zone->flags |= ZONE_HAS_LOCATION;
+    }
+    if (json_is_string(Interpolation) && strcmp(json_string_value(Interpolation), "nearest") == 0)
+        zone->flags |= ZONE_NEAREST;
+}
+
+
+static int compile_zone(json_t *section, int i, const zone_config_source *sources, int num_sources,
+        weather_station *stations, int *num_stations, const char *default_station, zone_config_zone *zone, const log_streams *log) {
+    json_t *Name = json_object_get(section, "Name");
+    json_t *EmitterGPH = json_object_get(section, "EmitterGPH");
+    json_t *Date = json_object_get(section, "Date");
+
+    memset(zone, 0, sizeof(zone_config_zone));
+    if (!json_is_object(section)) {
+        fprintf(LOG_ERR(log), "error: garden section %d is not an object\n", i);
+        return -1;
+    }
+
+    if (json_is_string(Name))
+        snprintf(zone->name, ZONE_NAME_LEN, "%s", json_string_value(Name));
+    else
+        snprintf(zone->name, ZONE_NAME_LEN, "section %d", i);
+
+    zone->PF = json_float(json_object_get(section, "PF"));
+    zone->LA = json_float(json_object_get(section, "LA"));
+    zone->gallons = json_float(json_object_get(section, "Gallons"));
+    zone->relay_num = json_integer_value(json_object_get(section, "Relay"));
+    zone->controller_num = json_integer_value(json_object_get(section, "Controller"));
+
+    // drip emitters are 1 gal/hr unless the section says otherwise
+    float emitter_gph = json_is_number(EmitterGPH) ? (float)json_number_value(EmitterGPH) : 1.0;
+    zone->flow_gph = json_integer_value(json_object_get(section, "numEmitters")) * emitter_gph;
+    zone->source = compile_source_index(section, sources, num_sources, log);
+
+    // root zone water holding, a foot of loam managed at 50% depletion unless the section says otherwise
+    json_t *RootDepth = json_object_get(section, "RootDepth");
+    json_t *AWC = json_object_get(section, "AWC");
+    json_t *MAD = json_object_get(section, "MAD");
+    zone->root_depth = json_is_number(RootDepth) ? (float)json_number_value(RootDepth) : ZONE_DEFAULT_ROOT_DEPTH;
+    zone->awc = json_is_number(AWC) ? (float)json_number_value(AWC) : ZONE_DEFAULT_AWC;
+    zone->mad = json_is_number(MAD) ? (float)json_number_value(MAD) : ZONE_DEFAULT_MAD;
+
+    // "YYYY-MM-DD HH:MM:SS", only the day matters for the demand window
+    zone->last_watered_day = cimis_epoch_day(json_string_value(Date));
+    if (zone->last_watered_day < 0) {
+        fprintf(LOG_ERR(log), "error: section %s has no valid Date of its last watering\n", zone->name);
+        return -1;
+    }
+
+    compile_zone_stations(section, stations, num_stations, default_station, zone, log);
+    return 0;
+}
+
+
+int zone_config_compile(const char *json_path, const char *path, const char *default_station, const log_streams *log) {
+    /* write to a temporary file and rename it over the binary so a mapping never sees half a file */
+    zone_config_header header;
+    zone_config_source sources[MAX_WATER_SOURCES];
+    zone_config_station station_records[MAX_STATIONS];
+    zone_config_controller *controllers = NULL;
+    weather_station *stations;
+    json_error_t error_irr;
+    char tmp_path[80];
+    int status = -1;
+
+    memset(&header, 0, sizeof(header));
+    memset(sources, 0, sizeof(sources));
+    memset(station_records, 0, sizeof(station_records));
+    if (json_stamp(json_path, &header.json_mtime_ns, &header.json_size) != 0) {
+        fprintf(LOG_ERR(log), "error: cannot find %s\n", json_path);
+        return -1;
+    }
+    snprintf(header.default_station, sizeof(header.default_station), "%s", default_station);
+
+    json_t *root_irr = json_load_file(json_path, 0, &error_irr);
+    if (!root_irr) {
+        fprintf(LOG_OUT(log), "Could not open irrigation file %s\n", json_path);
+        fprintf(LOG_ERR(log), "ERROR: on line %d: %s\n", error_irr.line, error_irr.text);
+        return -1;
+    }
+    json_t *Data = json_object_get(root_irr, "Data");
+    if (!json_is_array(Data)) {
+        fprintf(LOG_ERR(log), "error: Data is not an array\n");
+        json_decref(root_irr);
+        return -1;
+    }
+
+    size_t num_zones = json_array_size(Data);
+    zone_config_zone *zones = calloc(num_zones + 1, sizeof(zone_config_zone));
+    stations = calloc(MAX_STATIONS, sizeof(weather_station));
+    if (!zones || !stations) {
+        fprintf(LOG_ERR(log), "error: unable to allocate %zu garden sections\n", num_zones);
+        goto done;
+    }
+
+    int num_sources = compile_sources(root_irr, sources, log);
+    int num_stations = compile_stations(root_irr, stations, log);
+    for (size_t i = 0; i < num_zones; i++) {
+        if (compile_zone(json_array_get(Data, i), (int)i, sources, num_sources, stations, &num_stations, default_station, &zones[i], log) != 0)
+            goto done;
+    }
+    int num_controllers = compile_controllers(root_irr, zones, num_zones, &controllers, log);
+    if (num_controllers < 0)
+        goto done;
+    for (int s = 0; s < num_stations; s++) {
+        snprintf(station_records[s].id, CIMIS_STATION_LEN, "%s", stations[s].id);
+        station_records[s].lat = stations[s].lat;
+        station_records[s].lon = stations[s].lon;
+        station_records[s].has_location = stations[s].has_location;
+    }
+
+    memcpy(header.magic, config_magic, 4);
+    header.version = ZONE_CONFIG_VERSION;
+    header.zone_size = sizeof(zone_config_zone);
+    header.num_sources = num_sources;
+    header.num_stations = num_stations;
+    header.num_zones = (int32_t)num_zones;
+    header.num_controllers = num_controllers;
+
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    FILE *config_file = fopen(tmp_path, "wb");
+    if (config_file == NULL) {
+        fprintf(LOG_ERR(log), "error: cannot write %s\n", tmp_path);
+        goto done;
+    }
+    if (fwrite(&header, sizeof(header), 1, config_file) != 1
+            || fwrite(sources, sizeof(zone_config_source), num_sources, config_file) != (size_t)num_sources
+            || fwrite(station_records, sizeof(zone_config_station), num_stations, config_file) != (size_t)num_stations
+            || fwrite(controllers, sizeof(zone_config_controller), num_controllers, config_file) != (size_t)num_controllers
+            || fwrite(zones, sizeof(zone_config_zone), num_zones, config_file) != num_zones) {
+        fprintf(LOG_ERR(log), "error: cannot write %s\n", tmp_path);
+        fclose(config_file);
+        remove(tmp_path);
+        goto done;
+    }
+    if (fclose(config_file) != 0 || rename(tmp_path, path) != 0) {
+        fprintf(LOG_ERR(log), "error: cannot replace %s\n", path);
+        remove(tmp_path);
+        goto done;
+    }
+
+    fprintf(LOG_OUT(log), "Compiled %zu garden sections on %d controllers from %s into %s\n", num_zones, num_controllers, json_path, path);
+    status = 0;
+
+done:
+    free(controllers);
+    free(zones);
+    free(stations);
+    json_decref(root_irr);
+    return status;
+}
+
+
+static int map_config(zone_config *config) {
+    /* map the binary and check it was compiled by this version from the current JSON; 1 if it has to be recompiled */
+    const log_streams *log = config->log;
+    int64_t mtime_ns, size;
+    struct stat config_stat;
+
+    int fd = open(config->path, O_RDONLY);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &config_stat) != 0 || (size_t)config_stat.st_size < sizeof(zone_config_header)) {
+        close(fd);
+        return 1;
+    }
+
+    void *map = mmap(NULL, config_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);   // the mapping keeps the file
+    if (map == MAP_FAILED) {
+        fprintf(LOG_ERR(log), "error: cannot map %s\n", config->path);
+        return -1;
+    }
+
+    const zone_config_header *header = (const zone_config_header *)map;
+    size_t expected = sizeof(zone_config_header);
+    int valid = memcmp(header->magic, config_magic, 4) == 0 && header->version == ZONE_CONFIG_VERSION
+        && header->zone_size == sizeof(zone_config_zone) && header->num_sources > 0 && header->num_sources <= MAX_WATER_SOURCES
+        && header->num_stations >= 0 && header->num_stations <= MAX_STATIONS && header->num_zones >= 0
+        && header->num_controllers >= 0
+        && strncmp(header->default_station, config->default_station, CIMIS_STATION_LEN) == 0;
+    if (valid) {
+        expected += header->num_sources * sizeof(zone_config_source) + header->num_stations * sizeof(zone_config_station)
+            + (size_t)header->num_controllers * sizeof(zone_config_controller) + (size_t)header->num_zones * sizeof(zone_config_zone);
+        valid = expected == (size_t)config_stat.st_size;
+    }
+    if (valid && json_stamp(config->json_path, &mtime_ns, &size) == 0)
+        valid = mtime_ns == header->json_mtime_ns && size == header->json_size;
+
+    if (!valid) {
+        munmap(map, config_stat.st_size);
+        return 1;
+    }
+
+    config->map = map;
+    config->map_size = config_stat.st_size;
+    config->header = header;
+    config->sources = (const zone_config_source *)(header + 1);
+    config->stations = (const zone_config_station *)(config->sources + header->num_sources);
+    config->controllers = (const zone_config_controller *)(config->stations + header->num_stations);
+    config->zones = (const zone_config_zone *)(config->controllers + header->num_controllers);
+    config->num_sources = header->num_sources;
+    config->num_stations = header->num_stations;
+    config->num_controllers = header->num_controllers;
+    config->num_zones = header->num_zones;
+    return 0;
+}
+
+
+int zone_config_open(zone_config *config, const char *json_path, const char *path, const char *default_station, const log_streams *log) {
+    memset(config, 0, sizeof(zone_config));
+    config->log = log;
+    snprintf(config->json_path, sizeof(config->json_path), "%s", json_path);
+    snprintf(config->path, sizeof(config->path), "%s", path);
+    snprintf(config->default_station, sizeof(config->default_station), "%s", default_station);
+
+    int status = map_config(config);
+    if (status == 1) {
+        // missing, from another version, for another default station or the JSON was edited since
+        if (zone_config_compile(json_path, path, default_station, log) != 0)
+            return -1;
+        status = map_config(config);
+    }
+    if (status != 0) {
+        fprintf(LOG_ERR(log), "error: %s is not a usable version %d zone configuration\n", path, ZONE_CONFIG_VERSION);
+        return -1;
+    }
+    return 0;
+}
+
+
+int zone_config_stale(const zone_config *config) {
+    int64_t mtime_ns, size;
+
+    if (!config->map || json_stamp(config->json_path, &mtime_ns, &size) != 0)
+        return 1;
+    return mtime_ns != config->header->json_mtime_ns || size != config->header->json_size
+        || strncmp(config->header->default_station, config->default_station, CIMIS_STATION_LEN) != 0;
+}
+
+
+void zone_config_close(zone_config *config) {
+    if (config->map)
+        munmap(config->map, config->map_size);
+    config->map = NULL;
+    config->header = NULL;
+    config->sources = NULL;
+    config->stations = NULL;
+    config->controllers = NULL;
+    config->zones = NULL;
+    config->num_sources = config->num_stations = config->num_controllers = config->num_zones = 0;
+}
+
+
+int zone_config_sources(const zone_config *config, water_source *sources) {
+    for (int s = 0; s < config->num_sources; s++) {
+        memset(&sources[s], 0, sizeof(water_source));
+        memcpy(sources[s].name, config->sources[s].name, WATER_SOURCE_NAME_LEN);
+        sources[s].name[WATER_SOURCE_NAME_LEN - 1] = '\0';
+        sources[s].max_gph = config->sources[s].max_gph;
+    }
+    return config->num_sources;
+}
+
+
+int zone_config_stations(const zone_config *config, weather_station *stations) {
+    for (int s = 0; s < config->num_stations; s++) {
+        memset(&stations[s], 0, sizeof(weather_station));
+        memcpy(stations[s].id, config->stations[s].id, CIMIS_STATION_LEN);
+        stations[s].id[CIMIS_STATION_LEN - 1] = '\0';
+        stations[s].lat = config->stations[s].lat;
+        stations[s].lon = config->stations[s].lon;
+        stations[s].has_location = config->stations[s].has_location;
+    }
+    return config->num_stations;
+}
+
+
+void zone_config_fill(const zone_config *config, const weather_station *stations, zone_table *zones, zone_weather *weather) {
+    /* the compiled records are already numbers, filling the table is a copy per field */
+    for (int i = 0; i < config->num_zones; i++) {
+        const zone_config_zone *record = &config->zones[i];
+
+        zones->name[i] = record->name;
+        zones->relay_num[i] = record->relay_num;
+        zones->controller_num[i] = record->controller_num;
+        zones->flow_gph[i] = record->flow_gph;
+        zones->source[i] = record->source;
+        zones->PF[i] = record->PF;
+        zones->LA[i] = record->LA;
+        zones->taw[i] = record->root_depth * record->awc * record->LA * INCHES_TO_GALLONS_PER_FT2;
+        zones->mad[i] = record->mad;
+
+        // the section's weather, from its nearest station or weighted between its stations
+        weather[i].num_stations = record->num_stations;
+        for (int k = 0; k < record->num_stations; k++)
+            weather[i].station[k] = record->station[k];
+        zone_weather_weights(&weather[i], stations, record->flags & ZONE_HAS_LOCATION, record->lat, record->lon,
+            (record->flags & ZONE_NEAREST) ? WEIGHT_NEAREST : WEIGHT_IDW);
+    }
+}
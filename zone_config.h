@@ -0,0 +1,140 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+compiled zone configuration. irrigation_log.json stays the file people edit, it is compiled into
+irrigation_log.bin: a versioned header followed by fixed size source, station, controller and section records with
+plain numbers (PF, LA, gallons) and day numbers for the last watering date. The runner maps the binary
+read-only and fills the zone table straight from it, the JSON is only parsed again when it changes
+(its size and modification time are stamped in the header).
+*/
+
+#ifndef ZONE_CONFIG_H
+#define ZONE_CONFIG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "scheduler.h"
+#include "weather.h"
+#include "zone_table.h"
+#include "log_streams.h"
+
+#define ZONE_CONFIG_VERSION 4
+#define ZONE_NAME_LEN 48
+#define CONTROLLER_TOPIC_LEN 56
+#define CONTROLLER_TOPIC_PREFIX "irrigation"   // controllers without a "Topic" use irrigation/<id>
+
+#define ZONE_DEFAULT_ROOT_DEPTH 12.f   // in inches
+#define ZONE_DEFAULT_AWC 0.15f         // in/in, loam
+#define ZONE_DEFAULT_MAD 0.5f
+
+enum { ZONE_HAS_LOCATION = 0x1, ZONE_NEAREST = 0x2 };
+
+// on-disk layout (native byte order, the binary is a local cache of the JSON), every record is a multiple of 8 bytes
+typedef struct zone_config_header {
+    char magic[4];
+    uint16_t version;
+    uint16_t zone_size;        // sizeof(zone_config_zone), catches layout changes
+    int64_t json_mtime_ns;     // modification time of the JSON the file was compiled from
+    int64_t json_size;
+    char default_station[CIMIS_STATION_LEN];  // of the sections that name none, the binary is only valid for it
+    int32_t num_sources;
+    int32_t num_stations;
+    int32_t num_zones;
+    int32_t num_controllers;
+} zone_config_header;
+
+typedef struct zone_config_source {
+    char name[WATER_SOURCE_NAME_LEN];
+    float max_gph;
+    float reserved;
+} zone_config_source;
+
+typedef struct zone_config_station {
+    char id[CIMIS_STATION_LEN];
+    double lat;
+    double lon;
+    int32_t has_location;
+    int32_t reserved;
+} zone_config_station;
+
+typedef struct zone_config_controller {
+    char topic[CONTROLLER_TOPIC_LEN];  // base topic, commands go out on <topic>/cmd and acks come back on <topic>/done
+    int32_t controller_num;
+    int32_t reserved;
+} zone_config_controller;
+
+typedef struct zone_config_zone {
+    double lat;                // section location for station weighting, only used with ZONE_HAS_LOCATION
+    double lon;
+    char name[ZONE_NAME_LEN];
+    float PF;
+    float LA;                  // in ft^2
+    float flow_gph;            // numEmitters * EmitterGPH
+    float gallons;             // amount applied at the last watering
+    int32_t last_watered_day;  // day number since 1970-01-01 of the last watering
+    int32_t relay_num;
+    int32_t controller_num;
+    int32_t source;            // index into the source records
+    float root_depth;          // in inches, depth of the root zone
+    float awc;                 // in inches of water per inch of soil, available water capacity
+    float mad;                 // fraction of the available water allowed to deplete before watering
+    int16_t station[MAX_ZONE_STATIONS];  // indexes into the station records
+    uint8_t num_stations;
+    uint8_t flags;             // ZONE_HAS_LOCATION, ZONE_NEAREST
+    uint8_t reserved[2];
+} zone_config_zone;
+
+typedef struct zone_config {
+    char json_path[64];
+    char path[64];
+    char default_station[CIMIS_STATION_LEN];
+    void *map;                 // read-only mapping of the whole binary
+    size_t map_size;
+    const zone_config_header *header;
+    const zone_config_source *sources;
+    const zone_config_station *stations;
+    const zone_config_controller *controllers;
+    const zone_config_zone *zones;
+    int num_sources;
+    int num_stations;
+    int num_controllers;
+    int num_zones;
+    const log_streams *log;    // where its messages go, and those of the route table built from it
+} zone_config;
+
+// parse json_path and write the binary to path (through a temporary file); default_station is used by the
+// sections that name no CIMIS station
+int zone_config_compile(const char *json_path, const char *path, const char *default_station, const log_streams *log);
+
+// map path read-only, compiling it first when it is missing, from another version, older than json_path or
+// compiled for another default_station
+int zone_config_open(zone_config *config, const char *json_path, const char *path, const char *default_station, const log_streams *log);
+// 1 when json_path or the default station no longer match the mapped binary
+int zone_config_stale(const zone_config *config);
+void zone_config_close(zone_config *config);
+
+// copy the sources and stations into the runtime tables, returns how many
+int zone_config_sources(const zone_config *config, water_source *sources);
+int zone_config_stations(const zone_config *config, weather_station *stations);
+
+// copy every section's plants, soil, relay and station weights into the first config->num_zones rows of a table
+// that already fits them; the balance columns (depletion, last_day) are left to the caller
+void zone_config_fill(const zone_config *config, const weather_station *stations, zone_table *zones, zone_weather *weather);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "zone_table.h"
+
+#define MS_PER_HOUR 3600000.f
+
+
+static float *alloc_column(int capacity) {
+    /* aligned and zeroed so the padding lanes compute a demand of 0 */
+    float *column = aligned_alloc(ZONE_ALIGN, capacity * sizeof(float));
+    if (column)
+        memset(column, 0, capacity * sizeof(float));
+    return column;
+}
+
+
+static float *grow_column(float *old, int old_capacity, int capacity) {
+    float *column = alloc_column(capacity);
+    if (column && old)
+        memcpy(column, old, old_capacity * sizeof(float));
+    free(old);
+    return column;
+}
+
+
+static void *grow_array(void *old, size_t element_size, int old_capacity, int capacity) {
+    void *array = calloc(capacity, element_size);
+    if (array && old)
+        memcpy(array, old, old_capacity * element_size);
+    free(old);
+    return array;
+}
+
+
+int zone_table_init(zone_table *table, int num_zones) {
+    memset(table, 0, sizeof(zone_table));
+    return zone_table_resize(table, num_zones);
+}
+
+
+int zone_table_resize(zone_table *table, int num_zones) {
+    if (num_zones > table->capacity) {
+        // round up to whole SIMD batches (and always at least one)
+        int old_capacity = table->capacity;
+        int capacity = ((num_zones + ZONE_LANES - 1) / ZONE_LANES) * ZONE_LANES;
+        if (capacity == 0)
+            capacity = ZONE_LANES;
+        if (old_capacity == 0) {
+            table->effective_precip = EFFECTIVE_PRECIP_FRACTION;
+            table->drip_efficiency = DRIP_EFFICIENCY;
+        }
+
+        table->eto = grow_column(table->eto, old_capacity, capacity);
+        table->precip = grow_column(table->precip, old_capacity, capacity);
+        table->PF = grow_column(table->PF, old_capacity, capacity);
+        table->LA = grow_column(table->LA, old_capacity, capacity);
+        table->taw = grow_column(table->taw, old_capacity, capacity);
+        table->mad = grow_column(table->mad, old_capacity, capacity);
+        table->flow_gph = grow_column(table->flow_gph, old_capacity, capacity);
+        table->depletion = grow_column(table->depletion, old_capacity, capacity);
+        table->last_day = grow_array(table->last_day, sizeof(int32_t), old_capacity, capacity);
+        table->water_demand = grow_column(table->water_demand, old_capacity, capacity);
+        table->runtime_ms = grow_column(table->runtime_ms, old_capacity, capacity);
+        table->name = grow_array((void *)table->name, sizeof(const char *), old_capacity, capacity);
+        table->relay_num = grow_array(table->relay_num, sizeof(long), old_capacity, capacity);
+        table->controller_num = grow_array(table->controller_num, sizeof(long), old_capacity, capacity);
+        table->source = grow_array(table->source, sizeof(int), old_capacity, capacity);
+        table->capacity = capacity;
+
+        if (!table->eto || !table->precip || !table->PF || !table->LA || !table->taw || !table->mad || !table->flow_gph
+                || !table->depletion || !table->last_day || !table->water_demand || !table->runtime_ms || !table->name || !table->relay_num
+                || !table->controller_num || !table->source) {
+            fprintf(stderr, "error: unable to allocate a zone table for %d sections\n", num_zones);
+            zone_table_free(table);
+            return -1;
+        }
+    }
+
+    // sections dropped by a smaller resize must not leave stale values in the padding lanes
+    for (int i = num_zones; i < table->num_zones && i < table->capacity; i++) {
+        table->eto[i] = table->precip[i] = table->PF[i] = table->LA[i] = table->taw[i] = table->mad[i] = 0.f;
+        table->flow_gph[i] = table->depletion[i] = 0.f;
+    }
+    table->num_zones = num_zones;
+    return 0;
+}
+
+
+void zone_table_free(zone_table *table) {
+    free(table->eto);
+    free(table->precip);
+    free(table->PF);
+    free(table->LA);
+    free(table->taw);
+    free(table->mad);
+    free(table->flow_gph);
+    free(table->depletion);
+    free(table->last_day);
+    free(table->water_demand);
+    free(table->runtime_ms);
+    free((void *)table->name);
+    free(table->relay_num);
+    free(table->controller_num);
+    free(table->source);
+    memset(table, 0, sizeof(zone_table));
+}
+
+
+#if defined(__GNUC__)
+
+// GCC/Clang vector extensions, lowered to AVX, SSE or NEON by the compiler for whatever the target has
+typedef float zone_vec __attribute__((vector_size(ZONE_LANES * sizeof(float))));
+typedef int32_t zone_mask __attribute__((vector_size(ZONE_LANES * sizeof(float))));
+
+void zone_balance_kernel(zone_table *table) {
+    const zone_vec zero = {0};
+    const zone_vec to_gallons = zero + INCHES_TO_GALLONS_PER_FT2;
+    const zone_vec effective = zero + table->effective_precip;
+
+    for (int i = 0; i < table->num_zones; i += ZONE_LANES) {
+        zone_vec PF = *(const zone_vec *)(table->PF + i);
+        zone_vec LA = *(const zone_vec *)(table->LA + i);
+        zone_vec eto = *(const zone_vec *)(table->eto + i);
+        zone_vec precip = *(const zone_vec *)(table->precip + i);
+        zone_vec taw = *(const zone_vec *)(table->taw + i);
+        zone_vec depletion = *(const zone_vec *)(table->depletion + i);
+
+        depletion += (eto * PF - precip * effective) * LA * to_gallons;
+        // rain past field capacity drains or runs off, and the plants can't use more than the root zone holds
+        depletion = (zone_vec)((zone_mask)depletion & (depletion > zero));
+        zone_mask over = depletion > taw;
+        depletion = (zone_vec)(((zone_mask)depletion & ~over) | ((zone_mask)taw & over));
+
+        *(zone_vec *)(table->depletion + i) = depletion;
+    }
+}
+
+
+void zone_demand_kernel(zone_table *table) {
+    const zone_vec zero = {0};
+    const zone_vec one = zero + 1.f;
+    const zone_vec runtime_factor = zero + MS_PER_HOUR / table->drip_efficiency;
+
+    for (int i = 0; i < table->num_zones; i += ZONE_LANES) {
+        zone_vec depletion = *(const zone_vec *)(table->depletion + i);
+        zone_vec taw = *(const zone_vec *)(table->taw + i);
+        zone_vec mad = *(const zone_vec *)(table->mad + i);
+        zone_vec flow = *(const zone_vec *)(table->flow_gph + i);
+
+        // refill the root zone once the depletion reaches the threshold, nothing before
+        zone_mask due = (depletion >= mad * taw) & (depletion > zero);
+        zone_vec demand = (zone_vec)((zone_mask)depletion & due);
+
+        // sections without emitters get no runtime instead of a division by zero
+        zone_mask has_flow = flow > zero;
+        zone_vec safe_flow = (zone_vec)(((zone_mask)flow & has_flow) | ((zone_mask)one & ~has_flow));
+        zone_vec runtime = (zone_vec)((zone_mask)(demand * runtime_factor / safe_flow) & has_flow);
+
+        *(zone_vec *)(table->water_demand + i) = demand;
+        *(zone_vec *)(table->runtime_ms + i) = runtime;
+    }
+}
+
+#else
+
+void zone_balance_kernel(zone_table *table) {
+    for (int i = 0; i < table->num_zones; i++) {
+        float depletion = table->depletion[i] + table->eto[i] * table->PF[i] * table->LA[i] * INCHES_TO_GALLONS_PER_FT2
+            - table->precip[i] * table->effective_precip * table->LA[i] * INCHES_TO_GALLONS_PER_FT2;
+        depletion = depletion > 0.f ? depletion : 0.f;
+        table->depletion[i] = depletion < table->taw[i] ? depletion : table->taw[i];
+    }
+}
+
+
+void zone_demand_kernel(zone_table *table) {
+    for (int i = 0; i < table->num_zones; i++) {
+        int due = table->depletion[i] > 0.f && table->depletion[i] >= table->mad[i] * table->taw[i];
+        table->water_demand[i] = due ? table->depletion[i] : 0.f;
+        table->runtime_ms[i] = table->flow_gph[i] > 0.f ? table->water_demand[i] * (MS_PER_HOUR / table->drip_efficiency) / table->flow_gph[i] : 0.f;
+    }
+}
+
+#endif
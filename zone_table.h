@@ -0,0 +1,86 @@
+/*
+Automated home irrigation based on weather data provided by CIMIS weather stations (https://cimis.water.ca.gov/Default.aspx).
+Copyright (C) 2024  Natalie C. Pueyo Svoboda
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+
+heap allocated table of garden sections stored as one array per field (structure of arrays), so the
+daily root zone water balance step and the water demand and relay runtime of every section are computed
+in vectorized passes over contiguous floats instead of one struct at a time. The numeric columns are
+padded to a whole number of SIMD lanes and aligned, the kernels never need a scalar tail.
+*/
+
+#ifndef ZONE_TABLE_H
+#define ZONE_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ZONE_LANES 8          // floats per SIMD batch (AVX width, two NEON/SSE registers)
+#define ZONE_ALIGN 32
+
+// coefficients of the SLIDE demand calculation, the last two are the defaults of every new table
+#define INCHES_TO_GALLONS_PER_FT2 0.623f   // 1 inch of water over 1 ft^2 in gallons
+#define EFFECTIVE_PRECIP_FRACTION 0.5f     // share of the rain that reaches the roots
+#define DRIP_EFFICIENCY 0.7f               // drip irrigation is not 100% effective, but better than flood
+
+typedef struct zone_table {
+    int num_zones;
+    int capacity;        // multiple of ZONE_LANES
+
+    // model coefficients for every section, EFFECTIVE_PRECIP_FRACTION and DRIP_EFFICIENCY unless changed (--sweep)
+    float effective_precip;
+    float drip_efficiency;
+
+    // one day of weather, input of the balance kernel
+    float *eto;          // in inches, the section's ETo for the day (0 for sections not advancing)
+    float *precip;       // in inches, the section's precipitation for the day
+
+    // soil and plants
+    float *PF;           // combined water demand determined by the types of plants being watered
+    float *LA;           // in ft^2, the area the garden section takes up
+    float *taw;          // in gallons, total available water the root zone holds at field capacity
+    float *mad;          // fraction of taw allowed to deplete before the section is watered
+    float *flow_gph;     // in gal/hr, the flow drawn while the section is on
+
+    // root zone water balance, kept between days
+    float *depletion;    // in gallons, water used from the root zone since it was at field capacity
+    int32_t *last_day;   // day number of the last day of weather in depletion
+
+    // outputs of the demand kernel
+    float *water_demand; // in gallons, the depletion once it reaches mad * taw, 0 before
+    float *runtime_ms;   // in msec, how long the relay has to stay on to refill the root zone
+
+    // per section data the kernels don't touch
+    const char **name;
+    long *relay_num;
+    long *controller_num;
+    int *source;         // index into the water source table
+} zone_table;
+
+int zone_table_init(zone_table *table, int num_zones);
+// grow (keeping the contents) so at least num_zones fit, and set num_zones; a table's first allocation also sets the
+// default coefficients
+int zone_table_resize(zone_table *table, int num_zones);
+void zone_table_free(zone_table *table);
+
+// one day of the balance: depletion += (ETo * PF - precip * effective_precip) * LA * 0.623, kept within [0, taw]
+void zone_balance_kernel(zone_table *table);
+
+// water_demand = depletion once it reaches the section's threshold (mad * taw), 0 before
+// runtime_ms = the time the section's emitters need to deliver water_demand to the roots at drip_efficiency
+void zone_demand_kernel(zone_table *table);
+
+#endif